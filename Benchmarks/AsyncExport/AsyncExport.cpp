@@ -0,0 +1,59 @@
+#include "../../Drawing++.hpp"
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <string>
+
+static const unsigned frames = 48;
+
+//moving translucent squares over background image
+static void renderFrame(Drawing::Canvas& canvas, Drawing::ImageFile& background, unsigned frame){
+    canvas.initBuffer();
+    background.drawFn(&background, &canvas);
+    for (unsigned i=0; i<20; i++){
+        const double x = (frame*7 + i*37) % 448, y = (frame*3 + i*53) % 448;
+        Drawing::Figure square(Drawing::Color(i%3 == 0, i%3 == 1, i%3 == 2, 0.5), 
+            Drawing::rect_filled, 
+            std::vector<Drawing::Point>{ Drawing::Point({x, y}), Drawing::Point({x+64, y+64}) });
+        square.drawFn(&square, &canvas);
+    }
+}
+
+static std::string framePath(const std::string& directory, unsigned frame){
+    return directory + "/frame_" + std::to_string(frame) + ".png";
+}
+
+int main(int argc, char** argv){
+    using clock = std::chrono::steady_clock;
+    const std::string directory = argc > 1 ? argv[1] : ".";
+
+    //run from Benchmarks/AsyncExport
+    Drawing::ImageFile background("../../Examples/LoadPNG/Lenna_(test_image).png");
+    Drawing::Canvas canvas(512, 512);
+
+    std::cout << std::left << std::setw(12) << "encoders" << std::setw(12) << "frames/s" << "\n";
+
+    auto start = clock::now();
+    for (unsigned frame=0; frame<frames; frame++){
+        renderFrame(canvas, background, frame);
+        canvas.bufferToFile(framePath(directory, frame).c_str());
+    }
+    double seconds = std::chrono::duration<double>(clock::now() - start).count();
+    std::cout << std::setw(12) << "sync" << std::setw(12) << frames/seconds << "\n";
+
+    const unsigned encoderCounts[] = {1, 2, 4, 8};
+    for (unsigned encoders : encoderCounts){
+        start = clock::now();
+        {
+            Drawing::AsyncExporter exporter(encoders, encoders*2);
+            for (unsigned frame=0; frame<frames; frame++){
+                renderFrame(canvas, background, frame);
+                exporter.submit(canvas, framePath(directory, frame));
+            }
+            exporter.flush();
+        }
+        seconds = std::chrono::duration<double>(clock::now() - start).count();
+        std::cout << std::setw(12) << encoders << std::setw(12) << frames/seconds << "\n";
+    }
+    return 0;
+}
@@ -0,0 +1,444 @@
+#include "../../Drawing++.hpp"
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <random>
+
+//usage: Checks [--filter text]
+//invariants promised by fast paths, every check compares them against a plain reference
+//(serial draw, full draw, full compare...); exit code is the number of failed checks
+
+class Checks {
+    public:
+        Checks(const std::string& filter) : m_filter(filter) {}
+
+        //fn returns true when invariant holds
+        template<typename Fn>
+        void run(const std::string& name, Fn fn){
+            if (!m_filter.empty() && name.find(m_filter) == std::string::npos) return;
+            const auto start = std::chrono::steady_clock::now();
+            const bool passed = fn();
+            const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            m_failed += !passed;
+            std::cout << std::left << std::setw(32) << name << (passed ? "ok    " : "FAILED")
+                << std::right << std::fixed << std::setprecision(3) << std::setw(10) << seconds << " s\n";
+        }
+
+        int getFailed(void) const { return m_failed; }
+
+    private:
+        std::string m_filter;
+        int m_failed = 0;
+};
+
+//same pixels in [width x height] window of a at (ax, ay) and of b at (bx, by)
+static bool sameWindow(const Drawing::Canvas& a, png_uint_32 ax, png_uint_32 ay,
+    const Drawing::Canvas& b, png_uint_32 bx, png_uint_32 by, png_uint_32 width, png_uint_32 height){
+
+    const size_t pixelSize = a.getBuffer().getPixelSize();
+    for (png_uint_32 y=0; y<height; y++){
+        if (memcmp(a.getBuffer().getRow(ay+y) + ax*pixelSize,
+            b.getBuffer().getRow(by+y) + bx*pixelSize, width*pixelSize) != 0) return false;
+    }
+    return true;
+}
+
+static bool samePixels(const Drawing::Canvas& a, const Drawing::Canvas& b){
+    return a.getWidth() == b.getWidth() && a.getHeight() == b.getHeight()
+        && sameWindow(a, 0, 0, b, 0, 0, a.getWidth(), a.getHeight());
+}
+
+static Drawing::Figure makeRect(double x, double y, double size, const Drawing::Color& color){
+    return Drawing::Figure(color, Drawing::rect_filled,
+        { Drawing::Point({x, y}), Drawing::Point({x + size, y + size}) });
+}
+
+static Drawing::Figure makeTriangle(const Drawing::Point2d& a, const Drawing::Point2d& b,
+    const Drawing::Point2d& c, const Drawing::Color& color){
+
+    return Drawing::Figure(color, Drawing::triangle_filled,
+        { Drawing::Point(a), Drawing::Point(b), Drawing::Point(c) });
+}
+
+//triangles reaching left of or above canvas draw the same pixels as the visible part of
+//the triangle moved onto a larger canvas; vertices are halves so moving them is exact
+static bool offscreenTriangles(void){
+    const png_uint_32 size = 64, margin = 64;
+    const Drawing::Point2d triangles[][3] = {
+        {{{10, -50}}, {{30, -40}}, {{20, -20}}},   //above
+        {{{-50, 10}}, {{-40, 30}}, {{-20, 20}}},   //left
+        {{{-20.5, 10}}, {{40, -30.5}}, {{30, 50}}}, //partly above and left
+        {{{-30, -30}}, {{90.5, 20}}, {{10, 100}}}   //around canvas
+    };
+    const Drawing::Color color(0.2, 0.6, 0.9, 0.5);
+
+    for (const auto& triangle : triangles){
+        Drawing::Canvas canvas(size, size), moved(size+2*margin, size+2*margin);
+        canvas.initBuffer();
+        moved.initBuffer();
+        canvas.addDrawable(makeTriangle(triangle[0], triangle[1], triangle[2], color));
+
+        Drawing::Point2d shifted[3];
+        for (int i=0; i<3; i++) shifted[i] = {{triangle[i].x() + margin, triangle[i].y() + margin}};
+        moved.addDrawable(makeTriangle(shifted[0], shifted[1], shifted[2], color));
+
+        for (unsigned threads : {1u, 4u}){
+            canvas.setThreadCount(threads);
+            canvas.initBuffer();
+            canvas.draw();
+            moved.draw();
+            if (!sameWindow(canvas, 0, 0, moved, margin, margin, size, size)) return false;
+            moved.initBuffer();
+        }
+    }
+    return true;
+}
+
+//moved drawables redrawn by redrawRegion over pixels left by a translucent Copy blit
+//give the same pixels as initBuffer and draw of the changed scene
+static bool redrawRegion(void){
+    const png_uint_32 size = 256;
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<double> unit(0.0, 1.0), pos(-16.0, size);
+
+    Drawing::FrameBuffer translucent(size, size, 4);
+    for (png_uint_32 y=0; y<size; y++){
+        png_bytep row = translucent.getRow(y);
+        for (png_uint_32 x=0; x<4*size; x++) row[x] = rng();
+    }
+
+    for (Drawing::BlendMode mode : {Drawing::BlendMode::Legacy, Drawing::BlendMode::Over}){
+        Drawing::Canvas canvas(size, size);
+        canvas.setBlendMode(mode);
+        canvas.setThreadCount(1);
+        for (int i=0; i<300; i++){
+            const Drawing::Color color(unit(rng), unit(rng), unit(rng), i%3 ? 0.5 : 1.0);
+            canvas.addDrawable(makeRect(pos(rng), pos(rng), 4 + unit(rng)*40, color));
+        }
+        canvas.initBuffer();
+        canvas.draw();
+        canvas.blit(translucent, Drawing::Rect(0, 0, size/2, size/2), size/4, size/4, Drawing::BlitMode::Copy);
+        canvas.redrawRegion(Drawing::Rect(size/4, size/4, 3*size/4, 3*size/4));
+
+        for (int i=0; i<50; i++){
+            const unsigned index = rng() % canvas.getDrawablesSize();
+            Drawing::Rect oldBounds, newBounds;
+            canvas.getDrawableBounds(index, oldBounds);
+            canvas.setDrawable(makeRect(pos(rng), pos(rng), 4 + unit(rng)*40, 
+                Drawing::Color(unit(rng), unit(rng), unit(rng), 0.5)), index);
+            canvas.getDrawableBounds(index, newBounds);
+            canvas.redrawRegion(oldBounds);
+            canvas.redrawRegion(newBounds);
+        }
+
+        Drawing::Canvas reference(size, size);
+        reference.setBlendMode(mode);
+        reference.setThreadCount(1);
+        for (unsigned i=0; i<canvas.getDrawablesSize(); i++) reference.addDrawable(canvas.copyDrawable(i));
+        reference.initBuffer();
+        reference.draw();
+        if (!samePixels(canvas, reference)) return false;
+    }
+    return true;
+}
+
+//same pixels as canvas, rows read from tiles
+static bool sameTiled(Drawing::TiledCanvas& tiled, const Drawing::Canvas& canvas){
+    std::vector<png_byte> row((size_t) tiled.getWidth()*4);
+    for (png_uint_32 y=0; y<tiled.getHeight(); y++){
+        tiled.readRow(y, row.data());
+        if (memcmp(row.data(), canvas.getBuffer().getRow(y), row.size()) != 0) return false;
+    }
+    return true;
+}
+
+//draw, addDrawable, draw renders every command once, like one draw of whole scene
+static bool tiledDraws(void){
+    const png_uint_32 size = 200;
+    std::mt19937 rng(11);
+    std::uniform_real_distribution<double> unit(0.0, 1.0), pos(-16.0, size);
+
+    Drawing::TiledCanvas tiled(size, size, 32, 8 << 10);
+    Drawing::Canvas canvas(size, size);
+    tiled.initBuffer();
+    for (int batch=0; batch<3; batch++){
+        for (int i=0; i<100; i++){
+            const Drawing::Figure rect = makeRect(pos(rng), pos(rng), 4 + unit(rng)*60, 
+                Drawing::Color(unit(rng), unit(rng), unit(rng), 0.5));
+            tiled.addDrawable(rect);
+            canvas.addDrawable(rect);
+        }
+        tiled.draw();
+    }
+    canvas.initBuffer();
+    canvas.draw();
+    if (!sameTiled(tiled, canvas)) return false;
+
+    //background again, next draw renders whole scene
+    tiled.initBuffer();
+    tiled.draw();
+    return sameTiled(tiled, canvas);
+}
+
+//flat image of same file size for any color
+static void writeFlat(const char* path, double red){
+    Drawing::Canvas canvas(16, 16);
+    canvas.initBuffer(Drawing::Color(red, 0.0, 0.0, 1.0));
+    Drawing::PNGWriteOptions stored;
+    stored.compressionLevel = 0;
+    canvas.bufferToFile(path, stored);
+}
+
+static png_byte firstRed(const char* path){
+    return Drawing::ImageFile(path).getPixels()->getRow(0)[0];
+}
+
+//cached decode is dropped when file is rewritten in place with same size, or replaced by rename
+static bool cacheRewrite(void){
+    const char* path = "./Checks_cache.png";
+    const char* replacement = "./Checks_cache_new.png";
+    writeFlat(path, 0.0);
+    bool passed = firstRed(path) == 0;
+
+    //past file system timestamp granularity, well within one second
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    writeFlat(path, 1.0);
+    passed = passed && firstRed(path) == 255;
+
+    writeFlat(replacement, 0.0);
+    passed = passed && rename(replacement, path) == 0 && firstRed(path) == 0;
+    remove(path);
+    return passed;
+}
+
+//random translucent rects and pixels, some through parallel draw
+static void mutate(Drawing::Canvas& canvas, std::mt19937& rng){
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    const png_uint_32 width = canvas.getWidth(), height = canvas.getHeight();
+    const Drawing::Color color(unit(rng), unit(rng), unit(rng), 0.5);
+    const png_uint_32 x = rng() % width, y = rng() % height;
+    switch (rng() % 3){
+        case 0: canvas.fillputPixels(x, x + rng() % 40, y, y + rng() % 40, color); break;
+        case 1: canvas.putPixel(x, y, color); break;
+        default:
+            canvas.clearDrawables();
+            canvas.addDrawable(makeRect(x, y, 1 + unit(rng)*80, color));
+            canvas.draw();
+    }
+}
+
+//comparators reading dirty rows of one canvas give same value as full compare,
+//whatever other readers of the same canvas do
+static bool incrementalCompare(void){
+    const png_uint_32 width = 200, height = 150;
+    std::mt19937 rng(5);
+    Drawing::Canvas reference(width, height), canvas(width, height);
+    for (int i=0; i<50; i++) mutate(reference, rng);
+    canvas.setThreadCount(4);
+    canvas.setTileSize(32);
+    canvas.setDirtyTracking(true);
+
+    Drawing::IncrementalComparator comparatorA(reference), comparatorB(reference, 16);
+    for (int i=0; i<300; i++){
+        mutate(canvas, rng);
+        const double expected = canvas.compare(reference);
+        //B and user of public dirty region only look now and then
+        if (comparatorA.compare(canvas) != expected) return false;
+        if (i%3 == 0 && comparatorB.compare(canvas) != expected) return false;
+        if (i%5 == 0) canvas.clearDirtyRegion();
+    }
+    return true;
+}
+
+//pyramid updated from dirty rows scores like one built from scratch, never above full
+//compare, and equal to it when not rejected; other readers use dirty rows of same canvas
+static bool pyramidCompare(void){
+    const png_uint_32 width = 256, height = 200;
+    std::mt19937 rng(9);
+    Drawing::Canvas reference(width, height), canvas(width, height);
+    for (int i=0; i<50; i++) mutate(reference, rng);
+    canvas.setThreadCount(4);
+    canvas.setTileSize(32);
+    canvas.setDirtyTracking(true);
+
+    for (Drawing::CompareMetric metric : {Drawing::CompareMetric::ChannelSum, Drawing::CompareMetric::MSE}){
+        Drawing::PyramidComparator pyramid(reference, 3, metric);
+        Drawing::IncrementalComparator incremental(reference);
+        for (int i=0; i<200; i++){
+            mutate(canvas, rng);
+            if (i%5 == 0) canvas.clearDirtyRegion(); //public region is not read by comparators
+            const double expected = canvas.compare(reference, metric);
+            if (metric == Drawing::CompareMetric::ChannelSum && incremental.compare(canvas) != expected) return false;
+
+            //thresholds around expected value, some candidates are rejected
+            const double threshold = i%4 == 0 ? std::numeric_limits<double>::infinity() : expected*(0.5 + (i%4)*0.25);
+            const double score = pyramid.compare(canvas, threshold);
+            Drawing::PyramidComparator fresh(reference, 3, metric);
+            if (fresh.compare(canvas, threshold) != score) return false;
+            if (pyramid.getRejectLevel() < 0 ? score != expected : score < threshold || score > expected) return false;
+        }
+    }
+    return true;
+}
+
+//vertices and their coordinates written through VertexStore::operator[] are stored,
+//also past inline capacity
+static bool vertexWrites(void){
+    Drawing::VertexStore points;
+    for (int i=0; i<7; i++) points.push_back(Drawing::Point({0.0, 0.0}));
+    for (size_t i=0; i<points.size(); i++){
+        points[i] = Drawing::Point({1.0*i, 2.0*i, 3.0*i});
+        points[i][1] += 0.5;
+    }
+    points[6] = points[0];
+    for (size_t i=0; i<6; i++){
+        const Drawing::Point point = points[i];
+        if (point.size() != 3 || point.x() != i || point.y() != 2.0*i + 0.5 || point.z() != 3.0*i) return false;
+    }
+    return points[6].x() == 0.0 && points[6].y() == 0.5 && points[6].size() == 3;
+}
+
+static unsigned s_countedDraws = 0;
+static void countDraws(Drawing::Drawable*, Drawing::Canvas*) { s_countedDraws++; }
+
+//changes made through getDrawable are drawn, also for plain rect, triangle and image commands;
+//images with own drawFn are drawn only through it
+static bool drawableChanges(void){
+    const png_uint_32 size = 64;
+    Drawing::Canvas canvas(size, size), reference(size, size);
+    canvas.setThreadCount(1);
+    const Drawing::Color color(0.2, 0.6, 0.9, 0.5);
+    canvas.addDrawable(makeRect(4, 4, 20, color));
+    canvas.addDrawable(makeTriangle({{30, 2}}, {{60, 10}}, {{40, 40}}, color));
+
+    //copies stay detached
+    canvas.copyDrawable(0)->points[0] = Drawing::Point({0.0, 0.0});
+    canvas.getDrawable(0)->points[0] = Drawing::Point({10.0, 10.0});
+    canvas.getDrawable(1)->points[2][1] = 60.0;
+
+    const char* path = "./Checks_image.png";
+    writeFlat(path, 1.0);
+    Drawing::ImageFile counted(path), image(path);
+    remove(path);
+    counted.setDrawFn(countDraws);
+    canvas.addDrawable(counted);
+    canvas.addDrawable(image);
+    canvas.getDrawable(3)->setDrawFn(countDraws);
+
+    s_countedDraws = 0;
+    canvas.draw();
+
+    reference.addDrawable(makeRect(10, 10, 14, color));
+    reference.addDrawable(makeTriangle({{30, 2}}, {{60, 10}}, {{40, 60}}, color));
+    reference.draw();
+    return s_countedDraws == 2 && samePixels(canvas, reference);
+}
+
+static void drawNothing(Drawing::Drawable*, Drawing::Canvas*) {}
+
+//drawables of arena scene kept through getDrawable stay valid after clearDrawables
+//refills the scene and after canvas is gone
+static bool arenaLifetime(void){
+    std::shared_ptr<Drawing::Drawable> kept, keptAfterClear;
+    {
+        Drawing::Canvas canvas(16, 16);
+        canvas.setArenaScene(true);
+        for (int frame=0; frame<3; frame++){
+            canvas.clearDrawables();
+            for (int i=0; i<1000; i++){
+                const double value = frame*1000 + i;
+                canvas.addDrawable(Drawing::Figure(Drawing::Color(0, 0, 0, 1), drawNothing, 
+                    { Drawing::Point({value, value}) }));
+            }
+            if (frame == 0) kept = canvas.getDrawable(0);
+            if (frame == 1) keptAfterClear = canvas.getDrawable(1);
+        }
+        if (kept->points[0].x() != 0.0 || keptAfterClear->points[0].x() != 1001.0) return false;
+    }
+    return kept->points[0].x() == 0.0 && keptAfterClear->points[0].y() == 1001.0;
+}
+
+//random rects and triangles of every triangle mode, mostly inside canvas, a third opaque
+static void randomScene(Drawing::Canvas& canvas, size_t count, std::mt19937& rng){
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    std::uniform_real_distribution<double> posX(-20.0, canvas.getWidth() + 20.0), posY(-20.0, canvas.getHeight() + 20.0);
+    const Drawing::draw_fn_ptr triangleFns[] = {Drawing::triangle_filled, Drawing::triangle_edge, Drawing::triangle_edge_aa};
+    for (size_t i=0; i<count; i++){
+        const Drawing::Color color(unit(rng), unit(rng), unit(rng), rng()%3 == 0 ? 1.0 : unit(rng));
+        const double x = posX(rng), y = posY(rng), size = 2 + unit(rng)*unit(rng)*100;
+        if (rng()%2) canvas.addDrawable(makeRect(x, y, size, color));
+        else {
+            Drawing::Figure triangle = makeTriangle({{x, y}}, {{x + unit(rng)*size, y + size}}, 
+                {{x + size, y + unit(rng)*size}}, color);
+            triangle.setDrawFn(triangleFns[rng()%3]);
+            canvas.addDrawable(triangle);
+        }
+    }
+}
+
+//draw with occlusion culling gives same pixels as without, Legacy and Over modes
+static bool occlusionCulling(void){
+    std::mt19937 rng(3);
+    size_t culled = 0;
+    for (int scene=0; scene<300; scene++){
+        const Drawing::BlendMode mode = scene%2 ? Drawing::BlendMode::Over : Drawing::BlendMode::Legacy;
+        Drawing::Canvas canvas(96 + rng()%64, 64 + rng()%64);
+        canvas.setBlendMode(mode);
+        canvas.setThreadCount(1);
+        randomScene(canvas, 20 + rng()%100, rng);
+        Drawing::Canvas reference(canvas);
+        reference.setOcclusionCulling(false);
+
+        canvas.draw();
+        reference.draw();
+        culled += canvas.getCulledSize();
+        if (!samePixels(canvas, reference)) return false;
+    }
+    //scenes have to exercise culling
+    return culled > 0;
+}
+
+//draw split into tiles on several threads gives same pixels as serial draw
+static bool parallelDraw(void){
+    std::mt19937 rng(13);
+    for (int scene=0; scene<60; scene++){
+        Drawing::Canvas canvas(200 + rng()%100, 150 + rng()%100);
+        canvas.setBlendMode(scene%2 ? Drawing::BlendMode::Over : Drawing::BlendMode::Legacy);
+        canvas.setThreadCount(1);
+        randomScene(canvas, 50 + rng()%300, rng);
+        Drawing::Canvas parallel(canvas);
+        parallel.setThreadCount(4);
+        parallel.setTileSize(scene%3 ? 64 : 16);
+
+        canvas.draw();
+        parallel.draw();
+        if (!samePixels(canvas, parallel)) return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv){
+    std::string filter;
+    for (int i=1; i<argc; i++){
+        const std::string arg = argv[i];
+        if (arg == "--filter" && i+1 < argc) filter = argv[++i];
+        else {
+            std::cerr << "unknown option " << arg << "\n";
+            return 2;
+        }
+    }
+
+    Checks checks(filter);
+    checks.run("vertex/writes", vertexWrites);
+    checks.run("triangle/offscreen", offscreenTriangles);
+    checks.run("drawable/changes", drawableChanges);
+    checks.run("arena/lifetime", arenaLifetime);
+    checks.run("cache/rewrite", cacheRewrite);
+    checks.run("redraw/region", redrawRegion);
+    checks.run("tiled/draws", tiledDraws);
+    checks.run("compare/incremental", incrementalCompare);
+    checks.run("compare/pyramid", pyramidCompare);
+    checks.run("draw/parallel", parallelDraw);
+    checks.run("draw/culling", occlusionCulling);
+    return checks.getFailed();
+}
@@ -0,0 +1,86 @@
+#include "../../Drawing++.hpp"
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+
+static const char* filterName(Drawing::PNGFilter filter){
+    switch (filter){
+        case Drawing::PNGFilter::None: return "none";
+        case Drawing::PNGFilter::Sub: return "sub";
+        case Drawing::PNGFilter::Up: return "up";
+        case Drawing::PNGFilter::Average: return "average";
+        case Drawing::PNGFilter::Paeth: return "paeth";
+        case Drawing::PNGFilter::Adaptive: return "adaptive";
+        default: return "default";
+    }
+}
+
+static const char* strategyName(Drawing::PNGStrategy strategy){
+    switch (strategy){
+        case Drawing::PNGStrategy::Filtered: return "filtered";
+        case Drawing::PNGStrategy::HuffmanOnly: return "huffman";
+        case Drawing::PNGStrategy::RLE: return "rle";
+        case Drawing::PNGStrategy::Fixed: return "fixed";
+        default: return "default";
+    }
+}
+
+static void benchmark(const char* name, Drawing::Canvas& canvas){
+    using clock = std::chrono::steady_clock;
+
+    const Drawing::PNGFilter filters[] = {
+        Drawing::PNGFilter::None, Drawing::PNGFilter::Sub, Drawing::PNGFilter::Up,
+        Drawing::PNGFilter::Paeth, Drawing::PNGFilter::Adaptive
+    };
+    const Drawing::PNGStrategy strategies[] = {
+        Drawing::PNGStrategy::Default, Drawing::PNGStrategy::Filtered, 
+        Drawing::PNGStrategy::RLE, Drawing::PNGStrategy::HuffmanOnly
+    };
+    const int levels[] = {1, 6, 9};
+
+    std::vector<png_byte> out;
+    for (int level : levels){
+        for (Drawing::PNGFilter filter : filters){
+            for (Drawing::PNGStrategy strategy : strategies){
+                Drawing::PNGWriteOptions options;
+                options.compressionLevel = level;
+                options.filter = filter;
+                options.strategy = strategy;
+
+                unsigned iterations = 0;
+                const auto start = clock::now();
+                double seconds = 0.0;
+                do {
+                    canvas.bufferToMemory(out, options);
+                    iterations++;
+                    seconds = std::chrono::duration<double>(clock::now() - start).count();
+                } while (seconds < 0.2);
+
+                std::cout << std::left << std::setw(14) << name << std::setw(7) << level 
+                    << std::setw(10) << filterName(filter) << std::setw(10) << strategyName(strategy)
+                    << std::setw(12) << seconds*1000/iterations << out.size() << "\n";
+            }
+        }
+    }
+}
+
+int main(){
+    //outputs of examples, run from Benchmarks/Encode
+    Drawing::ImageFile threeSquares("../../Examples/ThreeSquares/output.png");
+    Drawing::ImageFile loadPNG("../../Examples/LoadPNG/mustachegirl.png");
+
+    Drawing::Canvas threeSquaresCanvas(threeSquares.getWidth(), threeSquares.getHeight());
+    threeSquaresCanvas.addDrawable(threeSquares);
+    threeSquaresCanvas.draw();
+
+    Drawing::Canvas loadPNGCanvas(loadPNG.getWidth(), loadPNG.getHeight());
+    loadPNGCanvas.addDrawable(loadPNG);
+    loadPNGCanvas.draw();
+
+    std::cout << std::left << std::setw(14) << "image" << std::setw(7) << "level" 
+        << std::setw(10) << "filter" << std::setw(10) << "strategy" 
+        << std::setw(12) << "ms" << "bytes\n";
+    benchmark("ThreeSquares", threeSquaresCanvas);
+    benchmark("LoadPNG", loadPNGCanvas);
+    return 0;
+}
@@ -0,0 +1,119 @@
+#include "../../Drawing++.hpp"
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <random>
+
+//reference blend, same double math as Canvas::putPixel
+static void blendSpanDouble(png_bytep row, png_uint_32 count, Drawing::Color color){
+    const double negAlpha = 1-color.a;
+    const double _255mulAlpha = 255*color.a;
+    color.multiplyRGB(_255mulAlpha, _255mulAlpha, _255mulAlpha);
+
+    for (png_uint_32 x=0; x<count; x++, row+=4){
+        const double alphaMix = (row[3] / (int) 255)*negAlpha;
+        row[0] = row[0]*alphaMix + color.r;
+        row[1] = row[1]*alphaMix + color.g;
+        row[2] = row[2]*alphaMix + color.b;
+    }
+}
+
+static void fillRandom(std::vector<png_byte>& buffer, std::mt19937& rng){
+    for (size_t i=0; i<buffer.size(); i++){
+        buffer[i] = rng();
+        //mostly opaque pixels, like a real canvas
+        if (i%4 == 3 && rng()%4) buffer[i] = 255;
+    }
+}
+
+static int maxError(const Drawing::SpanKernels& kernels, std::mt19937& rng){
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    std::vector<png_byte> source(4*1021), reference, result;
+    int maxErr = 0;
+
+    for (int i=0; i<2000; i++){
+        Drawing::Color color(unit(rng), unit(rng), unit(rng), unit(rng));
+        if (i%10 == 0) color.a = 1.0;
+        if (i%10 == 1) color.a = 0.0;
+        fillRandom(source, rng);
+
+        reference = source;
+        result = source;
+        blendSpanDouble(reference.data(), reference.size()/4, color);
+        kernels.blendSpan(result.data(), result.size()/4, Drawing::makeSpanColor(color));
+
+        for (size_t j=0; j<result.size(); j++)
+            maxErr = std::max(maxErr, std::abs(result[j] - reference[j]));
+    }
+    return maxErr;
+}
+
+template<typename Fn>
+static double pixelsPerSecond(Fn fn, png_uint_32 width, png_uint_32 height){
+    using clock = std::chrono::steady_clock;
+    unsigned iterations = 0;
+    const auto start = clock::now();
+    double seconds = 0.0;
+
+    do {
+        fn();
+        iterations++;
+        seconds = std::chrono::duration<double>(clock::now() - start).count();
+    } while (seconds < 0.5);
+
+    return (double) width*height*iterations / seconds;
+}
+
+int main(){
+    const png_uint_32 width = 512, height = 512;
+    std::mt19937 rng(1234);
+
+    Drawing::FrameBuffer buffer(width, height, 4);
+    std::vector<png_byte> init(buffer.getSize());
+    fillRandom(init, rng);
+    memcpy(buffer.getData(), init.data(), init.size());
+
+    const Drawing::Color color(0.2, 0.6, 0.9, 0.5);
+    const Drawing::SpanColor spanColor = Drawing::makeSpanColor(color);
+
+    std::cout << "detected: " << Drawing::getSimdLevelName(Drawing::detectSimdLevel()) << "\n";
+    std::cout << std::left << std::setw(10) << "kernel" << std::setw(16) << "blend px/s"
+        << std::setw(16) << "set px/s" << std::setw(16) << "over px/s" << "max err (LSB)\n";
+
+    double doubleRate = pixelsPerSecond([&](){
+        for (png_uint_32 y=0; y<height; y++)
+            blendSpanDouble(buffer.getRow(y), width, color);
+    }, width, height);
+    std::cout << std::setw(10) << "double" << std::setw(16) << doubleRate 
+        << std::setw(16) << "-" << std::setw(16) << "-" << 0 << "\n";
+
+    //premultiplied copy for BlendMode::Over
+    Drawing::FrameBuffer premultiplied = buffer;
+    for (png_uint_32 y=0; y<height; y++) Drawing::premultiplyRow(premultiplied.getRow(y), width);
+    png_byte premultipliedColor[4];
+    Drawing::premultiplyColor(color, premultipliedColor);
+
+    const Drawing::SimdLevel levels[] = {
+        Drawing::SimdLevel::Scalar, Drawing::SimdLevel::SSE2, Drawing::SimdLevel::AVX2
+    };
+    for (Drawing::SimdLevel level : levels){
+        const Drawing::SpanKernels& kernels = Drawing::getSpanKernels(level);
+        if (kernels.level != level) continue; //not supported by this CPU
+
+        double blendRate = pixelsPerSecond([&](){
+            kernels.blendRect(buffer.getData(), buffer.getStride(), width, height, spanColor);
+        }, width, height);
+        double setRate = pixelsPerSecond([&](){
+            kernels.setRect(buffer.getData(), buffer.getStride(), width, height, spanColor);
+        }, width, height);
+        double overRate = pixelsPerSecond([&](){
+            for (png_uint_32 y=0; y<height; y++)
+                kernels.compositeSpan(premultiplied.getRow(y), width, premultipliedColor, Drawing::BlendMode::Over);
+        }, width, height);
+
+        std::cout << std::setw(10) << Drawing::getSimdLevelName(level) 
+            << std::setw(16) << blendRate << std::setw(16) << setRate 
+            << std::setw(16) << overRate << maxError(kernels, rng) << "\n";
+    }
+    return 0;
+}
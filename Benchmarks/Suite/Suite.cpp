@@ -0,0 +1,325 @@
+#include "../../Drawing++.hpp"
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <random>
+#include <map>
+#include <cmath>
+
+//usage: Suite [--filter text] [--json out.json] [--baseline old.json] [--threshold 0.10]
+//             [--repetitions 5] [--min-time 0.5]
+//every scenario is timed in repetitions, median time of one run is reported;
+//with --baseline, scenarios slower than baseline by more than threshold fail (exit code 1)
+
+#ifndef DRAWING_BENCHMARK_DATA
+#define DRAWING_BENCHMARK_DATA "../../Examples/LoadPNG"
+#endif
+
+struct Options {
+    std::string filter;
+    std::string jsonPath;
+    std::string baselinePath;
+    double threshold = 0.10;
+    unsigned repetitions = 5;
+    double minTime = 0.5; //seconds per scenario
+};
+
+struct Result {
+    std::string name;
+    double items; //per run, e.g. rects or pixels
+    double ns; //median time of one run
+};
+
+class Suite {
+    public:
+        Suite(const Options& options) : m_options(options) {}
+
+        //fn is one run processing items
+        template<typename Fn>
+        void run(const std::string& name, double items, Fn fn){
+            if (!m_options.filter.empty() && name.find(m_options.filter) == std::string::npos) return;
+            using clock = std::chrono::steady_clock;
+
+            //calibrate runs per repetition on first run, also a warm-up
+            auto start = clock::now();
+            fn();
+            const double first = std::chrono::duration<double>(clock::now() - start).count();
+            const double target = m_options.minTime / m_options.repetitions;
+            const unsigned runs = std::max(1.0, std::min(1e6, target / std::max(first, 1e-9)));
+
+            std::vector<double> times;
+            for (unsigned repetition=0; repetition<m_options.repetitions; repetition++){
+                start = clock::now();
+                for (unsigned i=0; i<runs; i++) fn();
+                times.push_back(std::chrono::duration<double, std::nano>(clock::now() - start).count() / runs);
+            }
+            std::sort(times.begin(), times.end());
+            m_results.push_back(Result{name, items, times[times.size()/2]});
+
+            const Result& result = m_results.back();
+            std::cout << std::left << std::setw(28) << name << std::right
+                << std::setw(14) << std::fixed << std::setprecision(0) << result.ns << " ns"
+                << std::setw(16) << std::scientific << std::setprecision(3) << items*1e9/result.ns << " items/s\n";
+        }
+
+        void writeJSON(const std::string& path) const {
+            std::ofstream out(path);
+            if (!out) abort();
+            out << "{\n  \"simd\": \"" << Drawing::getSimdLevelName(Drawing::detectSimdLevel()) << "\",\n";
+            out << "  \"results\": [\n";
+            for (size_t i=0; i<m_results.size(); i++){
+                const Result& result = m_results[i];
+                out << std::setprecision(6) << std::defaultfloat
+                    << "    {\"name\": \"" << result.name << "\", \"items\": " << result.items
+                    << ", \"ns\": " << result.ns << ", \"items_per_second\": " << result.items*1e9/result.ns
+                    << "}" << (i+1 < m_results.size() ? "," : "") << "\n";
+            }
+            out << "  ]\n}\n";
+        }
+
+        //returns number of scenarios slower than baseline
+        unsigned compareBaseline(const std::string& path) const {
+            std::ifstream in(path);
+            if (!in) abort();
+
+            //one result per line, as written by writeJSON
+            std::map<std::string, double> baseline;
+            std::string line;
+            while (std::getline(in, line)){
+                const size_t name = line.find("\"name\": \"");
+                const size_t ns = line.find("\"ns\": ");
+                if (name == std::string::npos || ns == std::string::npos) continue;
+                const size_t nameEnd = line.find('"', name+9);
+                baseline[line.substr(name+9, nameEnd-name-9)] = atof(line.c_str() + ns+6);
+            }
+
+            unsigned slower = 0;
+            std::cout << "\n" << std::left << std::setw(28) << "scenario" << std::right
+                << std::setw(14) << "baseline ns" << std::setw(14) << "ns" << std::setw(10) << "ratio" << "\n";
+            for (const Result& result : m_results){
+                auto found = baseline.find(result.name);
+                if (found == baseline.end()) continue;
+
+                const double ratio = result.ns / found->second;
+                const bool regressed = ratio > 1.0 + m_options.threshold;
+                slower += regressed;
+                std::cout << std::left << std::setw(28) << result.name << std::right << std::fixed
+                    << std::setw(14) << std::setprecision(0) << found->second
+                    << std::setw(14) << result.ns << std::setw(10) << std::setprecision(3) << ratio
+                    << (regressed ? "  SLOWER" : "") << "\n";
+            }
+            return slower;
+        }
+
+    private:
+        Options m_options;
+        std::vector<Result> m_results;
+};
+
+static Drawing::Figure makeRect(double x, double y, double size, const Drawing::Color& color){
+    return Drawing::Figure(color, Drawing::rect_filled,
+        { Drawing::Point({x, y}), Drawing::Point({x + size, y + size}) });
+}
+
+//radial gradient with soft edge, straight alpha
+static void gradientSpan(const Drawing::SpanShader* shader, png_uint_32 y, 
+    png_uint_32 x1, png_uint_32 x2, png_bytep rgba){
+
+    const double cx = shader->points[0].x(), cy = shader->points[0].y(), radius = shader->points[1].x();
+    for (png_uint_32 x=x1; x<x2; x++, rgba+=4){
+        const double d = std::sqrt((x-cx)*(x-cx) + (y-cy)*(y-cy)) / radius;
+        rgba[0] = 255; rgba[1] = std::min(d, 1.0)*255; rgba[2] = 64;
+        rgba[3] = d < 1.0 ? (1.0 - d)*255 : 0;
+    }
+}
+
+static Drawing::Figure makeTriangle(double x, double y, double size, const Drawing::Color& color,
+    std::mt19937& rng){
+
+    std::uniform_real_distribution<double> offset(0.0, size);
+    return Drawing::Figure(color, Drawing::triangle_filled,
+        { Drawing::Point({x + offset(rng), y + offset(rng)}),
+          Drawing::Point({x + offset(rng), y + offset(rng)}),
+          Drawing::Point({x + offset(rng), y + offset(rng)}) });
+}
+
+//canvas with random content, so compare and encode do not see flat images
+static void fillNoise(Drawing::Canvas& canvas, std::mt19937& rng){
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    const png_uint_32 width = canvas.getBuffer().getWidth(), height = canvas.getBuffer().getHeight();
+    canvas.initBuffer(Drawing::Color(1.0, 1.0, 1.0, 1.0));
+    for (int i=0; i<200; i++){
+        const double x = unit(rng)*width, y = unit(rng)*height;
+        canvas.fillputPixels(x, x + unit(rng)*width/4, y, y + unit(rng)*height/4,
+            Drawing::Color(unit(rng), unit(rng), unit(rng), 0.5));
+    }
+}
+
+int main(int argc, char** argv){
+    Options options;
+    for (int i=1; i<argc; i++){
+        const std::string arg = argv[i];
+        if (i+1 >= argc){
+            std::cerr << "missing value of " << arg << "\n";
+            return 2;
+        }
+        if (arg == "--filter") options.filter = argv[++i];
+        else if (arg == "--json") options.jsonPath = argv[++i];
+        else if (arg == "--baseline") options.baselinePath = argv[++i];
+        else if (arg == "--threshold") options.threshold = atof(argv[++i]);
+        else if (arg == "--repetitions") options.repetitions = std::max(1, atoi(argv[++i]));
+        else if (arg == "--min-time") options.minTime = atof(argv[++i]);
+        else {
+            std::cerr << "unknown option " << arg << "\n";
+            return 2;
+        }
+    }
+
+    Suite suite(options);
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    const std::string lennaPath = std::string(DRAWING_BENCHMARK_DATA) + "/Lenna_(test_image).png";
+    std::cout << "simd: " << Drawing::getSimdLevelName(Drawing::detectSimdLevel()) << "\n";
+
+    const png_uint_32 width = 1024, height = 1024;
+    Drawing::Canvas canvas(width, height);
+
+    //single pixels
+    for (double alpha : {0.5, 1.0}){
+        std::vector<png_uint_32> xs(100000), ys(xs.size());
+        for (size_t i=0; i<xs.size(); i++){ xs[i] = rng() % width; ys[i] = rng() % height; }
+        const Drawing::Color color(0.2, 0.6, 0.9, alpha);
+        suite.run(alpha < 1.0 ? "putPixel/a50" : "putPixel/a100", xs.size(), [&](){
+            for (size_t i=0; i<xs.size(); i++) canvas.putPixel(xs[i], ys[i], color);
+        });
+    }
+
+    //translucent fill and compare of whole canvas in every pixel format, items are pixels
+    const struct { const char* name; int bitDepth, colorType; } formats[] = {
+        {"rgba8", 8, PNG_COLOR_TYPE_RGBA}, {"rgb8", 8, PNG_COLOR_TYPE_RGB},
+        {"gray8", 8, PNG_COLOR_TYPE_GRAY}, {"rgba16", 16, PNG_COLOR_TYPE_RGBA}
+    };
+    for (const auto& format : formats){
+        Drawing::Canvas formatA(width, height, format.bitDepth, format.colorType);
+        Drawing::Canvas formatB(formatA);
+        const Drawing::Color color(0.2, 0.6, 0.9, 0.5);
+        suite.run(std::string("fill/") + format.name, (double) width*height, [&](){
+            formatA.fillputPixels(0, width, 0, height, color);
+        });
+        suite.run(std::string("compare/") + format.name, (double) width*height, [&](){ formatA.compare(formatB); });
+    }
+
+    //scenes of rects and triangles drawn by Canvas::draw, items are drawables
+    const struct { const char* name; double size; size_t count; } sizes[] = {
+        {"s8", 8.0, 20000}, {"s64", 64.0, 2000}, {"s512", 512.0, 50}
+    };
+    for (const char* shape : {"rects", "triangles"}){
+        for (const auto& size : sizes){
+            for (double alpha : {0.5, 1.0}){
+                Drawing::Canvas scene(width, height);
+                std::uniform_real_distribution<double> posX(0.0, width - size.size);
+                std::uniform_real_distribution<double> posY(0.0, height - size.size);
+                for (size_t i=0; i<size.count; i++){
+                    const Drawing::Color color(unit(rng), unit(rng), unit(rng), alpha);
+                    const double x = posX(rng), y = posY(rng);
+                    if (shape[0] == 'r') scene.addDrawable(makeRect(x, y, size.size, color));
+                    else scene.addDrawable(makeTriangle(x, y, size.size, color, rng));
+                }
+                const std::string name = std::string(shape) + "/" + size.name + (alpha < 1.0 ? "/a50" : "/a100");
+                suite.run(name, size.count, [&](){ scene.draw(); });
+            }
+        }
+    }
+
+    //one drawable of s8 scene moved and its old and new bounds redrawn, items are changes
+    {
+        Drawing::Canvas scene(width, height);
+        std::uniform_real_distribution<double> posX(0.0, width - 8.0), posY(0.0, height - 8.0);
+        for (size_t i=0; i<20000; i++)
+            scene.addDrawable(makeRect(posX(rng), posY(rng), 8.0, Drawing::Color(unit(rng), unit(rng), unit(rng), 0.5)));
+        scene.draw();
+        unsigned index = 0;
+        suite.run("redraw/s8", 1, [&](){
+            index = (index + 7919) % scene.getDrawablesSize();
+            Drawing::Rect oldBounds, newBounds;
+            scene.getDrawableBounds(index, oldBounds);
+            scene.setDrawable(makeRect(posX(rng), posY(rng), 8.0, Drawing::Color(0.2, 0.4, 0.6, 0.5)), index);
+            scene.getDrawableBounds(index, newBounds);
+            scene.redrawRegion(oldBounds);
+            scene.redrawRegion(newBounds);
+        });
+    }
+
+    //full image blits
+    Drawing::ImageCache::getInstance().setMemoryBudget(0); //every load decodes
+    const Drawing::ImageFile lenna(lennaPath.c_str());
+    const Drawing::FrameBuffer& lennaPixels = *lenna.getPixels();
+    const Drawing::Rect lennaRect(0, 0, lennaPixels.getWidth(), lennaPixels.getHeight());
+    const double lennaSize = (double) lennaPixels.getWidth()*lennaPixels.getHeight();
+    suite.run("blit/lenna/over", lennaSize, [&](){
+        canvas.blit(lennaPixels, lennaRect, 0, 0, Drawing::BlitMode::AlphaOver);
+    });
+    suite.run("blit/lenna/copy", lennaSize, [&](){
+        canvas.blit(lennaPixels, lennaRect, 0, 0, Drawing::BlitMode::Copy);
+    });
+
+    //span shader over whole canvas, items are pixels
+    const Drawing::SpanShader gradient(gradientSpan, 
+        { Drawing::Point({width/2.0, height/2.0}), Drawing::Point({width/2.0}) });
+    suite.run("shader/gradient", (double) width*height, [&](){ canvas.drawShader(gradient); });
+
+    //rollback of a small change, items are pixels of canvas
+    Drawing::FrameBuffer fullSnapshot;
+    Drawing::CanvasSnapshot tileSnapshot;
+    canvas.takeSnapshot(fullSnapshot);
+    suite.run("snapshot/full", (double) width*height, [&](){
+        canvas.fillputPixels(100, 164, 100, 164, Drawing::Color(0.1, 0.2, 0.3, 0.5));
+        canvas.restoreSnapshot(fullSnapshot);
+    });
+    canvas.takeSnapshot(tileSnapshot);
+    suite.run("snapshot/tiles", (double) width*height, [&](){
+        canvas.fillputPixels(100, 164, 100, 164, Drawing::Color(0.1, 0.2, 0.3, 0.5));
+        canvas.restoreSnapshot(tileSnapshot);
+    });
+
+    //compare, items are pixels
+    const struct { const char* name; png_uint_32 width, height; } compareSizes[] = {
+        {"compare/512", 512, 512}, {"compare/4k", 3840, 2160}
+    };
+    for (const auto& size : compareSizes){
+        if (!options.filter.empty() && std::string(size.name).find(options.filter) == std::string::npos) continue;
+        Drawing::Canvas canvasA(size.width, size.height), canvasB(size.width, size.height);
+        fillNoise(canvasA, rng);
+        fillNoise(canvasB, rng);
+        suite.run(size.name, (double) size.width*size.height, [&](){ canvasA.compare(canvasB); });
+
+        //candidate differing in a block, rejected from coarsest level after a small change
+        canvasA.fillputPixels(0, size.width/2, 0, size.height/2, Drawing::Color(0.9, 0.1, 0.1, 1.0));
+        const double threshold = canvasA.compare(canvasB)/2;
+        Drawing::PyramidComparator pyramid(canvasB, 3);
+        canvasA.setDirtyTracking(true);
+        suite.run(std::string(size.name) + "/pyramid", (double) size.width*size.height, [&](){
+            canvasA.putPixel(size.width-1, size.height-1, Drawing::Color(0.5, 0.5, 0.5, 1.0));
+            pyramid.compare(canvasA, threshold);
+        });
+    }
+
+    //PNG encode and decode of lenna, items are pixels
+    Drawing::Canvas lennaCanvas(lennaPixels.getWidth(), lennaPixels.getHeight());
+    lennaCanvas.blit(lennaPixels, lennaRect, 0, 0, Drawing::BlitMode::Copy);
+    std::vector<png_byte> encoded;
+    suite.run("encode/lenna/memory", lennaSize, [&](){ lennaCanvas.bufferToMemory(encoded); });
+    const std::string outputPath = "./Suite_output.png";
+    suite.run("encode/lenna/file", lennaSize, [&](){ lennaCanvas.bufferToFile(outputPath.c_str()); });
+    remove(outputPath.c_str());
+    suite.run("decode/lenna", lennaSize, [&](){ Drawing::ImageFile image(lennaPath.c_str()); });
+    Drawing::ImageLoadOptions thumbnail;
+    thumbnail.downscale = 2;
+    suite.run("decode/lenna/quarter", lennaSize, [&](){ Drawing::ImageFile image(lennaPath.c_str(), thumbnail); });
+
+    if (!options.jsonPath.empty()) suite.writeJSON(options.jsonPath);
+    if (!options.baselinePath.empty() && suite.compareBaseline(options.baselinePath) > 0) return 1;
+    return 0;
+}
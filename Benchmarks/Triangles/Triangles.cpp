@@ -0,0 +1,78 @@
+#include "../../Drawing++.hpp"
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <random>
+
+//random triangles with edges of about size pixels, all inside the canvas
+static std::vector<Drawing::Figure> makeTriangles(size_t count, double size, 
+    png_uint_32 width, png_uint_32 height, std::mt19937& rng){
+
+    std::uniform_real_distribution<double> posX(0.0, width - size);
+    std::uniform_real_distribution<double> posY(0.0, height - size);
+    std::uniform_real_distribution<double> offset(0.0, size);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+
+    std::vector<Drawing::Figure> triangles;
+    for (size_t i=0; i<count; i++){
+        const double x = posX(rng), y = posY(rng);
+        triangles.push_back(Drawing::Figure(
+            Drawing::Color(unit(rng), unit(rng), unit(rng), 0.5), Drawing::triangle_filled,
+            { Drawing::Point({x + offset(rng), y + offset(rng)}), 
+              Drawing::Point({x + offset(rng), y + offset(rng)}),
+              Drawing::Point({x + offset(rng), y + offset(rng)}) }
+        ));
+    }
+    return triangles;
+}
+
+static double trianglesPerSecond(std::vector<Drawing::Figure>& triangles, 
+    Drawing::draw_fn_ptr drawFn, Drawing::Canvas& canvas){
+
+    using clock = std::chrono::steady_clock;
+    for (Drawing::Figure& triangle : triangles) triangle.setDrawFn(drawFn);
+
+    size_t drawn = 0;
+    const auto start = clock::now();
+    double seconds = 0.0;
+    do {
+        for (Drawing::Figure& triangle : triangles) triangle.drawFn(&triangle, &canvas);
+        drawn += triangles.size();
+        seconds = std::chrono::duration<double>(clock::now() - start).count();
+    } while (seconds < 0.5);
+
+    return drawn / seconds;
+}
+
+int main(){
+    const png_uint_32 width = 1024, height = 1024;
+    std::mt19937 rng(1234);
+
+    Drawing::Canvas canvas(width, height);
+    canvas.initBuffer(Drawing::Color(1.0, 1.0, 1.0, 1.0));
+
+    const struct { const char* name; double size; size_t count; } sizes[] = {
+        {"small", 8.0, 20000}, {"medium", 64.0, 2000}, {"large", 512.0, 50}
+    };
+    const struct { const char* name; Drawing::draw_fn_ptr drawFn; } engines[] = {
+        {"triangle_filled", Drawing::triangle_filled},
+        {"triangle_edge", Drawing::triangle_edge},
+        {"triangle_edge_aa", Drawing::triangle_edge_aa}
+    };
+
+    std::cout << std::left << std::setw(18) << "engine";
+    for (const auto& size : sizes) std::cout << std::setw(16) << (std::string(size.name) + " tri/s");
+    std::cout << "\n";
+
+    std::vector<std::vector<Drawing::Figure>> scenes;
+    for (const auto& size : sizes) 
+        scenes.push_back(makeTriangles(size.count, size.size, width, height, rng));
+
+    for (const auto& engine : engines){
+        std::cout << std::setw(18) << engine.name;
+        for (std::vector<Drawing::Figure>& scene : scenes)
+            std::cout << std::setw(16) << trianglesPerSecond(scene, engine.drawFn, canvas);
+        std::cout << "\n";
+    }
+    return 0;
+}
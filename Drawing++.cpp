@@ -1,29 +1,947 @@
 #include "Drawing++.hpp"
+#include <zlib.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define DRAWING_X86_SIMD 1
+#include <immintrin.h>
+#else
+#define DRAWING_X86_SIMD 0
+#endif
+
+static png_bytep _alignedAlloc(size_t size){
+    void* ptr = nullptr;
+#ifdef _WIN32
+    ptr = _aligned_malloc(size, Drawing::FrameBuffer::alignment);
+#else
+    if (posix_memalign(&ptr, Drawing::FrameBuffer::alignment, size) != 0) ptr = nullptr;
+#endif
+    if (!ptr) abort();
+    Drawing::countAllocation(Drawing::AllocationKind::FrameBuffer);
+    return (png_bytep) ptr;
+}
+
+static std::atomic<unsigned long long> _allocationCounts[(size_t) Drawing::AllocationKind::Count];
+
+void Drawing::countAllocation(AllocationKind kind){
+    _allocationCounts[(size_t) kind].fetch_add(1, std::memory_order_relaxed);
+}
+
+unsigned long long Drawing::getAllocationCount(AllocationKind kind){
+    return _allocationCounts[(size_t) kind].load(std::memory_order_relaxed);
+}
+
+unsigned long long Drawing::getAllocationCount(void){
+    unsigned long long count = 0;
+    for (const auto& kindCount : _allocationCounts) count += kindCount.load(std::memory_order_relaxed);
+    return count;
+}
+
+void Drawing::resetAllocationCounts(void){
+    for (auto& kindCount : _allocationCounts) kindCount.store(0, std::memory_order_relaxed);
+}
+
+static std::atomic<bool> _profiling{false};
+
+Drawing::Profiler::Profiler(void) : m_epoch(std::chrono::steady_clock::now()) {}
+
+Drawing::Profiler& Drawing::Profiler::getInstance(void){
+    static Profiler profiler;
+    return profiler;
+}
+
+void Drawing::Profiler::setEnabled(bool enabled){
+    _profiling.store(enabled && DRAWING_PROFILE, std::memory_order_relaxed);
+}
+
+bool Drawing::Profiler::isEnabled(void) const {
+    return _profiling.load(std::memory_order_relaxed);
+}
+
+void Drawing::Profiler::clear(void){
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (auto& events : m_threads) events->clear();
+}
+
+void Drawing::Profiler::record(ProfileEvent event){
+    //threads register once, buffers outlive threads
+    thread_local std::shared_ptr<std::vector<ProfileEvent>> events;
+    thread_local unsigned thread = 0;
+    if (!events){
+        events = std::make_shared<std::vector<ProfileEvent>>();
+        std::lock_guard<std::mutex> lock(m_mutex);
+        thread = m_threads.size();
+        m_threads.push_back(events);
+    }
+    event.thread = thread;
+    events->push_back(event);
+}
+
+unsigned long long Drawing::Profiler::getTime(void) const {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - m_epoch).count();
+}
+
+std::vector<Drawing::ProfileEvent> Drawing::Profiler::getEvents(void){
+    std::vector<ProfileEvent> events;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto& threadEvents : m_threads) 
+            events.insert(events.end(), threadEvents->begin(), threadEvents->end());
+    }
+    std::stable_sort(events.begin(), events.end(), [](const ProfileEvent& a, const ProfileEvent& b){
+        return a.start < b.start;
+    });
+    return events;
+}
+
+void Drawing::Profiler::writeTrace(const char* filepath){
+    FILE *fp = fopen(filepath, "w");
+    if (!fp) abort();
+
+    const std::vector<ProfileEvent> events = getEvents();
+    fprintf(fp, "{\"traceEvents\":[");
+    for (size_t i=0; i<events.size(); i++){
+        const ProfileEvent& event = events[i];
+        fprintf(fp, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+            "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"command\":%lld,\"blendedPixels\":%llu,\"setPixels\":%llu}}",
+            i ? "," : "", event.name, event.command < 0 ? "phase" : "command", event.thread,
+            event.start / 1000.0, event.duration / 1000.0, event.command, 
+            event.blendedPixels, event.setPixels);
+    }
+    fprintf(fp, "\n],\"displayTimeUnit\":\"ns\"}\n");
+    fclose(fp);
+}
+
+std::string Drawing::Profiler::getSummary(size_t commands){
+    struct Total {
+        const char* name = nullptr;
+        long long command = -1;
+        unsigned long long calls = 0, duration = 0, blendedPixels = 0, setPixels = 0;
+    };
+    std::vector<Total> phases;
+    std::unordered_map<long long, Total> commandTotals;
+    for (const ProfileEvent& event : getEvents()){
+        Total* total = nullptr;
+        if (event.command >= 0) total = &commandTotals[event.command];
+        else {
+            for (Total& phase : phases) if (strcmp(phase.name, event.name) == 0) total = &phase;
+            if (total == nullptr){
+                phases.emplace_back();
+                total = &phases.back();
+            }
+        }
+        total->name = event.name;
+        total->command = event.command;
+        total->calls++;
+        total->duration += event.duration;
+        total->blendedPixels += event.blendedPixels;
+        total->setPixels += event.setPixels;
+    }
+
+    std::vector<Total> top;
+    for (const auto& total : commandTotals) top.push_back(total.second);
+    std::sort(top.begin(), top.end(), [](const Total& a, const Total& b){ return a.duration > b.duration; });
+    if (top.size() > commands) top.resize(commands);
+
+    std::string summary;
+    char line[160];
+    auto addRow = [&](const char* first, const char* second, const Total& total){
+        snprintf(line, sizeof(line), "%-14s %-9s %8llu %12.3f %12llu %12llu\n", first, second, 
+            total.calls, total.duration / 1e6, total.blendedPixels, total.setPixels);
+        summary += line;
+    };
+    snprintf(line, sizeof(line), "%-14s %-9s %8s %12s %12s %12s\n", 
+        "phase", "", "calls", "ms", "blended px", "set px");
+    summary += line;
+    for (const Total& phase : phases) addRow(phase.name, "", phase);
+
+    snprintf(line, sizeof(line), "\n%-14s %-9s %8s %12s %12s %12s\n", 
+        "command", "type", "calls", "ms", "blended px", "set px");
+    summary += line;
+    for (const Total& total : top){
+        char index[24];
+        snprintf(index, sizeof(index), "%lld", total.command);
+        addRow(index, total.name, total);
+    }
+    return summary;
+}
+
+#if DRAWING_PROFILE
+namespace {
+    struct _PixelCounters {
+        unsigned long long blended = 0;
+        unsigned long long set = 0;
+    };
+    thread_local _PixelCounters _pixelCounters;
+
+    //records event of its lifetime when profiler is enabled
+    class _ProfileScope {
+        public:
+            _ProfileScope(const char* name, long long command = -1) {
+                if (!_profiling.load(std::memory_order_relaxed)) return;
+                m_event.name = name;
+                m_event.command = command;
+                m_event.blendedPixels = _pixelCounters.blended;
+                m_event.setPixels = _pixelCounters.set;
+                m_event.start = Drawing::Profiler::getInstance().getTime();
+            }
+            ~_ProfileScope(){
+                if (m_event.name == nullptr) return;
+                Drawing::Profiler& profiler = Drawing::Profiler::getInstance();
+                m_event.duration = profiler.getTime() - m_event.start;
+                m_event.blendedPixels = _pixelCounters.blended - m_event.blendedPixels;
+                m_event.setPixels = _pixelCounters.set - m_event.setPixels;
+                profiler.record(m_event);
+            }
+
+        private:
+            Drawing::ProfileEvent m_event = {};
+    };
+}
+
+#define DRAWING_PROFILE_SCOPE(...) _ProfileScope _profileScope(__VA_ARGS__)
+#define DRAWING_COUNT_BLENDED(pixels) \
+    do { if (_profiling.load(std::memory_order_relaxed)) _pixelCounters.blended += (pixels); } while (0)
+#define DRAWING_COUNT_SET(pixels) \
+    do { if (_profiling.load(std::memory_order_relaxed)) _pixelCounters.set += (pixels); } while (0)
+#else
+#define DRAWING_PROFILE_SCOPE(...) do {} while (0)
+#define DRAWING_COUNT_BLENDED(pixels) do {} while (0)
+#define DRAWING_COUNT_SET(pixels) do {} while (0)
+#endif
+
+
+static void _alignedFree(png_bytep ptr){
+#ifdef _WIN32
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+
+Drawing::FrameBuffer::FrameBuffer(png_uint_32 width, png_uint_32 height, png_byte channels, png_byte bitDepth){
+    resize(width, height, channels, bitDepth);
+}
+
+Drawing::FrameBuffer::FrameBuffer(const FrameBuffer& buffer){
+    *this = buffer;
+}
+
+Drawing::FrameBuffer::FrameBuffer(FrameBuffer&& buffer) noexcept {
+    *this = std::move(buffer);
+}
+
+Drawing::FrameBuffer::~FrameBuffer(){
+    release();
+}
+
+Drawing::FrameBuffer& Drawing::FrameBuffer::operator=(const FrameBuffer& rhs){
+    if (this == &rhs) return *this;
+    resize(rhs.m_width, rhs.m_height, rhs.m_channels, rhs.m_bitDepth);
+    if (rhs.m_data) memcpy(m_data, rhs.m_data, getSize());
+    return *this;
+}
+
+Drawing::FrameBuffer& Drawing::FrameBuffer::operator=(FrameBuffer&& rhs) noexcept {
+    if (this == &rhs) return *this;
+    release();
+    std::swap(m_data, rhs.m_data);
+    std::swap(m_capacity, rhs.m_capacity);
+    std::swap(m_stride, rhs.m_stride);
+    std::swap(m_width, rhs.m_width);
+    std::swap(m_height, rhs.m_height);
+    std::swap(m_channels, rhs.m_channels);
+    std::swap(m_bitDepth, rhs.m_bitDepth);
+    return *this;
+}
+
+void Drawing::FrameBuffer::resize(png_uint_32 width, png_uint_32 height, png_byte channels, png_byte bitDepth){
+    assert(bitDepth == 8 || bitDepth == 16);
+    const size_t stride = computeStride(width, channels*bitDepth/8);
+    const size_t size = stride*height;
+
+    if (size > m_capacity){
+        release();
+        m_data = _alignedAlloc(size);
+        m_capacity = size;
+    }
+    m_stride = stride;
+    m_width = width;
+    m_height = height;
+    m_channels = channels;
+    m_bitDepth = bitDepth;
+}
+
+void Drawing::FrameBuffer::release(void){
+    if (m_data) _alignedFree(m_data);
+    m_data = nullptr;
+    m_capacity = 0;
+    m_stride = 0;
+    m_width = 0;
+    m_height = 0;
+    m_channels = 0;
+    m_bitDepth = 8;
+}
+
+std::vector<png_bytep> Drawing::FrameBuffer::getRowPointers(void){
+    std::vector<png_bytep> rows(m_height);
+    for (png_uint_32 y=0; y<m_height; y++)
+        rows[y] = getRow(y);
+    return rows;
+}
+
+
+Drawing::FrameBuffer Drawing::FrameBufferPool::acquire(
+    png_uint_32 width, png_uint_32 height, png_byte channels, png_byte bitDepth){
+
+    const size_t size = FrameBuffer::computeStride(width, channels*bitDepth/8)*height;
+
+    FrameBuffer buffer;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        //smallest pooled buffer that fits
+        auto best = m_buffers.end();
+        for (auto it = m_buffers.begin(); it != m_buffers.end(); it++){
+            if (it->getCapacity() < size) continue;
+            if (best == m_buffers.end() || it->getCapacity() < best->getCapacity())
+                best = it;
+        }
+        if (best != m_buffers.end()){
+            buffer = std::move(*best);
+            m_buffers.erase(best);
+        }
+    }
+    buffer.resize(width, height, channels, bitDepth);
+    return buffer;
+}
+
+void Drawing::FrameBufferPool::release(FrameBuffer&& buffer){
+    if (!buffer.getData()) return;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_buffers.size() >= m_maxBuffers) return; //buffer freed by caller's destructor
+    m_buffers.push_back(std::move(buffer));
+}
+
+void Drawing::FrameBufferPool::setMaxBuffers(size_t maxBuffers){
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_maxBuffers = maxBuffers;
+    if (m_buffers.size() > maxBuffers)
+        m_buffers.resize(maxBuffers);
+}
+
+size_t Drawing::FrameBufferPool::getBuffersSize(void){
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_buffers.size();
+}
+
+void Drawing::FrameBufferPool::clear(void){
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_buffers.clear();
+}
+
+void Drawing::DirtyRegion::reset(png_uint_32 width, png_uint_32 height){
+    m_width = width;
+    m_x1.assign(height, width);
+    m_x2.assign(height, 0);
+    m_bounds = Rect();
+}
+
+void Drawing::DirtyRegion::mark(png_uint_32 x1, png_uint_32 x2, png_uint_32 y1, png_uint_32 y2){
+    if (x1 >= x2 || y1 >= y2) return;
+    for (png_uint_32 y=y1; y<y2; y++){
+        m_x1[y] = std::min(m_x1[y], x1);
+        m_x2[y] = std::max(m_x2[y], x2);
+    }
+    if (m_bounds.isEmpty()) m_bounds = Rect(x1, y1, x2, y2);
+    else m_bounds = Rect(std::min(m_bounds.x1, x1), std::min(m_bounds.y1, y1),
+        std::max(m_bounds.x2, x2), std::max(m_bounds.y2, y2));
+}
+
+void Drawing::DirtyRegion::clear(void){
+    for (png_uint_32 y=m_bounds.y1; y<m_bounds.y2; y++){
+        m_x1[y] = m_width;
+        m_x2[y] = 0;
+    }
+    m_bounds = Rect();
+}
+
+void Drawing::SpatialGrid::reset(png_uint_32 width, png_uint_32 height, png_uint_32 cellSize){
+    m_cellSize = std::max(cellSize, 1u);
+    m_width = width;
+    m_height = height;
+    m_cellsX = (width + m_cellSize-1) / m_cellSize;
+    m_cellsY = (height + m_cellSize-1) / m_cellSize;
+    //cells keep their capacity
+    m_cells.resize((size_t) m_cellsX*m_cellsY);
+    for (std::vector<unsigned>& cell : m_cells) cell.clear();
+    m_unbounded.clear();
+    m_items.clear();
+}
+
+void Drawing::SpatialGrid::_cellRange(const Drawing::Rect& rect, png_uint_32& cx1, png_uint_32& cy1, 
+    png_uint_32& cx2, png_uint_32& cy2) const {
+
+    cx1 = rect.x1 / m_cellSize;
+    cy1 = rect.y1 / m_cellSize;
+    cx2 = (rect.x2-1) / m_cellSize;
+    cy2 = (rect.y2-1) / m_cellSize;
+}
+
+//sorted insert, items are mostly appended in order
+static void _insertSorted(std::vector<unsigned>& items, unsigned item){
+    if (items.empty() || items.back() < item) items.push_back(item);
+    else items.insert(std::lower_bound(items.begin(), items.end(), item), item);
+}
+
+static void _eraseSorted(std::vector<unsigned>& items, unsigned item){
+    std::vector<unsigned>::iterator it = std::lower_bound(items.begin(), items.end(), item);
+    if (it != items.end() && *it == item) items.erase(it);
+}
+
+void Drawing::SpatialGrid::insert(unsigned item, const Drawing::Rect& bounds, bool bounded){
+    remove(item);
+    if (item >= m_items.size()) m_items.resize(item+1, Item{Rect(), ItemState::None});
+
+    Item& stored = m_items[item];
+    if (!bounded){
+        stored = Item{Rect(), ItemState::Unbounded};
+        _insertSorted(m_unbounded, item);
+        return;
+    }
+    stored = Item{bounds.intersect(Rect(0, 0, m_width, m_height)), ItemState::Bounded};
+    if (stored.bounds.isEmpty()) return;
+
+    png_uint_32 cx1, cy1, cx2, cy2;
+    _cellRange(stored.bounds, cx1, cy1, cx2, cy2);
+    for (png_uint_32 cy=cy1; cy<=cy2; cy++)
+        for (png_uint_32 cx=cx1; cx<=cx2; cx++)
+            _insertSorted(m_cells[(size_t) cy*m_cellsX + cx], item);
+}
+
+void Drawing::SpatialGrid::remove(unsigned item){
+    if (item >= m_items.size()) return;
+    Item& stored = m_items[item];
+
+    if (stored.state == ItemState::Unbounded) _eraseSorted(m_unbounded, item);
+    else if (stored.state == ItemState::Bounded && !stored.bounds.isEmpty()){
+        png_uint_32 cx1, cy1, cx2, cy2;
+        _cellRange(stored.bounds, cx1, cy1, cx2, cy2);
+        for (png_uint_32 cy=cy1; cy<=cy2; cy++)
+            for (png_uint_32 cx=cx1; cx<=cx2; cx++)
+                _eraseSorted(m_cells[(size_t) cy*m_cellsX + cx], item);
+    }
+    stored = Item{Rect(), ItemState::None};
+}
+
+void Drawing::SpatialGrid::query(const Drawing::Rect& rect, std::vector<unsigned>& out) const {
+    out.assign(m_unbounded.begin(), m_unbounded.end());
+    const Rect area = rect.intersect(Rect(0, 0, m_width, m_height));
+    if (!area.isEmpty()){
+        png_uint_32 cx1, cy1, cx2, cy2;
+        _cellRange(area, cx1, cy1, cx2, cy2);
+        for (png_uint_32 cy=cy1; cy<=cy2; cy++){
+            for (png_uint_32 cx=cx1; cx<=cx2; cx++){
+                for (unsigned item : m_cells[(size_t) cy*m_cellsX + cx])
+                    if (m_items[item].bounds.intersects(area)) out.push_back(item);
+            }
+        }
+    }
+    //items spanning several cells are found once per cell
+    std::sort(out.begin(), out.end());
+    out.erase(std::unique(out.begin(), out.end()), out.end());
+}
+
+
+static thread_local Drawing::ThreadPool* _currentPool = nullptr;
+static thread_local unsigned _currentQueue = 0;
+
+Drawing::ThreadPool::ThreadPool(unsigned workers){
+    if (workers == 0){
+        const unsigned hardwareThreads = std::thread::hardware_concurrency();
+        workers = hardwareThreads > 1 ? hardwareThreads-1 : 0;
+    }
+    for (unsigned i=0; i<workers; i++)
+        m_queues.emplace_back(new TaskQueue());
+    for (unsigned i=0; i<workers; i++)
+        m_workers.emplace_back(&ThreadPool::_workerLoop, this, i);
+}
+
+Drawing::ThreadPool::~ThreadPool(){
+    {
+        std::lock_guard<std::mutex> lock(m_sleepMutex);
+        m_stop = true;
+    }
+    m_sleepCv.notify_all();
+    for (auto& worker : m_workers)
+        worker.join();
+}
+
+void Drawing::ThreadPool::submit(std::function<void()> task){
+    if (m_workers.empty()){
+        task();
+        return;
+    }
+    //tasks spawned by a worker stay on its own queue
+    const unsigned index = _currentPool == this ? 
+        _currentQueue : m_nextQueue++ % m_queues.size();
+    {
+        std::lock_guard<std::mutex> lock(m_queues[index]->mutex);
+        m_queues[index]->tasks.push_back(std::move(task));
+    }
+    m_queued++;
+    {
+        std::lock_guard<std::mutex> lock(m_sleepMutex);
+    }
+    m_sleepCv.notify_one();
+}
+
+bool Drawing::ThreadPool::_popTask(std::function<void()>& task){
+    const size_t queuesSize = m_queues.size();
+    if (queuesSize == 0 || m_queued == 0) return false;
+
+    const bool isWorker = _currentPool == this;
+    const unsigned own = isWorker ? _currentQueue : 0;
+
+    if (isWorker){
+        //newest task of own queue first, it is most likely still in cache
+        TaskQueue& queue = *m_queues[own];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.tasks.empty()){
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+            m_queued--;
+            return true;
+        }
+    }
+    //steal oldest task from other queues
+    for (size_t i=isWorker; i<queuesSize; i++){
+        TaskQueue& queue = *m_queues[(own+i) % queuesSize];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.tasks.empty()){
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+            m_queued--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void Drawing::ThreadPool::_workerLoop(unsigned index){
+    _currentPool = this;
+    _currentQueue = index;
+
+    std::function<void()> task;
+    while (true){
+        if (_popTask(task)){
+            task();
+            task = nullptr;
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(m_sleepMutex);
+        m_sleepCv.wait(lock, [this]{ return m_stop || m_queued > 0; });
+        if (m_stop && m_queued == 0) return;
+    }
+}
+
+void Drawing::ThreadPool::parallelFor(size_t count, const std::function<void(size_t)>& fn){
+    if (m_workers.empty() || count <= 1){
+        for (size_t i=0; i<count; i++) fn(i);
+        return;
+    }
+
+    struct Latch {
+        std::atomic<size_t> remaining;
+        std::mutex mutex;
+        std::condition_variable cv;
+    };
+    auto latch = std::make_shared<Latch>();
+    latch->remaining = count;
+
+    for (size_t i=0; i<count; i++){
+        submit([latch, &fn, i](){
+            fn(i);
+            if (--latch->remaining == 0){
+                {
+                    std::lock_guard<std::mutex> lock(latch->mutex);
+                }
+                latch->cv.notify_all();
+            }
+        });
+    }
+
+    std::function<void()> task;
+    while (latch->remaining > 0){
+        if (_popTask(task)){
+            task();
+            task = nullptr;
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(latch->mutex);
+        latch->cv.wait(lock, [&latch]{ return latch->remaining == 0; });
+    }
+}
+
+
+Drawing::VertexStore::VertexStore(std::initializer_list<Point> points){
+    reserve(points.size());
+    for (const Point& point : points) push_back(point);
+}
+
+Drawing::VertexStore::VertexStore(const std::vector<Point>& points){
+    reserve(points.size());
+    for (const Point& point : points) push_back(point);
+}
+
+Drawing::VertexStore::VertexStore(const VertexStore& other){
+    *this = other;
+}
+
+Drawing::VertexStore::VertexStore(VertexStore&& other) noexcept {
+    *this = std::move(other);
+}
+
+Drawing::VertexStore& Drawing::VertexStore::operator=(const VertexStore& other){
+    if (this == &other) return *this;
+    m_size = 0;
+    reserve(other.m_size);
+    for (size_t d=0; d<Point::maxDimensions; d++)
+        std::copy(other.getComponent(d), other.getComponent(d) + other.m_size, m_data + d*m_capacity);
+    std::copy(other.m_dims, other.m_dims + other.m_size, m_dims);
+    m_size = other.m_size;
+    return *this;
+}
+
+Drawing::VertexStore& Drawing::VertexStore::operator=(VertexStore&& other) noexcept {
+    if (this == &other) return *this;
+    if (other.m_data == other.m_inline){
+        //inline vertices have to be copied
+        *this = (const VertexStore&) other;
+        other.m_size = 0;
+        return *this;
+    }
+    if (m_data != m_inline) free(m_data);
+    m_data = other.m_data;
+    m_dims = other.m_dims;
+    m_size = other.m_size;
+    m_capacity = other.m_capacity;
+
+    other.m_data = other.m_inline;
+    other.m_dims = other.m_inlineDims;
+    other.m_size = 0;
+    other.m_capacity = inlineCapacity;
+    return *this;
+}
+
+Drawing::VertexStore::~VertexStore(void){
+    if (m_data != m_inline) free(m_data);
+}
+
+void Drawing::VertexStore::reserve(size_t capacity){
+    if (capacity <= m_capacity) return;
+
+    //coordinate arrays followed by dimension bytes in one allocation
+    double* data = (double*) malloc(capacity * (Point::maxDimensions*sizeof(double) + 1));
+    if (data == nullptr) abort();
+    countAllocation(AllocationKind::VertexStore);
+    png_bytep dims = (png_bytep) (data + capacity*Point::maxDimensions);
+
+    for (size_t d=0; d<Point::maxDimensions; d++)
+        std::copy(getComponent(d), getComponent(d) + m_size, data + d*capacity);
+    std::copy(m_dims, m_dims + m_size, dims);
+
+    if (m_data != m_inline) free(m_data);
+    m_data = data;
+    m_dims = dims;
+    m_capacity = capacity;
+}
+
+void Drawing::VertexStore::push_back(const Point& point){
+    if (m_size == m_capacity) reserve(m_capacity*2);
+    _write(m_size++, point);
+}
+
+void Drawing::VertexStore::set(size_t i, const Point& point){
+    assert(i < m_size);
+    _write(i, point);
+}
+
+Drawing::Point Drawing::VertexStore::operator[](size_t i) const {
+    assert(i < m_size);
+    double coords[Point::maxDimensions];
+    for (size_t d=0; d<m_dims[i]; d++) coords[d] = m_data[d*m_capacity + i];
+    return Point(coords, m_dims[i]);
+}
+
+void Drawing::VertexStore::_write(size_t i, const Point& point){
+    for (size_t d=0; d<Point::maxDimensions; d++) m_data[d*m_capacity + i] = point[d];
+    m_dims[i] = point.size();
+}
+
+
+Drawing::Arena::~Arena(void){
+    release();
+}
+
+void* Drawing::Arena::allocate(size_t size, size_t alignment){
+    assert(alignment <= alignof(std::max_align_t) && (alignment & (alignment-1)) == 0);
+    size = std::max<size_t>(size, 1);
+
+    while (true){
+        if (m_current){
+            const size_t offset = (m_offset + alignment-1) & ~(alignment-1);
+            if (headerSize + offset + size <= m_current->size){
+                m_offset = offset + size;
+                return (png_bytep) m_current + headerSize + offset;
+            }
+            //kept block from before reset
+            if (m_current->next){
+                m_usedBefore += m_offset;
+                m_current = m_current->next;
+                m_offset = 0;
+                continue;
+            }
+        }
+
+        const size_t blockSize = std::max(m_blockSize, headerSize + size);
+        Block* block = (Block*) malloc(blockSize);
+        if (block == nullptr) abort();
+        countAllocation(AllocationKind::ArenaBlock);
+        block->size = blockSize;
+        block->next = nullptr;
+        m_capacity += blockSize;
+
+        if (m_current){
+            m_usedBefore += m_offset;
+            m_current->next = block;
+        }
+        else m_first = block;
+        m_current = block;
+        m_offset = 0;
+    }
+}
+
+void Drawing::Arena::reset(void){
+    m_current = m_first;
+    m_offset = 0;
+    m_usedBefore = 0;
+}
+
+void Drawing::Arena::release(void){
+    while (m_first){
+        Block* next = m_first->next;
+        free(m_first);
+        m_first = next;
+    }
+    m_current = nullptr;
+    m_offset = 0;
+    m_usedBefore = 0;
+    m_capacity = 0;
+}
+
+
+static bool _pointsBounds(const double* xs, const double* ys, size_t count, Drawing::Rect& bounds){
+    if (count == 0) return false;
+
+    double minX = xs[0], maxX = minX;
+    double minY = ys[0], maxY = minY;
+    for (size_t i=1; i<count; i++){
+        minX = std::min(minX, xs[i]);
+        maxX = std::max(maxX, xs[i]);
+        minY = std::min(minY, ys[i]);
+        maxY = std::max(maxY, ys[i]);
+    }
+    //conservative, pixel coordinates are truncated by draw functions
+    const double limit = (double) PNG_UINT_32_MAX;
+    bounds.x1 = (png_uint_32) std::min(std::max(floor(minX), 0.0), limit);
+    bounds.y1 = (png_uint_32) std::min(std::max(floor(minY), 0.0), limit);
+    bounds.x2 = (png_uint_32) std::min(std::max(ceil(maxX)+1, 0.0), limit);
+    bounds.y2 = (png_uint_32) std::min(std::max(ceil(maxY)+1, 0.0), limit);
+    return true;
+}
+
+bool Drawing::Drawable::getBounds(Rect& bounds) const {
+    if (m_hasBounds){
+        bounds = m_bounds;
+        return true;
+    }
+#if DEFAULT_DRAWING_FUNCS
+    if (drawFn == rect_filled || drawFn == triangle_filled || 
+        drawFn == triangle_edge || drawFn == triangle_edge_aa)
+        return _pointsBounds(points.getComponent(0), points.getComponent(1), points.size(), bounds);
+#endif
+    return false;
+}
+
 
 Drawing::Figure::Figure(Color bgColor,
-    draw_fn_ptr drawFnPtr, std::vector<Point> points){
+    draw_fn_ptr drawFnPtr, VertexStore points){
     
     this->drawFn = drawFnPtr;
     m_bgColor = bgColor;
-    this->points = points;
+    this->points = std::move(points);
+}
+
+static void _spanShaderDrawFn(Drawing::Drawable* drawable, Drawing::Canvas* canvas){
+    canvas->drawShader(*static_cast<Drawing::SpanShader*>(drawable));
+}
+
+Drawing::SpanShader::SpanShader(void){
+    this->drawFn = _spanShaderDrawFn;
+}
+
+Drawing::SpanShader::SpanShader(span_fn_ptr spanFnPtr, VertexStore points, const Rect& bounds){
+    this->drawFn = _spanShaderDrawFn;
+    this->spanFn = spanFnPtr;
+    this->points = std::move(points);
+    if (!bounds.isEmpty()) setBounds(bounds);
+}
+
+Drawing::Color Drawing::SpanShader::getPixel(png_uint_32 x, png_uint_32 y){
+    png_byte rgba[4] = {0, 0, 0, 0};
+    if (spanFn) spanFn(this, y, x, x+1, rgba);
+    return Color(rgba[0]/255.0, rgba[1]/255.0, rgba[2]/255.0, rgba[3]/255.0);
 }
 
 
 static void _imageFileDrawFn(Drawing::Drawable* drawable, Drawing::Canvas* canvas){
-    for(png_uint_32 x=0; x<canvas->getWidth(); x++){  
-        for(png_uint_32 y=0; y<canvas->getHeight(); y++){
-            canvas->putPixel(x, y, drawable->getPixel(x, y));
-        }
-    }
+    const Drawing::ImageFile* image = static_cast<Drawing::ImageFile*>(drawable);
+    const std::shared_ptr<const Drawing::FrameBuffer> pixels = image->getPixels();
+    if (!pixels) return;
+
+    canvas->blit(*pixels, Drawing::Rect(0, 0, pixels->getWidth(), pixels->getHeight()), 0, 0);
 }
 
-Drawing::ImageFile::ImageFile(const char* filename) {
-    loadPNGFile(filename);
+Drawing::ImageFile::ImageFile(const char* filename, const ImageLoadOptions& options) {
+    loadPNGFile(filename, options);
     setDrawFn(_imageFileDrawFn);
 }
 
 
-void Drawing::ImageFile::loadPNGFile(const char* filename) {
+namespace {
+    //area resampling of rows fed top to bottom, weights are overlaps of pixels
+    //in units where a source pixel has outWidth*outHeight area
+    class _AreaResampler {
+        public:
+            _AreaResampler(png_uint_32 width, png_uint_32 height, Drawing::FrameBuffer& out)
+                : m_width(width), m_height(height), m_out(out) {
+
+                const png_uint_32 outWidth = out.getWidth();
+                m_tapStart.push_back(0);
+                for (png_uint_32 x=0; x<outWidth; x++){
+                    const unsigned long long lo = (unsigned long long) x*width;
+                    const unsigned long long hi = lo + width;
+                    for (unsigned long long source=lo/outWidth; source*outWidth < hi; source++){
+                        const unsigned long long start = std::max(lo, source*outWidth);
+                        const unsigned long long end = std::min(hi, (source+1)*outWidth);
+                        m_taps.push_back({(png_uint_32) source, (png_uint_32) (end-start)});
+                    }
+                    m_tapStart.push_back(m_taps.size());
+                }
+                m_row.resize((size_t) outWidth*4);
+                m_sums.assign((size_t) outWidth*4, 0);
+            }
+
+            void addRow(png_const_bytep row){
+                Drawing::FrameBuffer& out = m_out;
+                const png_uint_32 outWidth = out.getWidth();
+                const png_uint_32 outHeight = out.getHeight();
+                if (outWidth == m_width && outHeight == m_height){
+                    memcpy(out.getRow(m_y++), row, out.getRowBytes());
+                    return;
+                }
+
+                //color is weighted by alpha, transparent pixels do not bleed into neighbours
+                for (png_uint_32 x=0; x<outWidth; x++){
+                    unsigned long long r = 0, g = 0, b = 0, a = 0;
+                    for (size_t tap=m_tapStart[x]; tap<m_tapStart[x+1]; tap++){
+                        png_const_bytep pixel = row + (size_t) m_taps[tap].source*4;
+                        const unsigned long long weight = (unsigned long long) m_taps[tap].weight*pixel[3];
+                        r += pixel[0]*weight;
+                        g += pixel[1]*weight;
+                        b += pixel[2]*weight;
+                        a += weight;
+                    }
+                    unsigned long long* sums = &m_row[(size_t) x*4];
+                    sums[0] = r; sums[1] = g; sums[2] = b; sums[3] = a;
+                }
+
+                //source row y covers [y*outHeight, (y+1)*outHeight), output row covers m_height of that
+                const unsigned long long lo = (unsigned long long) m_y*outHeight;
+                const unsigned long long hi = lo + outHeight;
+                while (m_outY < outHeight){
+                    const unsigned long long outLo = (unsigned long long) m_outY*m_height;
+                    const unsigned long long outHi = outLo + m_height;
+                    const unsigned long long weight = std::min(hi, outHi) - std::max(lo, outLo);
+                    for (size_t i=0; i<m_sums.size(); i++) m_sums[i] += m_row[i]*weight;
+                    if (outHi > hi) break;
+                    _finishRow();
+                }
+                m_y++;
+            }
+
+        private:
+            void _finishRow(void){
+                png_bytep out = m_out.getRow(m_outY++);
+                const unsigned long long area = (unsigned long long) m_width*m_height;
+                for (size_t i=0; i<m_sums.size(); i+=4){
+                    const unsigned long long a = m_sums[i+3];
+                    for (int c=0; c<3; c++) out[i+c] = a ? (m_sums[i+c] + a/2) / a : 0;
+                    out[i+3] = (a + area/2) / area;
+                    m_sums[i] = m_sums[i+1] = m_sums[i+2] = m_sums[i+3] = 0;
+                }
+            }
+
+            struct Tap {
+                png_uint_32 source;
+                png_uint_32 weight;
+            };
+
+            png_uint_32 m_width;
+            png_uint_32 m_height;
+            Drawing::FrameBuffer& m_out;
+            png_uint_32 m_y = 0;
+            png_uint_32 m_outY = 0;
+            std::vector<Tap> m_taps;
+            std::vector<size_t> m_tapStart;
+            std::vector<unsigned long long> m_row;
+            std::vector<unsigned long long> m_sums;
+    };
+}
+
+//size of decoded image for options, region is clipped to image
+static void _loadSize(const Drawing::ImageLoadOptions& options, png_uint_32 width, png_uint_32 height,
+    Drawing::Rect& region, png_uint_32& outWidth, png_uint_32& outHeight){
+
+    region = Drawing::Rect(0, 0, width, height);
+    if (!options.region.isEmpty()) region = options.region.intersect(region);
+    if (region.isEmpty()) abort();
+
+    const png_uint_32 regionWidth = region.x2-region.x1;
+    const png_uint_32 regionHeight = region.y2-region.y1;
+    outWidth = options.width;
+    outHeight = options.height;
+    if (outWidth == 0 && outHeight == 0){
+        const png_uint_32 divisor = 1u << std::min<int>(options.downscale, 31);
+        outWidth = (regionWidth + divisor-1) / divisor;
+        outHeight = (regionHeight + divisor-1) / divisor;
+    }
+    else if (outWidth == 0)
+        outWidth = std::max<unsigned long long>((unsigned long long) regionWidth*outHeight / regionHeight, 1);
+    else if (outHeight == 0)
+        outHeight = std::max<unsigned long long>((unsigned long long) regionHeight*outWidth / regionWidth, 1);
+}
+
+static std::shared_ptr<Drawing::FrameBuffer> _decodePNGFile(const char* filename, 
+    const Drawing::ImageLoadOptions& options) {
     FILE *fp = fopen(filename, "rb");
     if (!fp) abort();
 
@@ -35,366 +953,3142 @@ void Drawing::ImageFile::loadPNGFile(const char* filename) {
 
     if(setjmp(png_jmpbuf(pngPtr))) abort();
 
-    png_init_io(pngPtr, fp);
+    png_init_io(pngPtr, fp);
+
+    png_read_info(pngPtr, infoPtr);
+
+    png_uint_32 width      = png_get_image_width(pngPtr, infoPtr);
+    png_uint_32 height     = png_get_image_height(pngPtr, infoPtr);
+    png_byte color_type = png_get_color_type(pngPtr, infoPtr);
+    png_byte bit_depth  = png_get_bit_depth(pngPtr, infoPtr);
+
+    // Read any color_type into 8bit depth, RGBA format.
+    // See http://www.libpng.org/pub/png/libpng-manual.txt
+
+    if(bit_depth == 16)
+        png_set_strip_16(pngPtr);
+    
+    if(color_type == PNG_COLOR_TYPE_PALETTE)
+        png_set_palette_to_rgb(pngPtr);
+
+    // PNG_COLOR_TYPE_GRAY_ALPHA is always 8 or 16bit depth.
+    if(color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
+        png_set_expand_gray_1_2_4_to_8(pngPtr);
+
+    if(png_get_valid(pngPtr, infoPtr, PNG_INFO_tRNS))
+        png_set_tRNS_to_alpha(pngPtr);
+
+    if(color_type == PNG_COLOR_TYPE_RGB ||
+        color_type == PNG_COLOR_TYPE_GRAY ||
+        color_type == PNG_COLOR_TYPE_PALETTE)
+        png_set_filler(pngPtr, 0xFF, PNG_FILLER_AFTER);
+
+    if(color_type == PNG_COLOR_TYPE_GRAY ||
+        color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
+        png_set_gray_to_rgb(pngPtr);
+
+    const int passes = png_set_interlace_handling(pngPtr);
+    png_read_update_info(pngPtr, infoPtr);
+
+    std::shared_ptr<Drawing::FrameBuffer> buffer;
+    if (options.isDefault()){
+        buffer = std::make_shared<Drawing::FrameBuffer>(width, height, 4);
+        std::vector<png_bytep> rows = buffer->getRowPointers();
+        png_read_image(pngPtr, rows.data());
+    }
+    else {
+        Drawing::Rect region;
+        png_uint_32 outWidth, outHeight;
+        _loadSize(options, width, height, region, outWidth, outHeight);
+        buffer = std::make_shared<Drawing::FrameBuffer>(outWidth, outHeight, 4);
+        _AreaResampler resampler(region.x2-region.x1, region.y2-region.y1, *buffer);
+
+        if (passes > 1){
+            //passes need whole image
+            Drawing::FrameBuffer image(width, height, 4);
+            std::vector<png_bytep> rows = image.getRowPointers();
+            png_read_image(pngPtr, rows.data());
+            for (png_uint_32 y=region.y1; y<region.y2; y++)
+                resampler.addRow(image.getRow(y) + (size_t) region.x1*4);
+        }
+        else {
+            //rows below region are never decoded
+            std::vector<png_byte> row((size_t) width*4);
+            for (png_uint_32 y=0; y<region.y2; y++){
+                png_read_row(pngPtr, row.data(), NULL);
+                if (y >= region.y1) resampler.addRow(row.data() + (size_t) region.x1*4);
+            }
+        }
+    }
+
+    fclose(fp);
+
+    png_destroy_read_struct(&pngPtr, &infoPtr, NULL);
+    return buffer;
+}
+
+void Drawing::ImageFile::loadPNGFile(const char* filename, const ImageLoadOptions& options) {
+    if (m_buffer) abort();
+    m_buffer = ImageCache::getInstance().load(filename, options);
+}
+
+
+Drawing::ImageCache& Drawing::ImageCache::getInstance(void){
+    static ImageCache cache;
+    return cache;
+}
+
+//modification time in ns, files rewritten within one second keep st_mtime
+static long long _modifyTime(const struct stat& fileStat){
+#if defined(__APPLE__)
+    return (long long) fileStat.st_mtimespec.tv_sec*1000000000 + fileStat.st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+    return (long long) fileStat.st_mtime*1000000000;
+#else
+    return (long long) fileStat.st_mtim.tv_sec*1000000000 + fileStat.st_mtim.tv_nsec;
+#endif
+}
+
+std::shared_ptr<const Drawing::FrameBuffer> Drawing::ImageCache::load(const char* filename, 
+    const ImageLoadOptions& options){
+
+    struct stat fileStat;
+    if (stat(filename, &fileStat) != 0) abort();
+    std::string key = filename;
+    if (!options.isDefault()){
+        //'\0' cannot be part of path
+        const png_uint_32 fields[7] = {options.region.x1, options.region.y1, options.region.x2, 
+            options.region.y2, options.width, options.height, options.downscale};
+        key.push_back('\0');
+        key.append((const char*) fields, sizeof(fields));
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto found = m_entries.find(key);
+        if (found != m_entries.end()){
+            const Entry& entry = *found->second;
+            if (entry.modifyTime == _modifyTime(fileStat) && entry.fileSize == (long long) fileStat.st_size
+                && entry.device == (unsigned long long) fileStat.st_dev 
+                && entry.inode == (unsigned long long) fileStat.st_ino){
+                m_lru.splice(m_lru.begin(), m_lru, found->second); //most recently used first
+                m_hits++;
+                return found->second->pixels;
+            }
+            //file changed on disk
+            _erase(found->second);
+        }
+        m_misses++;
+    }
+
+    //decode without lock, other files can be loaded meanwhile
+    std::shared_ptr<const FrameBuffer> pixels = _decodePNGFile(filename, options);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (pixels->getSize() > m_memoryBudget || m_entries.count(key)) return pixels;
+
+    m_lru.push_front(Entry{key, _modifyTime(fileStat), (long long) fileStat.st_size, 
+        (unsigned long long) fileStat.st_dev, (unsigned long long) fileStat.st_ino, pixels});
+    m_entries[key] = m_lru.begin();
+    m_memoryUsage += pixels->getSize();
+    _evict();
+    return pixels;
+}
+
+void Drawing::ImageCache::setMemoryBudget(size_t bytes){
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_memoryBudget = bytes;
+    _evict();
+}
+
+size_t Drawing::ImageCache::getMemoryUsage(void){
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_memoryUsage;
+}
+
+size_t Drawing::ImageCache::getEntriesSize(void){
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_entries.size();
+}
+
+void Drawing::ImageCache::clear(void){
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_entries.clear();
+    m_lru.clear();
+    m_memoryUsage = 0;
+}
+
+void Drawing::ImageCache::_evict(void){
+    while (m_memoryUsage > m_memoryBudget && !m_lru.empty())
+        _erase(std::prev(m_lru.end()));
+}
+
+void Drawing::ImageCache::_erase(std::list<Entry>::iterator entry){
+    m_memoryUsage -= entry->pixels->getSize();
+    m_entries.erase(entry->key);
+    m_lru.erase(entry);
+}
+
+bool Drawing::ImageFile::getBounds(Rect& bounds) const {
+    if (Drawable::getBounds(bounds)) return true;
+    bounds = Rect(0, 0, getWidth(), getHeight());
+    return true;
+}
+
+Drawing::Color Drawing::ImageFile::getPixel(png_uint_32 x, png_uint_32 y){
+    assert(m_buffer != nullptr);
+
+    Drawing::Color color;
+    png_const_bytep row = m_buffer->getRow(y);
+    const png_byte channels = 4;
+
+    color.r = row[channels*x] / 255.0;
+    color.g = row[channels*x+1] / 255.0;
+    color.b = row[channels*x+2] / 255.0;
+    color.a = row[channels*x+3] / 255.0;
+
+    return color;
+}
+
+
+void Drawing::Canvas::_copyConstructor(const Drawing::Canvas& canvas){
+    assert(canvas.m_pngPtr != nullptr);
+    assert(canvas.m_infoPtr != nullptr);
+    assert(canvas.m_target->getData() != nullptr);
+
+    m_bufferPool = canvas.m_bufferPool;
+    if (!m_pngPtr || !(getPNGHeader() == canvas.getPNGHeader())) initImage(canvas.m_pngPtr, canvas.m_infoPtr);
+    else resetClipRect();
+    if (m_bufferPool && m_buffer.getCapacity() < canvas.m_target->getSize())
+        adoptBuffer(m_bufferPool->acquire(canvas.m_target->getWidth(), 
+            canvas.m_target->getHeight(), canvas.m_target->getChannels(), canvas.m_target->getBitDepth()));
+
+    m_buffer = *canvas.m_target;
+    m_snapshotTiles.clear();
+    m_commands = canvas.m_commands;
+    m_spatialIndexValid = false;
+    //old drawables are released before the arena they may live in
+    m_drawables = canvas.m_drawables;
+    m_arena = canvas.m_arena;
+    m_arenaScene = canvas.m_arenaScene;
+    m_clip = canvas.m_clip;
+    m_blendMode = canvas.m_blendMode;
+    setDirtyTracking(canvas.m_dirtyTracking);
+    m_threadPool = canvas.m_threadPool;
+    m_tileSize = canvas.m_tileSize;
+    m_occlusionCulling = canvas.m_occlusionCulling;
+}
+
+Drawing::Canvas::Canvas(const Drawing::Canvas& canvas){
+    _copyConstructor(canvas);
+}
+
+Drawing::Canvas::Canvas(Drawing::Canvas& canvas, const Drawing::Rect& clip){
+    m_width = canvas.m_width;
+    m_height = canvas.m_height;
+    m_target = canvas.m_target;
+    m_originX = canvas.m_originX;
+    m_originY = canvas.m_originY;
+    m_clip = canvas.m_clip.intersect(clip);
+    m_blendMode = canvas.m_blendMode;
+    m_formatOps = canvas.m_formatOps;
+}
+
+Drawing::Canvas::Canvas(Drawing::FrameBuffer& buffer, 
+    png_uint_32 width, png_uint_32 height, const Drawing::Rect& area){
+    
+    assert(buffer.getChannels() == 4 && buffer.getBitDepth() == 8);
+    m_width = width;
+    m_height = height;
+    m_target = &buffer;
+    m_originX = area.x1;
+    m_originY = area.y1;
+    m_clip = area.intersect(Rect(0, 0, width, height));
+}
+
+Drawing::Canvas::Canvas(png_uint_32 width, png_uint_32 height,
+    int bitDepth, int colorType, int interlaceMethod, int compressMethod, int filterMethod){
+    
+    initImage(width, height, bitDepth, colorType, interlaceMethod, compressMethod, filterMethod);
+    initBuffer();
+}
+
+Drawing::Canvas::~Canvas(){
+    if (m_bufferPool) m_bufferPool->release(std::move(m_buffer));
+    png_destroy_write_struct(&m_pngPtr, &m_infoPtr);
+}
+
+
+Drawing::Canvas::Canvas(Drawing::Canvas&& canvas) noexcept {
+    _swap(canvas);
+}
+
+Drawing::Canvas& Drawing::Canvas::operator=(const Drawing::Canvas& rhs){
+    if (this != &rhs) _copyConstructor(rhs);
+    return *this;
+}
+
+Drawing::Canvas& Drawing::Canvas::operator=(Drawing::Canvas&& rhs) noexcept {
+    //old buffers and structs are freed by rhs
+    if (this != &rhs) _swap(rhs);
+    return *this;
+}
+
+void Drawing::Canvas::_swap(Drawing::Canvas& rhs){
+    assert(m_target == &m_buffer && rhs.m_target == &rhs.m_buffer); //views are not moved
+
+    std::swap(m_commands, rhs.m_commands);
+    std::swap(m_arena, rhs.m_arena);
+    std::swap(m_arenaScene, rhs.m_arenaScene);
+    std::swap(m_drawables, rhs.m_drawables);
+    std::swap(m_pngPtr, rhs.m_pngPtr);
+    std::swap(m_infoPtr, rhs.m_infoPtr);
+    std::swap(m_width, rhs.m_width);
+    std::swap(m_height, rhs.m_height);
+    std::swap(m_buffer, rhs.m_buffer);
+    std::swap(m_formatOps, rhs.m_formatOps);
+    std::swap(m_bufferPool, rhs.m_bufferPool);
+    std::swap(m_clip, rhs.m_clip);
+    std::swap(m_blendMode, rhs.m_blendMode);
+    std::swap(m_dirtyRegion, rhs.m_dirtyRegion);
+    std::swap(m_dirtyReaders, rhs.m_dirtyReaders);
+    std::swap(m_dirtyTracking, rhs.m_dirtyTracking);
+    std::swap(m_snapshotTiles, rhs.m_snapshotTiles);
+    std::swap(m_snapshotTileSize, rhs.m_snapshotTileSize);
+    std::swap(m_snapshotWritten, rhs.m_snapshotWritten);
+    std::swap(m_threadPool, rhs.m_threadPool);
+    std::swap(m_tileSize, rhs.m_tileSize);
+    std::swap(m_tileBins, rhs.m_tileBins);
+    std::swap(m_tiles, rhs.m_tiles);
+    std::swap(m_occlusionCulling, rhs.m_occlusionCulling);
+    std::swap(m_culled, rhs.m_culled);
+    std::swap(m_opaqueTiles, rhs.m_opaqueTiles);
+    std::swap(m_culledSize, rhs.m_culledSize);
+    std::swap(m_spatialIndex, rhs.m_spatialIndex);
+    std::swap(m_spatialIndexValid, rhs.m_spatialIndexValid);
+}
+
+
+void Drawing::Canvas::takeSnapshot(Drawing::FrameBuffer& snapshot) const {
+    snapshot.resize(m_target->getWidth(), m_target->getHeight(), m_target->getChannels(), m_target->getBitDepth());
+    memcpy(snapshot.getData(), m_target->getData(), m_target->getSize());
+}
+
+void Drawing::Canvas::restoreSnapshot(const Drawing::FrameBuffer& snapshot){
+    assert(snapshot.getWidth() == m_target->getWidth() && snapshot.getHeight() == m_target->getHeight());
+    assert(snapshot.getStride() == m_target->getStride());
+    memcpy(m_target->getData(), snapshot.getData(), m_target->getSize());
+    markDirty(Rect(0, 0, m_width, m_height));
+}
+
+//flag per tile, set if any pixel of tile was written since last snapshot
+void Drawing::Canvas::_writtenTiles(png_uint_32 tileSize, std::vector<png_byte>& written) const {
+    const png_uint_32 tilesX = (m_width + tileSize-1) / tileSize;
+    const png_uint_32 tilesY = (m_height + tileSize-1) / tileSize;
+    written.assign((size_t) tilesX*tilesY, m_snapshotTiles.empty());
+    if (m_snapshotTiles.empty()) return;
+
+    const Rect& bounds = m_snapshotWritten.getBounds();
+    for (png_uint_32 y=bounds.y1; y<bounds.y2; y++){
+        const png_uint_32 x1 = m_snapshotWritten.getRowX1(y), x2 = m_snapshotWritten.getRowX2(y);
+        if (x1 >= x2) continue;
+        png_byte* row = &written[(size_t) (y/tileSize)*tilesX];
+        for (png_uint_32 tx=x1/tileSize; tx<=(x2-1)/tileSize; tx++) row[tx] = 1;
+    }
+}
+
+void Drawing::Canvas::takeSnapshot(Drawing::CanvasSnapshot& snapshot){
+    const png_uint_32 tileSize = snapshot.m_tileSize;
+    const png_byte channels = m_target->getChannels(), bitDepth = m_target->getBitDepth();
+    const png_byte pixelSize = m_target->getPixelSize();
+    //tiles of previous snapshot can be shared only if it has same layout
+    if (m_snapshotTileSize != tileSize) m_snapshotTiles.clear();
+    std::vector<png_byte> written;
+    _writtenTiles(tileSize, written);
+
+    const png_uint_32 tilesX = (m_width + tileSize-1) / tileSize;
+    snapshot.m_tiles.resize(written.size());
+    snapshot.m_width = m_width;
+    snapshot.m_height = m_height;
+    snapshot.m_copiedTiles = 0;
+    for (size_t tile=0; tile<written.size(); tile++){
+        if (!written[tile]){
+            snapshot.m_tiles[tile] = m_snapshotTiles[tile];
+            continue;
+        }
+        const png_uint_32 x = (tile % tilesX)*tileSize, y = (tile / tilesX)*tileSize;
+        const png_uint_32 width = std::min(tileSize, m_width-x), height = std::min(tileSize, m_height-y);
+        std::shared_ptr<FrameBuffer> copy = std::make_shared<FrameBuffer>(width, height, channels, bitDepth);
+        for (png_uint_32 row=0; row<height; row++)
+            memcpy(copy->getRow(row), _getPixelPtr(x, y+row), (size_t) width*pixelSize);
+        snapshot.m_tiles[tile] = std::move(copy);
+        snapshot.m_copiedTiles++;
+    }
+
+    m_snapshotTiles = snapshot.m_tiles;
+    m_snapshotTileSize = tileSize;
+    m_snapshotWritten.reset(m_width, m_height);
+}
+
+void Drawing::Canvas::restoreSnapshot(const Drawing::CanvasSnapshot& snapshot){
+    assert(snapshot.m_width == m_width && snapshot.m_height == m_height);
+    const png_uint_32 tileSize = snapshot.m_tileSize;
+    const png_byte pixelSize = m_target->getPixelSize();
+    if (m_snapshotTileSize != tileSize) m_snapshotTiles.clear();
+    std::vector<png_byte> written;
+    _writtenTiles(tileSize, written);
+
+    //buffer equals previous snapshot outside written tiles, so tiles shared with it are in place
+    const png_uint_32 tilesX = (m_width + tileSize-1) / tileSize;
+    for (size_t tile=0; tile<written.size(); tile++){
+        if (!written[tile] && m_snapshotTiles[tile] == snapshot.m_tiles[tile]) continue;
+
+        const FrameBuffer& stored = *snapshot.m_tiles[tile];
+        assert(stored.getPixelSize() == pixelSize);
+        const png_uint_32 x = (tile % tilesX)*tileSize, y = (tile / tilesX)*tileSize;
+        for (png_uint_32 row=0; row<stored.getHeight(); row++)
+            memcpy(_getPixelPtr(x, y+row), stored.getRow(row), (size_t) stored.getWidth()*pixelSize);
+        if (m_dirtyTracking) _markDirty(x, x+stored.getWidth(), y, y+stored.getHeight());
+    }
+
+    m_snapshotTiles = snapshot.m_tiles;
+    m_snapshotTileSize = tileSize;
+    m_snapshotWritten.reset(m_width, m_height);
+}
+
+
+
+void createPngStructs(png_structp *pngPtr, png_infop *infoPtr){
+    *pngPtr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!(*pngPtr)) abort();
+
+    *infoPtr = png_create_info_struct(*pngPtr);
+    if (!infoPtr) abort();
+
+    if (setjmp(png_jmpbuf(*pngPtr))) abort();
+}
+
+void Drawing::Canvas::initImage(png_uint_32 width, png_uint_32 height,
+    int bitDepth, int colorType, int interlaceMethod, int compressMethod, int filterMethod){
+
+    png_destroy_write_struct(&m_pngPtr, &m_infoPtr);
+    createPngStructs(&m_pngPtr, &m_infoPtr);
+    png_set_IHDR(
+        m_pngPtr, m_infoPtr, width, height,
+        bitDepth, colorType, interlaceMethod,
+        compressMethod, filterMethod
+    );
+    m_formatOps = &getPixelFormatOps(getPNGPixelFormat(bitDepth, colorType));
+    m_width = width;
+    m_height = height;
+    m_snapshotTiles.clear();
+    m_spatialIndexValid = false;
+    resetClipRect();
+}
+
+void Drawing::Canvas::initImage(const png_structp &pngPtr, const png_infop &infoPtr){
+
+    png_structp oldPngPtr = m_pngPtr;
+    png_infop oldInfoPtr = m_infoPtr;
+    createPngStructs(&m_pngPtr, &m_infoPtr);
+    png_set_IHDR(
+        m_pngPtr, m_infoPtr,
+        png_get_image_width(pngPtr, infoPtr),
+        png_get_image_height(pngPtr, infoPtr),
+        png_get_bit_depth(pngPtr, infoPtr),
+        png_get_color_type(pngPtr, infoPtr),
+        png_get_interlace_type(pngPtr, infoPtr),
+        png_get_compression_type(pngPtr, infoPtr),
+        png_get_filter_type(pngPtr, infoPtr)
+    );
+    //source may be our own structs (self assignment)
+    png_destroy_write_struct(&oldPngPtr, &oldInfoPtr);
+    m_formatOps = &getPixelFormatOps(getPNGPixelFormat(
+        png_get_bit_depth(m_pngPtr, m_infoPtr), png_get_color_type(m_pngPtr, m_infoPtr)));
+    m_width = png_get_image_width(m_pngPtr, m_infoPtr);
+    m_height = png_get_image_height(m_pngPtr, m_infoPtr);
+    m_snapshotTiles.clear();
+    m_spatialIndexValid = false;
+    resetClipRect();
+}
+
+void Drawing::Canvas::initBuffer(Color bgColor){
+    png_uint_32 height = png_get_image_height(m_pngPtr, m_infoPtr);
+    png_uint_32 width = png_get_image_width(m_pngPtr, m_infoPtr);
+    const PixelFormatOps& format = *m_formatOps;
+    size_t rowbytes = png_get_rowbytes(m_pngPtr, m_infoPtr);
+
+    if (m_bufferPool && m_buffer.getCapacity() < FrameBuffer::computeStride(width, format.pixelSize)*height)
+        adoptBuffer(m_bufferPool->acquire(width, height, format.channels, format.bitDepth));
+    m_buffer.resize(width, height, format.channels, format.bitDepth);
+
+    //set default background color on first row, then replicate it
+    png_bytep firstRow = m_buffer.getRow(0);
+    if (m_blendMode != BlendMode::Legacy){
+        png_byte premultiplied[4];
+        premultiplyColor(bgColor, premultiplied);
+        assert(format.format == PixelFormat::RGBA8);
+        for (unsigned x=0; x<rowbytes; x+=4) memcpy(firstRow+x, premultiplied, 4);
+    }
+    else format.fillRow(firstRow, width, bgColor);
+    for(unsigned y=1; y<height; y++) {
+        memcpy(m_buffer.getRow(y), firstRow, rowbytes);
+    }
+    m_snapshotTiles.clear();
+    if (m_dirtyTracking) setDirtyTracking(true);
+}
+
+void Drawing::Canvas::setBlendMode(Drawing::BlendMode mode){
+    assert(mode == BlendMode::Legacy || m_formatOps->format == PixelFormat::RGBA8);
+    const bool wasPremultiplied = isPremultiplied();
+    m_blendMode = mode;
+    if (wasPremultiplied == isPremultiplied() || m_target->getData() == nullptr) return;
+
+    for (png_uint_32 y=0; y<m_target->getHeight(); y++){
+        if (wasPremultiplied) unpremultiplyRow(m_target->getRow(y), m_target->getWidth());
+        else premultiplyRow(m_target->getRow(y), m_target->getWidth());
+    }
+    markDirty(Rect(0, 0, m_width, m_height));
+}
+
+void Drawing::Canvas::setClipRect(const Drawing::Rect& rect){
+    m_clip = rect.intersect(Rect(0, 0, m_width, m_height));
+}
+
+void Drawing::Canvas::resetClipRect(void){
+    m_clip = Rect(0, 0, m_width, m_height);
+}
+
+//readers released by their owner are held only by canvas
+static void _dropReleasedReaders(std::vector<std::shared_ptr<Drawing::DirtyRegion>>& readers){
+    readers.erase(std::remove_if(readers.begin(), readers.end(), 
+        [](const std::shared_ptr<Drawing::DirtyRegion>& reader){ return reader.use_count() == 1; }), readers.end());
+}
+
+void Drawing::Canvas::setDirtyTracking(bool enabled){
+    m_dirtyTracking = enabled;
+    _dropReleasedReaders(m_dirtyReaders);
+    if (enabled){
+        //everything is dirty for whoever looks first
+        m_dirtyRegion.reset(m_width, m_height);
+        m_dirtyRegion.markAll();
+        for (const std::shared_ptr<DirtyRegion>& reader : m_dirtyReaders){
+            reader->reset(m_width, m_height);
+            reader->markAll();
+        }
+    }
+    else m_dirtyRegion = DirtyRegion();
+}
+
+std::shared_ptr<Drawing::DirtyRegion> Drawing::Canvas::addDirtyReader(void){
+    _dropReleasedReaders(m_dirtyReaders);
+    std::shared_ptr<DirtyRegion> reader = std::make_shared<DirtyRegion>();
+    reader->reset(m_width, m_height);
+    reader->markAll();
+    m_dirtyReaders.push_back(reader);
+    return reader;
+}
+
+void Drawing::Canvas::setThreadCount(unsigned threads){
+    if (threads == 1) m_threadPool.reset();
+    else m_threadPool = std::make_shared<ThreadPool>(threads == 0 ? 0 : threads-1);
+}
+
+Drawing::FrameBuffer Drawing::Canvas::releaseBuffer(void){
+    m_snapshotTiles.clear();
+    return std::move(m_buffer);
+}
+
+void Drawing::Canvas::adoptBuffer(FrameBuffer&& buffer){
+    if (m_bufferPool) m_bufferPool->release(std::move(m_buffer));
+    m_buffer = std::move(buffer);
+    m_snapshotTiles.clear();
+    if (m_dirtyTracking) setDirtyTracking(true);
+}
+
+
+
+#define mixColor(oldColor, alphaOld, newColor, alphaNew) \
+    oldColor*alphaOld*(1-alphaNew) + newColor*alphaNew
+
+/*
+alphaMixConst = alphaOld * negAlphaConst
+negAlphaConst = (1-alphaNew)
+newColorConst = newColor * alphaNew
+*/
+#define mixColor2(oldColor, alphaMixConst, newColorConst) \
+    oldColor*alphaMixConst + newColorConst
+
+
+Drawing::SpanColor Drawing::makeSpanColor(const Drawing::Color& color){
+    Drawing::SpanColor spanColor;
+    const double a = std::min(std::max(color.a, 0.0), 1.0);
+    const png_uint_16 alpha = (png_uint_16) lround(a*256);
+    const double rgb[3] = {color.r, color.g, color.b};
+
+    for (int i=0; i<3; i++){
+        const double c = std::min(std::max(rgb[i], 0.0), 1.0);
+        spanColor.mul[i] = 256 - alpha;
+        spanColor.add[i] = (png_uint_16) lround(c*255*a*256);
+        spanColor.rgba[i] = (png_byte) (c*255);
+    }
+    //alpha channel is kept as is
+    spanColor.mul[3] = 256;
+    spanColor.add[3] = 0;
+    spanColor.rgba[3] = 0;
+    return spanColor;
+}
+
+static void _blendSpanScalar(png_bytep row, png_uint_32 count, const Drawing::SpanColor& color){
+    for (png_uint_32 i=0; i<count; i++, row+=4){
+        const unsigned opaque = row[3] == 255;
+        row[0] = (row[0]*opaque*color.mul[0] + color.add[0]) >> 8;
+        row[1] = (row[1]*opaque*color.mul[1] + color.add[1]) >> 8;
+        row[2] = (row[2]*opaque*color.mul[2] + color.add[2]) >> 8;
+    }
+}
+
+static void _setSpanScalar(png_bytep row, png_uint_32 count, const Drawing::SpanColor& color){
+    for (png_uint_32 i=0; i<count; i++, row+=4){
+        row[0] = color.rgba[0];
+        row[1] = color.rgba[1];
+        row[2] = color.rgba[2];
+    }
+}
+
+static void _blendRowScalar(png_bytep dst, png_const_bytep src, png_uint_32 count){
+    for (png_uint_32 i=0; i<count; i++, dst+=4, src+=4){
+        //0...255 alpha to 0...256 weight
+        const unsigned alpha = src[3] + (src[3] >> 7);
+        const unsigned negAlpha = (dst[3] == 255) * (256 - alpha);
+        dst[0] = (dst[0]*negAlpha + src[0]*alpha) >> 8;
+        dst[1] = (dst[1]*negAlpha + src[1]*alpha) >> 8;
+        dst[2] = (dst[2]*negAlpha + src[2]*alpha) >> 8;
+    }
+}
+
+//x/255 rounded, exact for x <= 255*255
+static inline unsigned _div255(unsigned x){
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+static inline void _compositePixel(png_bytep pixel, const png_byte color[4], Drawing::BlendMode mode){
+    const unsigned negAlpha = 255 - color[3];
+    const unsigned negDstAlpha = 255 - pixel[3];
+
+    switch (mode){
+        case Drawing::BlendMode::Over:
+            for (int c=0; c<4; c++) pixel[c] = color[c] + _div255(pixel[c]*negAlpha);
+            break;
+        case Drawing::BlendMode::Add:
+            for (int c=0; c<4; c++) pixel[c] = std::min(255u, (unsigned) pixel[c] + color[c]);
+            break;
+        case Drawing::BlendMode::Multiply:
+            for (int c=0; c<4; c++) pixel[c] = std::min(255u, 
+                _div255(color[c]*pixel[c]) + _div255(color[c]*negDstAlpha) + _div255(pixel[c]*negAlpha));
+            break;
+        default:
+            memcpy(pixel, color, 4);
+            break;
+    }
+}
+
+static void _compositeSpanScalar(png_bytep row, png_uint_32 count, const png_byte color[4], Drawing::BlendMode mode){
+    for (png_uint_32 i=0; i<count; i++, row+=4)
+        _compositePixel(row, color, mode);
+}
+
+//straight alpha source row
+static void _compositeRowScalar(png_bytep dst, png_const_bytep src, png_uint_32 count, Drawing::BlendMode mode){
+    for (png_uint_32 i=0; i<count; i++, dst+=4, src+=4){
+        const png_byte color[4] = {
+            (png_byte) _div255(src[0]*src[3]), (png_byte) _div255(src[1]*src[3]), 
+            (png_byte) _div255(src[2]*src[3]), src[3]
+        };
+        _compositePixel(dst, color, mode);
+    }
+}
+
+//c*255/a rounded for every alpha
+static const std::vector<png_uint_32>& _unpremultiplyTable(void){
+    static const std::vector<png_uint_32> table = []{
+        std::vector<png_uint_32> reciprocals(256, 0);
+        for (unsigned a=1; a<256; a++) reciprocals[a] = ((255u << 16) + a/2) / a;
+        return reciprocals;
+    }();
+    return table;
+}
+
+void Drawing::premultiplyColor(const Drawing::Color& color, png_byte out[4]){
+    const double a = std::min(std::max(color.a, 0.0), 1.0);
+    const double rgb[3] = {color.r, color.g, color.b};
+    for (int i=0; i<3; i++) out[i] = (png_byte) lround(std::min(std::max(rgb[i], 0.0), 1.0)*a*255);
+    out[3] = (png_byte) lround(a*255);
+}
+
+void Drawing::premultiplyRow(png_bytep row, png_uint_32 count){
+    for (png_uint_32 i=0; i<count; i++, row+=4){
+        row[0] = _div255(row[0]*row[3]);
+        row[1] = _div255(row[1]*row[3]);
+        row[2] = _div255(row[2]*row[3]);
+    }
+}
+
+void Drawing::unpremultiplyRow(png_bytep row, png_uint_32 count){
+    const std::vector<png_uint_32>& reciprocals = _unpremultiplyTable();
+    for (png_uint_32 i=0; i<count; i++, row+=4){
+        const png_uint_32 reciprocal = reciprocals[row[3]];
+        row[0] = std::min(255u, (row[0]*reciprocal + 0x8000) >> 16);
+        row[1] = std::min(255u, (row[1]*reciprocal + 0x8000) >> 16);
+        row[2] = std::min(255u, (row[2]*reciprocal + 0x8000) >> 16);
+    }
+}
+
+#if DRAWING_X86_SIMD
+__attribute__((target("sse2")))
+static inline __m128i _div255SSE2(__m128i x){
+    x = _mm_add_epi16(x, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+__attribute__((target("sse2")))
+static void _compositeSpanSSE2(png_bytep row, png_uint_32 count, const png_byte color[4], Drawing::BlendMode mode){
+    const __m128i zero = _mm_setzero_si128();
+    png_uint_32 rgba;
+    memcpy(&rgba, color, 4);
+    const __m128i colorBytes = _mm_set1_epi32((int) rgba);
+    const __m128i colorWords = _mm_unpacklo_epi8(colorBytes, zero);
+    const __m128i negAlpha = _mm_set1_epi16(255 - color[3]);
+    const __m128i full = _mm_set1_epi16(255);
+
+    png_uint_32 i = 0;
+    for (; i+4<=count; i+=4, row+=16){
+        const __m128i px = _mm_loadu_si128((const __m128i*) row);
+        __m128i result;
+
+        if (mode == Drawing::BlendMode::Over){
+            const __m128i lo = _mm_add_epi16(colorWords, _div255SSE2(_mm_mullo_epi16(_mm_unpacklo_epi8(px, zero), negAlpha)));
+            const __m128i hi = _mm_add_epi16(colorWords, _div255SSE2(_mm_mullo_epi16(_mm_unpackhi_epi8(px, zero), negAlpha)));
+            result = _mm_packus_epi16(lo, hi);
+        }
+        else if (mode == Drawing::BlendMode::Add){
+            result = _mm_adds_epu8(px, colorBytes);
+        }
+        else if (mode == Drawing::BlendMode::Multiply){
+            __m128i halves[2] = {_mm_unpacklo_epi8(px, zero), _mm_unpackhi_epi8(px, zero)};
+            for (__m128i& half : halves){
+                //destination alpha of every pixel to its four lanes
+                const __m128i negDstAlpha = _mm_sub_epi16(full, _mm_shufflehi_epi16(_mm_shufflelo_epi16(half, 0xFF), 0xFF));
+                half = _mm_add_epi16(_mm_add_epi16(
+                    _div255SSE2(_mm_mullo_epi16(colorWords, half)),
+                    _div255SSE2(_mm_mullo_epi16(colorWords, negDstAlpha))),
+                    _div255SSE2(_mm_mullo_epi16(half, negAlpha)));
+            }
+            result = _mm_packus_epi16(halves[0], halves[1]);
+        }
+        else result = colorBytes;
+
+        _mm_storeu_si128((__m128i*) row, result);
+    }
+    _compositeSpanScalar(row, count-i, color, mode);
+}
+
+__attribute__((target("sse2")))
+static void _blendSpanSSE2(png_bytep row, png_uint_32 count, const Drawing::SpanColor& color){
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i alphaBytes = _mm_set1_epi32((int) 0xFF000000);
+    const __m128i mul = _mm_setr_epi16(
+        color.mul[0], color.mul[1], color.mul[2], color.mul[3],
+        color.mul[0], color.mul[1], color.mul[2], color.mul[3]);
+    const __m128i add = _mm_setr_epi16(
+        color.add[0], color.add[1], color.add[2], color.add[3],
+        color.add[0], color.add[1], color.add[2], color.add[3]);
+
+    png_uint_32 i = 0;
+    for (; i+4<=count; i+=4, row+=16){
+        __m128i px = _mm_loadu_si128((const __m128i*) row);
+        //keep old color only where pixel alpha == 255, alpha byte is always kept
+        const __m128i opaque = _mm_cmpeq_epi32(_mm_and_si128(px, alphaBytes), alphaBytes);
+        px = _mm_and_si128(px, _mm_or_si128(opaque, alphaBytes));
+
+        __m128i lo = _mm_unpacklo_epi8(px, zero);
+        __m128i hi = _mm_unpackhi_epi8(px, zero);
+        lo = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(lo, mul), add), 8);
+        hi = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(hi, mul), add), 8);
+        _mm_storeu_si128((__m128i*) row, _mm_packus_epi16(lo, hi));
+    }
+    _blendSpanScalar(row, count-i, color);
+}
+
+__attribute__((target("sse2")))
+static void _setSpanSSE2(png_bytep row, png_uint_32 count, const Drawing::SpanColor& color){
+    const __m128i alphaBytes = _mm_set1_epi32((int) 0xFF000000);
+    png_uint_32 rgb;
+    memcpy(&rgb, color.rgba, 4);
+    const __m128i rgbBytes = _mm_andnot_si128(alphaBytes, _mm_set1_epi32((int) rgb));
+
+    png_uint_32 i = 0;
+    for (; i+4<=count; i+=4, row+=16){
+        const __m128i px = _mm_loadu_si128((const __m128i*) row);
+        _mm_storeu_si128((__m128i*) row, _mm_or_si128(_mm_and_si128(px, alphaBytes), rgbBytes));
+    }
+    _setSpanScalar(row, count-i, color);
+}
+
+__attribute__((target("sse2")))
+static inline __m128i _blendPixelsSSE2(__m128i dst, __m128i src){
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i alphaBytes = _mm_set1_epi32((int) 0xFF000000);
+    const __m128i opaqueDst = _mm_cmpeq_epi32(_mm_and_si128(dst, alphaBytes), alphaBytes);
+    const __m128i maskedDst = _mm_and_si128(dst, opaqueDst);
+    const __m128i full = _mm_set1_epi16(256);
+
+    __m128i srcLo = _mm_unpacklo_epi8(src, zero);
+    __m128i srcHi = _mm_unpackhi_epi8(src, zero);
+    //broadcast alpha of every pixel to its four 16-bit lanes, 0...255 to 0...256
+    __m128i alphaLo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(srcLo, 0xFF), 0xFF);
+    __m128i alphaHi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(srcHi, 0xFF), 0xFF);
+    alphaLo = _mm_add_epi16(alphaLo, _mm_srli_epi16(alphaLo, 7));
+    alphaHi = _mm_add_epi16(alphaHi, _mm_srli_epi16(alphaHi, 7));
+
+    __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(maskedDst, zero), _mm_sub_epi16(full, alphaLo)),
+        _mm_mullo_epi16(srcLo, alphaLo));
+    __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(maskedDst, zero), _mm_sub_epi16(full, alphaHi)),
+        _mm_mullo_epi16(srcHi, alphaHi));
+    const __m128i blended = _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8));
+
+    //destination alpha is kept
+    return _mm_or_si128(_mm_andnot_si128(alphaBytes, blended), _mm_and_si128(dst, alphaBytes));
+}
+
+__attribute__((target("sse2")))
+static void _blendRowSSE2(png_bytep dst, png_const_bytep src, png_uint_32 count){
+    const __m128i alphaBytes = _mm_set1_epi32((int) 0xFF000000);
+    png_uint_32 i = 0;
+    for (; i+4<=count; i+=4, dst+=16, src+=16){
+        const __m128i srcPixels = _mm_loadu_si128((const __m128i*) src);
+        const __m128i dstPixels = _mm_loadu_si128((const __m128i*) dst);
+
+        //opaque source pixels (most images) replace color
+        const __m128i opaqueSrc = _mm_cmpeq_epi32(_mm_and_si128(srcPixels, alphaBytes), alphaBytes);
+        if (_mm_movemask_epi8(opaqueSrc) == 0xFFFF){
+            _mm_storeu_si128((__m128i*) dst, _mm_or_si128(_mm_andnot_si128(alphaBytes, srcPixels), 
+                _mm_and_si128(dstPixels, alphaBytes)));
+            continue;
+        }
+        _mm_storeu_si128((__m128i*) dst, _blendPixelsSSE2(dstPixels, srcPixels));
+    }
+    _blendRowScalar(dst, src, count-i);
+}
+
+__attribute__((target("avx2")))
+static void _blendRowAVX2(png_bytep dst, png_const_bytep src, png_uint_32 count){
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i alphaBytes = _mm256_set1_epi32((int) 0xFF000000);
+    const __m256i full = _mm256_set1_epi16(256);
+
+    png_uint_32 i = 0;
+    for (; i+8<=count; i+=8, dst+=32, src+=32){
+        const __m256i srcPixels = _mm256_loadu_si256((const __m256i*) src);
+        const __m256i dstPixels = _mm256_loadu_si256((const __m256i*) dst);
+        const __m256i keptAlpha = _mm256_and_si256(dstPixels, alphaBytes);
+
+        const __m256i opaqueSrc = _mm256_cmpeq_epi32(_mm256_and_si256(srcPixels, alphaBytes), alphaBytes);
+        if (_mm256_movemask_epi8(opaqueSrc) == -1){
+            _mm256_storeu_si256((__m256i*) dst, _mm256_or_si256(_mm256_andnot_si256(alphaBytes, srcPixels), keptAlpha));
+            continue;
+        }
+
+        const __m256i opaqueDst = _mm256_cmpeq_epi32(keptAlpha, alphaBytes);
+        const __m256i maskedDst = _mm256_and_si256(dstPixels, opaqueDst);
+        const __m256i srcLo = _mm256_unpacklo_epi8(srcPixels, zero);
+        const __m256i srcHi = _mm256_unpackhi_epi8(srcPixels, zero);
+        __m256i alphaLo = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(srcLo, 0xFF), 0xFF);
+        __m256i alphaHi = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(srcHi, 0xFF), 0xFF);
+        alphaLo = _mm256_add_epi16(alphaLo, _mm256_srli_epi16(alphaLo, 7));
+        alphaHi = _mm256_add_epi16(alphaHi, _mm256_srli_epi16(alphaHi, 7));
+
+        const __m256i lo = _mm256_add_epi16(
+            _mm256_mullo_epi16(_mm256_unpacklo_epi8(maskedDst, zero), _mm256_sub_epi16(full, alphaLo)),
+            _mm256_mullo_epi16(srcLo, alphaLo));
+        const __m256i hi = _mm256_add_epi16(
+            _mm256_mullo_epi16(_mm256_unpackhi_epi8(maskedDst, zero), _mm256_sub_epi16(full, alphaHi)),
+            _mm256_mullo_epi16(srcHi, alphaHi));
+        const __m256i blended = _mm256_packus_epi16(_mm256_srli_epi16(lo, 8), _mm256_srli_epi16(hi, 8));
+        _mm256_storeu_si256((__m256i*) dst, _mm256_or_si256(_mm256_andnot_si256(alphaBytes, blended), keptAlpha));
+    }
+    _blendRowSSE2(dst, src, count-i);
+}
+
+__attribute__((target("avx2")))
+static void _blendSpanAVX2(png_bytep row, png_uint_32 count, const Drawing::SpanColor& color){
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i alphaBytes = _mm256_set1_epi32((int) 0xFF000000);
+    const __m256i mul = _mm256_setr_epi16(
+        color.mul[0], color.mul[1], color.mul[2], color.mul[3],
+        color.mul[0], color.mul[1], color.mul[2], color.mul[3],
+        color.mul[0], color.mul[1], color.mul[2], color.mul[3],
+        color.mul[0], color.mul[1], color.mul[2], color.mul[3]);
+    const __m256i add = _mm256_setr_epi16(
+        color.add[0], color.add[1], color.add[2], color.add[3],
+        color.add[0], color.add[1], color.add[2], color.add[3],
+        color.add[0], color.add[1], color.add[2], color.add[3],
+        color.add[0], color.add[1], color.add[2], color.add[3]);
+
+    png_uint_32 i = 0;
+    for (; i+8<=count; i+=8, row+=32){
+        __m256i px = _mm256_loadu_si256((const __m256i*) row);
+        const __m256i opaque = _mm256_cmpeq_epi32(_mm256_and_si256(px, alphaBytes), alphaBytes);
+        px = _mm256_and_si256(px, _mm256_or_si256(opaque, alphaBytes));
+
+        //unpack and pack work per 128-bit lane, so pixel order is preserved
+        __m256i lo = _mm256_unpacklo_epi8(px, zero);
+        __m256i hi = _mm256_unpackhi_epi8(px, zero);
+        lo = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(lo, mul), add), 8);
+        hi = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(hi, mul), add), 8);
+        _mm256_storeu_si256((__m256i*) row, _mm256_packus_epi16(lo, hi));
+    }
+    _blendSpanSSE2(row, count-i, color);
+}
+
+__attribute__((target("avx2")))
+static void _setSpanAVX2(png_bytep row, png_uint_32 count, const Drawing::SpanColor& color){
+    const __m256i alphaBytes = _mm256_set1_epi32((int) 0xFF000000);
+    png_uint_32 rgb;
+    memcpy(&rgb, color.rgba, 4);
+    const __m256i rgbBytes = _mm256_andnot_si256(alphaBytes, _mm256_set1_epi32((int) rgb));
+
+    png_uint_32 i = 0;
+    for (; i+8<=count; i+=8, row+=32){
+        const __m256i px = _mm256_loadu_si256((const __m256i*) row);
+        _mm256_storeu_si256((__m256i*) row, 
+            _mm256_or_si256(_mm256_and_si256(px, alphaBytes), rgbBytes));
+    }
+    _setSpanSSE2(row, count-i, color);
+}
+#endif
+
+//channel sum of RGBA8 pixel, same as Canvas::compare
+static inline unsigned _channelSum(png_const_bytep pixel){
+    return pixel[0] + pixel[1] + pixel[2] + pixel[3];
+}
+
+static void _compareChannelSumsScalar(png_const_bytep rowA, png_const_bytep rowB, 
+    png_uint_32 count, unsigned long long sums[3]){
+
+    for (png_uint_32 i=0; i<count; i++, rowA+=4, rowB+=4){
+        const long long channelSumA = _channelSum(rowA);
+        const long long channelSumB = _channelSum(rowB);
+        const long long diff = channelSumA - channelSumB;
+        sums[0] += diff*diff;
+        sums[1] += channelSumA*channelSumA;
+        sums[2] += channelSumB*channelSumB;
+    }
+}
+
+static void _compareChannelsScalar(png_const_bytep rowA, png_const_bytep rowB, 
+    png_uint_32 count, unsigned long long sums[4]){
+
+    for (png_uint_32 i=0; i<count; i++, rowA+=4, rowB+=4){
+        for (int c=0; c<4; c++){
+            const int diff = rowA[c] - rowB[c];
+            sums[c] += diff*diff;
+        }
+    }
+}
+
+#if DRAWING_X86_SIMD
+//per 32-bit lane: r+g+b+a of pixel
+__attribute__((target("sse2")))
+static inline __m128i _channelSumsSSE2(__m128i px){
+    const __m128i lowBytes = _mm_set1_epi16(0x00FF);
+    const __m128i pairs = _mm_add_epi16(_mm_and_si128(px, lowBytes), 
+        _mm_and_si128(_mm_srli_epi16(px, 8), lowBytes));
+    return _mm_add_epi32(_mm_and_si128(pairs, _mm_set1_epi32(0xFFFF)), _mm_srli_epi32(pairs, 16));
+}
+
+__attribute__((target("sse2")))
+static void _flushSumsSSE2(__m128i acc, unsigned long long& sum){
+    png_uint_32 lanes[4];
+    _mm_storeu_si128((__m128i*) lanes, acc);
+    sum += (unsigned long long) lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+__attribute__((target("sse2")))
+static void _compareChannelSumsSSE2(png_const_bytep rowA, png_const_bytep rowB, 
+    png_uint_32 count, unsigned long long sums[3]){
+
+    png_uint_32 i = 0;
+    while (i+8 <= count){
+        //madd of 16-bit sums adds at most 2*1020^2 per lane, flush before 32-bit overflow
+        const png_uint_32 blockEnd = std::min(count, i + 8*512);
+        __m128i accDiff = _mm_setzero_si128();
+        __m128i accA = _mm_setzero_si128();
+        __m128i accB = _mm_setzero_si128();
+
+        for (; i+8<=blockEnd; i+=8, rowA+=32, rowB+=32){
+            const __m128i sumsA = _mm_packs_epi32(
+                _channelSumsSSE2(_mm_loadu_si128((const __m128i*) rowA)),
+                _channelSumsSSE2(_mm_loadu_si128((const __m128i*) (rowA+16))));
+            const __m128i sumsB = _mm_packs_epi32(
+                _channelSumsSSE2(_mm_loadu_si128((const __m128i*) rowB)),
+                _channelSumsSSE2(_mm_loadu_si128((const __m128i*) (rowB+16))));
+            const __m128i diff = _mm_sub_epi16(sumsA, sumsB);
+
+            accDiff = _mm_add_epi32(accDiff, _mm_madd_epi16(diff, diff));
+            accA = _mm_add_epi32(accA, _mm_madd_epi16(sumsA, sumsA));
+            accB = _mm_add_epi32(accB, _mm_madd_epi16(sumsB, sumsB));
+        }
+        _flushSumsSSE2(accDiff, sums[0]);
+        _flushSumsSSE2(accA, sums[1]);
+        _flushSumsSSE2(accB, sums[2]);
+    }
+    _compareChannelSumsScalar(rowA, rowB, count-i, sums);
+}
+
+__attribute__((target("sse2")))
+static void _compareChannelsSSE2(png_const_bytep rowA, png_const_bytep rowB, 
+    png_uint_32 count, unsigned long long sums[4]){
+
+    const __m128i zero = _mm_setzero_si128();
+    png_uint_32 i = 0;
+    while (i+4 <= count){
+        //4 squares of at most 255^2 per lane and iteration
+        const png_uint_32 blockEnd = std::min(count, i + 4*8192);
+        __m128i acc = _mm_setzero_si128();
+
+        for (; i+4<=blockEnd; i+=4, rowA+=16, rowB+=16){
+            const __m128i a = _mm_loadu_si128((const __m128i*) rowA);
+            const __m128i b = _mm_loadu_si128((const __m128i*) rowB);
+            const __m128i diffLo = _mm_sub_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+            const __m128i diffHi = _mm_sub_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+            const __m128i squareLo = _mm_mullo_epi16(diffLo, diffLo);
+            const __m128i squareHi = _mm_mullo_epi16(diffHi, diffHi);
+
+            acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(squareLo, zero));
+            acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(squareLo, zero));
+            acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(squareHi, zero));
+            acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(squareHi, zero));
+        }
+        png_uint_32 lanes[4];
+        _mm_storeu_si128((__m128i*) lanes, acc);
+        for (int c=0; c<4; c++) sums[c] += lanes[c];
+    }
+    _compareChannelsScalar(rowA, rowB, count-i, sums);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i _channelSumsAVX2(__m256i px){
+    const __m256i lowBytes = _mm256_set1_epi16(0x00FF);
+    const __m256i pairs = _mm256_add_epi16(_mm256_and_si256(px, lowBytes), 
+        _mm256_and_si256(_mm256_srli_epi16(px, 8), lowBytes));
+    return _mm256_add_epi32(_mm256_and_si256(pairs, _mm256_set1_epi32(0xFFFF)), 
+        _mm256_srli_epi32(pairs, 16));
+}
+
+__attribute__((target("avx2")))
+static void _flushSumsAVX2(__m256i acc, unsigned long long& sum){
+    png_uint_32 lanes[8];
+    _mm256_storeu_si256((__m256i*) lanes, acc);
+    for (int i=0; i<8; i++) sum += lanes[i];
+}
+
+__attribute__((target("avx2")))
+static void _compareChannelSumsAVX2(png_const_bytep rowA, png_const_bytep rowB, 
+    png_uint_32 count, unsigned long long sums[3]){
+
+    png_uint_32 i = 0;
+    while (i+16 <= count){
+        const png_uint_32 blockEnd = std::min(count, i + 16*512);
+        __m256i accDiff = _mm256_setzero_si256();
+        __m256i accA = _mm256_setzero_si256();
+        __m256i accB = _mm256_setzero_si256();
+
+        //pack works per 128-bit lane, pixel order does not matter for sums
+        for (; i+16<=blockEnd; i+=16, rowA+=64, rowB+=64){
+            const __m256i sumsA = _mm256_packs_epi32(
+                _channelSumsAVX2(_mm256_loadu_si256((const __m256i*) rowA)),
+                _channelSumsAVX2(_mm256_loadu_si256((const __m256i*) (rowA+32))));
+            const __m256i sumsB = _mm256_packs_epi32(
+                _channelSumsAVX2(_mm256_loadu_si256((const __m256i*) rowB)),
+                _channelSumsAVX2(_mm256_loadu_si256((const __m256i*) (rowB+32))));
+            const __m256i diff = _mm256_sub_epi16(sumsA, sumsB);
+
+            accDiff = _mm256_add_epi32(accDiff, _mm256_madd_epi16(diff, diff));
+            accA = _mm256_add_epi32(accA, _mm256_madd_epi16(sumsA, sumsA));
+            accB = _mm256_add_epi32(accB, _mm256_madd_epi16(sumsB, sumsB));
+        }
+        _flushSumsAVX2(accDiff, sums[0]);
+        _flushSumsAVX2(accA, sums[1]);
+        _flushSumsAVX2(accB, sums[2]);
+    }
+    _compareChannelSumsSSE2(rowA, rowB, count-i, sums);
+}
+
+__attribute__((target("avx2")))
+static void _compareChannelsAVX2(png_const_bytep rowA, png_const_bytep rowB, 
+    png_uint_32 count, unsigned long long sums[4]){
+
+    const __m256i zero = _mm256_setzero_si256();
+    png_uint_32 i = 0;
+    while (i+8 <= count){
+        const png_uint_32 blockEnd = std::min(count, i + 8*4096);
+        __m256i acc = _mm256_setzero_si256();
+
+        for (; i+8<=blockEnd; i+=8, rowA+=32, rowB+=32){
+            const __m256i a = _mm256_loadu_si256((const __m256i*) rowA);
+            const __m256i b = _mm256_loadu_si256((const __m256i*) rowB);
+            const __m256i diffLo = _mm256_sub_epi16(_mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(b, zero));
+            const __m256i diffHi = _mm256_sub_epi16(_mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(b, zero));
+            const __m256i squareLo = _mm256_mullo_epi16(diffLo, diffLo);
+            const __m256i squareHi = _mm256_mullo_epi16(diffHi, diffHi);
+
+            //every 32-bit lane keeps one channel (r, g, b, a, r, g, b, a)
+            acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(squareLo, zero));
+            acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(squareLo, zero));
+            acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(squareHi, zero));
+            acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(squareHi, zero));
+        }
+        png_uint_32 lanes[8];
+        _mm256_storeu_si256((__m256i*) lanes, acc);
+        for (int c=0; c<4; c++) sums[c] += (unsigned long long) lanes[c] + lanes[c+4];
+    }
+    _compareChannelsSSE2(rowA, rowB, count-i, sums);
+}
+#endif
+
+static void _downsampleRowScalar(png_bytep dst, png_const_bytep row0, png_const_bytep row1, png_uint_32 count){
+    for (png_uint_32 i=0; i<count; i++, dst+=4, row0+=8, row1+=8)
+        for (int c=0; c<4; c++)
+            dst[c] = (row0[c] + row0[c+4] + row1[c] + row1[c+4] + 2) >> 2;
+}
+
+#if DRAWING_X86_SIMD
+__attribute__((target("sse2")))
+static void _downsampleRowSSE2(png_bytep dst, png_const_bytep row0, png_const_bytep row1, png_uint_32 count){
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i two = _mm_set1_epi16(2);
+    png_uint_32 i = 0;
+
+    //4 source pixel pairs to 2 pixels, 16-bit sums are exact
+    for (; i+4 <= count; i+=4, dst+=16, row0+=32, row1+=32){
+        __m128i out[2];
+        for (int half=0; half<2; half++){
+            const __m128i top = _mm_loadu_si128((const __m128i*) (row0 + half*16));
+            const __m128i bottom = _mm_loadu_si128((const __m128i*) (row1 + half*16));
+            //pixels 0,1 and 2,3 of both rows, per channel
+            const __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(top, zero), _mm_unpacklo_epi8(bottom, zero));
+            const __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(top, zero), _mm_unpackhi_epi8(bottom, zero));
+            //adjacent pixels added: lanes 0-3 of each
+            const __m128i sumLo = _mm_add_epi16(lo, _mm_srli_si128(lo, 8));
+            const __m128i sumHi = _mm_add_epi16(hi, _mm_srli_si128(hi, 8));
+            out[half] = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(sumLo, sumHi), two), 2);
+        }
+        _mm_storeu_si128((__m128i*) dst, _mm_packus_epi16(out[0], out[1]));
+    }
+    _downsampleRowScalar(dst, row0, row1, count-i);
+}
+#endif
+
+template<void (*spanFn)(png_bytep, png_uint_32, const Drawing::SpanColor&)>
+static void _rectKernel(png_bytep data, size_t stride, png_uint_32 width, 
+    png_uint_32 height, const Drawing::SpanColor& color){
+    
+    for (png_uint_32 y=0; y<height; y++, data+=stride)
+        spanFn(data, width, color);
+}
+
+static const Drawing::SpanKernels _spanKernels[] = {
+    {Drawing::SimdLevel::Scalar, _blendSpanScalar, _setSpanScalar,
+        _rectKernel<_blendSpanScalar>, _rectKernel<_setSpanScalar>, _blendRowScalar,
+        _compositeSpanScalar, _compareChannelSumsScalar, _compareChannelsScalar, _downsampleRowScalar},
+#if DRAWING_X86_SIMD
+    {Drawing::SimdLevel::SSE2, _blendSpanSSE2, _setSpanSSE2,
+        _rectKernel<_blendSpanSSE2>, _rectKernel<_setSpanSSE2>, _blendRowSSE2,
+        _compositeSpanSSE2, _compareChannelSumsSSE2, _compareChannelsSSE2, _downsampleRowSSE2},
+    {Drawing::SimdLevel::AVX2, _blendSpanAVX2, _setSpanAVX2,
+        _rectKernel<_blendSpanAVX2>, _rectKernel<_setSpanAVX2>, _blendRowAVX2,
+        _compositeSpanSSE2, _compareChannelSumsAVX2, _compareChannelsAVX2, _downsampleRowSSE2},
+#endif
+};
+
+Drawing::SimdLevel Drawing::detectSimdLevel(void){
+#if DRAWING_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return SimdLevel::AVX2;
+    if (__builtin_cpu_supports("sse2")) return SimdLevel::SSE2;
+#endif
+    return SimdLevel::Scalar;
+}
+
+const Drawing::SpanKernels& Drawing::getSpanKernels(Drawing::SimdLevel level){
+    static const SimdLevel detected = detectSimdLevel();
+    if (level > detected) level = detected;
+    return _spanKernels[(int) level];
+}
+
+static std::atomic<const Drawing::SpanKernels*> _activeSpanKernels(nullptr);
+
+const Drawing::SpanKernels& Drawing::getSpanKernels(void){
+    const SpanKernels* kernels = _activeSpanKernels.load(std::memory_order_relaxed);
+    if (!kernels){
+        kernels = &getSpanKernels(detectSimdLevel());
+        _activeSpanKernels.store(kernels, std::memory_order_relaxed);
+    }
+    return *kernels;
+}
+
+void Drawing::setSimdLevel(Drawing::SimdLevel level){
+    _activeSpanKernels.store(&getSpanKernels(level), std::memory_order_relaxed);
+}
+
+const char* Drawing::getSimdLevelName(Drawing::SimdLevel level){
+    switch (level){
+        case SimdLevel::SSE2: return "SSE2";
+        case SimdLevel::AVX2: return "AVX2";
+        default: return "Scalar";
+    }
+}
+
+
+//pixel format routines, one instantiation per format so channel count, 
+//sample size and alpha are constants of every loop
+template <Drawing::PixelFormat Format>
+struct _FormatOps {
+    typedef Drawing::PixelFormatTraits<Format> Traits;
+    typedef typename Traits::Sample Sample;
+    static const png_byte channels = Traits::channels;
+    static const png_byte colors = channels == 1 ? 1 : 3; //gray is one color channel
+    static const bool hasAlpha = channels == 4;
+    static const unsigned max = (1u << Traits::bitDepth) - 1;
+    static const unsigned scale8 = max / 255; //RGBA8 sample to format sample
+
+    static void colorSamples(const Drawing::Color& color, double samples[3]){
+        if (colors == 1){
+            samples[0] = 0.2126*color.r + 0.7152*color.g + 0.0722*color.b;
+            return;
+        }
+        samples[0] = color.r;
+        samples[1] = color.g;
+        samples[2] = color.b;
+    }
+
+    static double rgba8Sample(png_const_bytep src, png_byte c){
+        if (colors == 1) return 0.2126*src[0] + 0.7152*src[1] + 0.0722*src[2];
+        return src[c]*scale8;
+    }
+
+    static void fillRow(png_bytep row, png_uint_32 count, const Drawing::Color& color){
+        Sample pixel[channels];
+        double samples[3];
+        colorSamples(color, samples);
+        for (png_byte c=0; c<colors; c++) pixel[c] = samples[c]*max;
+        if (hasAlpha) pixel[3] = color.a*max;
+
+        for (png_uint_32 i=0; i<count; i++, row+=sizeof(pixel)) memcpy(row, pixel, sizeof(pixel));
+    }
+
+    //alpha of destination counts only when opaque, as in Legacy RGBA8
+    static void putPixel(png_bytep pixel, const Drawing::Color& color){
+        Sample* samples = (Sample*) pixel;
+        const double a = hasAlpha ? samples[channels-1] / (int) max : 1;
+        const double alphaMix = a * (1-color.a);
+        const double scale = max*color.a;
+
+        double values[3];
+        colorSamples(color, values);
+        for (png_byte c=0; c<colors; c++)
+            samples[c] = mixColor2(samples[c], alphaMix, values[c]*scale);
+    }
+
+    static void setPixel(png_bytep pixel, const Drawing::Color& color){
+        Sample* samples = (Sample*) pixel;
+        double values[3];
+        colorSamples(color, values);
+        for (png_byte c=0; c<colors; c++) samples[c] = values[c]*max;
+    }
+
+    static void blendRect(png_bytep data, size_t stride, png_uint_32 width, 
+        png_uint_32 height, const Drawing::Color& color){
+
+        const double negAlpha = 1-color.a;
+        const double scale = max*color.a;
+        double values[3];
+        colorSamples(color, values);
+        for (png_byte c=0; c<colors; c++) values[c] *= scale;
+
+        //opaque 8-bit formats: every sample value maps to one result, same as putPixel
+        if (sizeof(Sample) == 1 && !hasAlpha && (unsigned long long) width*height >= 256){
+            png_byte table[3][256];
+            for (png_byte c=0; c<colors; c++)
+                for (unsigned v=0; v<256; v++) table[c][v] = mixColor2(v, negAlpha, values[c]);
+
+            for (png_uint_32 y=0; y<height; y++, data+=stride){
+                png_bytep samples = data;
+                for (png_uint_32 x=0; x<width; x++, samples+=channels)
+                    for (png_byte c=0; c<colors; c++) samples[c] = table[c][samples[c]];
+            }
+            return;
+        }
+        //16-bit: 15-bit fixed point, within 1 of putPixel
+        if (sizeof(Sample) == 2){
+            const png_uint_32 negMul = lround(negAlpha*32768);
+            png_uint_32 add[3];
+            for (png_byte c=0; c<colors; c++) add[c] = lround(values[c]*32768);
+
+            for (png_uint_32 y=0; y<height; y++, data+=stride){
+                Sample* samples = (Sample*) data;
+                for (png_uint_32 x=0; x<width; x++, samples+=channels){
+                    const png_uint_32 mul = hasAlpha ? negMul*(samples[channels-1] == max) : negMul;
+                    for (png_byte c=0; c<colors; c++) samples[c] = (samples[c]*mul + add[c]) >> 15;
+                }
+            }
+            return;
+        }
+
+        for (png_uint_32 y=0; y<height; y++, data+=stride){
+            Sample* samples = (Sample*) data;
+            for (png_uint_32 x=0; x<width; x++, samples+=channels){
+                const double alphaMix = (hasAlpha ? samples[channels-1] / (int) max : 1) * negAlpha;
+                for (png_byte c=0; c<colors; c++)
+                    samples[c] = mixColor2(samples[c], alphaMix, values[c]);
+            }
+        }
+    }
+
+    static void setRect(png_bytep data, size_t stride, png_uint_32 width, 
+        png_uint_32 height, const Drawing::Color& color){
+
+        Sample pixel[3];
+        double values[3];
+        colorSamples(color, values);
+        for (png_byte c=0; c<colors; c++) pixel[c] = values[c]*max;
+
+        for (png_uint_32 y=0; y<height; y++, data+=stride){
+            Sample* samples = (Sample*) data;
+            for (png_uint_32 x=0; x<width; x++, samples+=channels)
+                for (png_byte c=0; c<colors; c++) samples[c] = pixel[c];
+        }
+    }
+
+    static void blendRow(png_bytep dst, png_const_bytep src, png_uint_32 count){
+        Sample* samples = (Sample*) dst;
+        for (png_uint_32 i=0; i<count; i++, samples+=channels, src+=4){
+            const double a = src[3] / 255.0;
+            const double keep = (hasAlpha ? samples[channels-1] == max : 1) * (1-a);
+            for (png_byte c=0; c<colors; c++)
+                samples[c] = samples[c]*keep + rgba8Sample(src, c)*a;
+        }
+    }
+
+    static void copyRow(png_bytep dst, png_const_bytep src, png_uint_32 count){
+        Sample* samples = (Sample*) dst;
+        for (png_uint_32 i=0; i<count; i++, samples+=channels, src+=4){
+            for (png_byte c=0; c<colors; c++) samples[c] = rgba8Sample(src, c);
+            if (hasAlpha) samples[channels-1] = src[3]*scale8;
+        }
+    }
+
+    static void compareChannelSums(png_const_bytep rowA, png_const_bytep rowB, 
+        png_uint_32 count, unsigned long long sums[3]){
+
+        const Sample* samplesA = (const Sample*) rowA;
+        const Sample* samplesB = (const Sample*) rowB;
+        //8-bit sums of 4096 pixels fit 32 bits
+        if (sizeof(Sample) == 1){
+            for (png_uint_32 block=0; block<count; block+=4096){
+                const png_uint_32 end = std::min(count, block+4096);
+                png_uint_32 blockSums[3] = {0, 0, 0};
+                for (png_uint_32 i=block; i<end; i++, samplesA+=channels, samplesB+=channels){
+                    png_uint_32 channelSumA = 0, channelSumB = 0;
+                    for (png_byte c=0; c<channels; c++){
+                        channelSumA += samplesA[c];
+                        channelSumB += samplesB[c];
+                    }
+                    const png_int_32 diff = channelSumA - channelSumB;
+                    blockSums[0] += diff*diff;
+                    blockSums[1] += channelSumA*channelSumA;
+                    blockSums[2] += channelSumB*channelSumB;
+                }
+                for (int k=0; k<3; k++) sums[k] += blockSums[k];
+            }
+            return;
+        }
+        for (png_uint_32 i=0; i<count; i++, samplesA+=channels, samplesB+=channels){
+            long long channelSumA = 0, channelSumB = 0;
+            for (png_byte c=0; c<channels; c++){
+                channelSumA += samplesA[c];
+                channelSumB += samplesB[c];
+            }
+            const long long diff = channelSumA - channelSumB;
+            sums[0] += diff*diff;
+            sums[1] += channelSumA*channelSumA;
+            sums[2] += channelSumB*channelSumB;
+        }
+    }
+
+    static void compareChannels(png_const_bytep rowA, png_const_bytep rowB, 
+        png_uint_32 count, unsigned long long sums[4]){
+
+        const Sample* samplesA = (const Sample*) rowA;
+        const Sample* samplesB = (const Sample*) rowB;
+        if (sizeof(Sample) == 1){
+            for (png_uint_32 block=0; block<count; block+=65536){
+                const png_uint_32 end = std::min(count, block+65536);
+                png_uint_32 blockSums[4] = {0, 0, 0, 0};
+                for (png_uint_32 i=block; i<end; i++, samplesA+=channels, samplesB+=channels){
+                    for (png_byte c=0; c<channels; c++){
+                        const png_int_32 diff = (png_int_32) samplesA[c] - samplesB[c];
+                        blockSums[c] += diff*diff;
+                    }
+                }
+                for (png_byte c=0; c<channels; c++) sums[c] += blockSums[c];
+            }
+            return;
+        }
+        for (png_uint_32 i=0; i<count; i++, samplesA+=channels, samplesB+=channels){
+            for (png_byte c=0; c<channels; c++){
+                const long long diff = (long long) samplesA[c] - samplesB[c];
+                sums[c] += diff*diff;
+            }
+        }
+    }
+
+    static Drawing::PixelFormatOps get(void){
+        return {Format, channels, Traits::bitDepth, (png_byte) sizeof(Sample[channels]),
+            fillRow, putPixel, setPixel, blendRect, setRect, blendRow, copyRow,
+            compareChannelSums, compareChannels};
+    }
+};
+
+//RGBA8 rects, rows and compares go through span kernels of active SIMD level
+static void _blendRectRGBA8(png_bytep data, size_t stride, png_uint_32 width, 
+    png_uint_32 height, const Drawing::Color& color){
+    Drawing::getSpanKernels().blendRect(data, stride, width, height, Drawing::makeSpanColor(color));
+}
+
+static void _setRectRGBA8(png_bytep data, size_t stride, png_uint_32 width, 
+    png_uint_32 height, const Drawing::Color& color){
+    Drawing::getSpanKernels().setRect(data, stride, width, height, Drawing::makeSpanColor(color));
+}
+
+static void _blendRowRGBA8(png_bytep dst, png_const_bytep src, png_uint_32 count){
+    Drawing::getSpanKernels().blendRow(dst, src, count);
+}
+
+static void _copyRowRGBA8(png_bytep dst, png_const_bytep src, png_uint_32 count){
+    memcpy(dst, src, (size_t) count*4);
+}
+
+static void _compareChannelSumsRGBA8(png_const_bytep rowA, png_const_bytep rowB, 
+    png_uint_32 count, unsigned long long sums[3]){
+    Drawing::getSpanKernels().compareChannelSums(rowA, rowB, count, sums);
+}
+
+static void _compareChannelsRGBA8(png_const_bytep rowA, png_const_bytep rowB, 
+    png_uint_32 count, unsigned long long sums[4]){
+    Drawing::getSpanKernels().compareChannels(rowA, rowB, count, sums);
+}
+
+static Drawing::PixelFormatOps _formatOpsRGBA8(void){
+    Drawing::PixelFormatOps ops = _FormatOps<Drawing::PixelFormat::RGBA8>::get();
+    ops.blendRect = _blendRectRGBA8;
+    ops.setRect = _setRectRGBA8;
+    ops.blendRow = _blendRowRGBA8;
+    ops.copyRow = _copyRowRGBA8;
+    ops.compareChannelSums = _compareChannelSumsRGBA8;
+    ops.compareChannels = _compareChannelsRGBA8;
+    return ops;
+}
+
+const Drawing::PixelFormatOps& Drawing::getPixelFormatOps(Drawing::PixelFormat format){
+    //indexed by PixelFormat, built on first use so canvases of static storage can use it
+    static const PixelFormatOps formatOps[] = {
+        _formatOpsRGBA8(),
+        _FormatOps<PixelFormat::RGB8>::get(),
+        _FormatOps<PixelFormat::Gray8>::get(),
+        _FormatOps<PixelFormat::RGBA16>::get(),
+    };
+    return formatOps[(int) format];
+}
+
+Drawing::PixelFormat Drawing::getPNGPixelFormat(int bitDepth, int colorType){
+    if (bitDepth == 8 && colorType == PNG_COLOR_TYPE_RGBA) return PixelFormat::RGBA8;
+    if (bitDepth == 8 && colorType == PNG_COLOR_TYPE_RGB) return PixelFormat::RGB8;
+    if (bitDepth == 8 && colorType == PNG_COLOR_TYPE_GRAY) return PixelFormat::Gray8;
+    if (bitDepth == 16 && colorType == PNG_COLOR_TYPE_RGBA) return PixelFormat::RGBA16;
+    abort();
+}
+
+
+void Drawing::Canvas::putPixel(
+    png_uint_32 x, png_uint_32 y, Drawing::Color color){
+    
+    if (!m_clip.contains(x, y)) return;
+    _markWritten(x, x+1, y, y+1);
+    DRAWING_COUNT_BLENDED(1);
+    png_bytep pixel = _getPixelPtr(x, y);
+
+    if (m_blendMode != BlendMode::Legacy){
+        png_byte premultiplied[4];
+        premultiplyColor(color, premultiplied);
+        _compositePixel(pixel, premultiplied, m_blendMode);
+        return;
+    }
+    m_formatOps->putPixel(pixel, color);
+}
+
+void Drawing::Canvas::setPixel(
+    png_uint_32 x, png_uint_32 y, Drawing::Color color){
+
+    if (!m_clip.contains(x, y)) return;
+    _markWritten(x, x+1, y, y+1);
+    DRAWING_COUNT_SET(1);
+
+    png_bytep pixel = _getPixelPtr(x, y);
+    if (m_blendMode != BlendMode::Legacy){
+        premultiplyColor(color, pixel);
+        return;
+    }
+    m_formatOps->setPixel(pixel, color);
+}
+
+void Drawing::Canvas::fillputPixels(
+    png_uint_32 x1, png_uint_32 x2, png_uint_32 y, 
+    Drawing::Color color){
+
+    fillputPixels(x1, x2, y, y+1, color);
+}
+void Drawing::Canvas::fillputPixels(png_uint_32 x1, png_uint_32 x2,
+    png_uint_32 y1, png_uint_32 y2, Drawing::Color color){
+
+    x1 = std::max(x1, m_clip.x1);
+    x2 = std::min(x2, m_clip.x2);
+    y1 = std::max(y1, m_clip.y1);
+    y2 = std::min(y2, m_clip.y2);
+    if (x1 >= x2 || y1 >= y2) return;
+    _markWritten(x1, x2, y1, y2);
+    DRAWING_COUNT_BLENDED((unsigned long long) (x2-x1)*(y2-y1));
+
+    if (m_blendMode != BlendMode::Legacy){
+        png_byte premultiplied[4];
+        premultiplyColor(color, premultiplied);
+        const SpanKernels& kernels = getSpanKernels();
+        for (png_uint_32 y=y1; y<y2; y++)
+            kernels.compositeSpan(_getPixelPtr(x1, y), x2-x1, premultiplied, m_blendMode);
+        return;
+    }
+    m_formatOps->blendRect(_getPixelPtr(x1, y1), m_target->getStride(), x2-x1, y2-y1, color);
+}
+
+void Drawing::Canvas::fillsetPixels(
+    png_uint_32 x1, png_uint_32 x2, png_uint_32 y, 
+    Drawing::Color color){
+    
+    fillsetPixels(x1, x2, y, y+1, color);
+}
+void Drawing::Canvas::fillsetPixels(png_uint_32 x1, png_uint_32 x2,
+    png_uint_32 y1, png_uint_32 y2, Drawing::Color color){
+    
+    x1 = std::max(x1, m_clip.x1);
+    x2 = std::min(x2, m_clip.x2);
+    y1 = std::max(y1, m_clip.y1);
+    y2 = std::min(y2, m_clip.y2);
+    if (x1 >= x2 || y1 >= y2) return;
+    _markWritten(x1, x2, y1, y2);
+    DRAWING_COUNT_SET((unsigned long long) (x2-x1)*(y2-y1));
+
+    if (m_blendMode != BlendMode::Legacy){
+        png_byte premultiplied[4];
+        premultiplyColor(color, premultiplied);
+        const SpanKernels& kernels = getSpanKernels();
+        for (png_uint_32 y=y1; y<y2; y++)
+            kernels.compositeSpan(_getPixelPtr(x1, y), x2-x1, premultiplied, BlendMode::Source);
+        return;
+    }
+    m_formatOps->setRect(_getPixelPtr(x1, y1), m_target->getStride(), x2-x1, y2-y1, color);
+}
+
+
+
+
+void Drawing::Canvas::blit(const Drawing::FrameBuffer& source, const Drawing::Rect& sourceRect,
+    png_uint_32 x, png_uint_32 y, Drawing::BlitMode mode){
+
+    assert(source.getChannels() == 4 && source.getBitDepth() == 8);
+    
+    //clip to source, then destination
+    Rect src = sourceRect.intersect(Rect(0, 0, source.getWidth(), source.getHeight()));
+    if (src.isEmpty()) return;
+    const long long offsetX = (long long) x - src.x1;
+    const long long offsetY = (long long) y - src.y1;
+    const Rect dst = Rect(
+        std::min<long long>(src.x1 + offsetX, PNG_UINT_32_MAX), std::min<long long>(src.y1 + offsetY, PNG_UINT_32_MAX),
+        std::min<long long>(src.x2 + offsetX, PNG_UINT_32_MAX), std::min<long long>(src.y2 + offsetY, PNG_UINT_32_MAX)
+    ).intersect(m_clip);
+    if (dst.isEmpty()) return;
+    src = Rect(dst.x1 - offsetX, dst.y1 - offsetY, dst.x2 - offsetX, dst.y2 - offsetY);
+
+    _markWritten(dst.x1, dst.x2, dst.y1, dst.y2);
+    const png_uint_32 width = dst.x2 - dst.x1;
+    if (mode == BlitMode::Copy) DRAWING_COUNT_SET((unsigned long long) width*(dst.y2-dst.y1));
+    else DRAWING_COUNT_BLENDED((unsigned long long) width*(dst.y2-dst.y1));
+
+    for (png_uint_32 row=0; row<dst.y2-dst.y1; row++)
+        _blitRow(_getPixelPtr(dst.x1, dst.y1+row), source.getRow(src.y1+row) + (size_t) src.x1*4, width, mode);
+}
+
+void Drawing::Canvas::_blitRow(png_bytep dstRow, png_const_bytep srcRow, png_uint_32 width, Drawing::BlitMode mode){
+    if (m_blendMode != BlendMode::Legacy){
+        _compositeRowScalar(dstRow, srcRow, width, mode == BlitMode::Copy ? BlendMode::Source : m_blendMode);
+        return;
+    }
+
+    if (mode == BlitMode::Copy) m_formatOps->copyRow(dstRow, srcRow, width);
+    else m_formatOps->blendRow(dstRow, srcRow, width);
+}
+
+void Drawing::Canvas::drawShader(const Drawing::SpanShader& shader){
+    Rect area = m_clip, bounds;
+    if (shader.getBounds(bounds)) area = area.intersect(bounds);
+    if (area.isEmpty() || !shader.spanFn) return;
+
+    _markWritten(area.x1, area.x2, area.y1, area.y2);
+    const png_uint_32 width = area.x2 - area.x1;
+    DRAWING_COUNT_BLENDED((unsigned long long) width*(area.y2-area.y1));
+
+    _parallelRows(area.y2 - area.y1, [&](png_uint_32 y1, png_uint_32 y2){
+        std::vector<png_byte> rgba((size_t) width*4);
+        for (png_uint_32 y=area.y1+y1; y<area.y1+y2; y++){
+            shader.spanFn(&shader, y, area.x1, area.x2, rgba.data());
+            _blitRow(_getPixelPtr(area.x1, y), rgba.data(), width, BlitMode::AlphaOver);
+        }
+    });
+}
+
+
+static void _triangleScanline(Drawing::Canvas* canvas, const double x[3], const double y[3], 
+    const Drawing::Color& color);
+static void _triangleEdges(Drawing::Canvas* canvas, const double x[3], const double y[3], 
+    const Drawing::Color& color, bool antialiased);
+static bool _pointsBounds(const double* xs, const double* ys, size_t count, Drawing::Rect& bounds);
+
+void Drawing::Canvas::_storeCommand(const DrawCommand& command, size_t index, std::shared_ptr<Drawable> owner){
+    assert(index <= m_commands.size());
+    DrawCommand stored = command;
+
+    //replaced command's owner slot is reused
+    const bool hasSlot = index < m_commands.size() && (m_commands[index].type == CommandType::Image 
+        || m_commands[index].type == CommandType::Callback);
+    if (owner){
+        if (hasSlot){
+            stored.drawable = m_commands[index].drawable;
+            m_drawables[stored.drawable] = owner;
+        }
+        else {
+            stored.drawable = m_drawables.size();
+            if (m_drawables.size() == m_drawables.capacity()) countAllocation(AllocationKind::SceneList);
+            m_drawables.push_back(owner);
+        }
+    }
+    else if (hasSlot) m_drawables[m_commands[index].drawable] = nullptr;
+
+    if (m_spatialIndexValid){
+        Rect bounds;
+        const bool bounded = _getCommandBounds(stored, bounds);
+        m_spatialIndex.insert(index, bounds, bounded);
+    }
+    if (index < m_commands.size()){
+        m_commands[index] = stored;
+        return;
+    }
+    if (m_commands.size() == m_commands.capacity()) countAllocation(AllocationKind::SceneList);
+    m_commands.push_back(stored);
+}
+
+void Drawing::Canvas::setArenaScene(bool enabled){
+    if (enabled && !m_arena) m_arena = std::make_shared<Arena>();
+    m_arenaScene = enabled;
+}
+
+void Drawing::Canvas::clearDrawables(void){
+    m_commands.clear();
+    m_drawables.clear();
+    m_spatialIndexValid = false;
+    if (!m_arena) return;
+
+    //copies of canvas may still draw drawables from shared arena,
+    //and every drawable allocated from it holds a reference too
+    if (m_arena.use_count() == 1) m_arena->reset();
+    else if (m_arenaScene) m_arena = std::make_shared<Arena>(m_arena->getBlockSize());
+    else m_arena = nullptr;
+}
+
+void Drawing::Canvas::_storeDrawable(std::shared_ptr<Drawable> drawable, size_t index){
+    DrawCommand command = DrawCommand();
+    command.type = CommandType::Callback;
+    _storeCommand(command, index, drawable);
+}
+
+void Drawing::Canvas::_storeFigure(const Figure& figure, size_t index){
+    DrawCommand command = DrawCommand();
+    command.color = figure.getColor();
+    command.explicitBounds = figure.getBounds(command.bounds) && figure.hasExplicitBounds();
+    const VertexStore& points = figure.points;
+
+#if DEFAULT_DRAWING_FUNCS
+    if (figure.drawFn == rect_filled && points.size() >= 2){
+        command.type = CommandType::Rect;
+        command.rect = {points.x(0), points.y(0), points.x(1), points.y(1)};
+    }
+    else if ((figure.drawFn == triangle_filled || figure.drawFn == triangle_edge 
+        || figure.drawFn == triangle_edge_aa) && points.size() >= 3){
+        
+        command.type = CommandType::Triangle;
+        command.triangleMode = figure.drawFn == triangle_filled ? TriangleMode::Scanline
+            : figure.drawFn == triangle_edge ? TriangleMode::Edge : TriangleMode::EdgeAA;
+        for (int i=0; i<3; i++){
+            command.triangle.x[i] = points.x(i);
+            command.triangle.y[i] = points.y(i);
+        }
+    }
+    else
+#endif
+    {
+        _storeDrawable(_copyDrawable<Figure>(figure), index);
+        return;
+    }
+    _storeCommand(command, index);
+}
+
+void Drawing::Canvas::_storeImage(const ImageFile& image, size_t index){
+    std::shared_ptr<Drawable> owner = _copyDrawable<ImageFile>(image);
+    //image with own draw function is drawn through it
+    if (image.drawFn != _imageFileDrawFn){
+        _storeDrawable(owner, index);
+        return;
+    }
+    DrawCommand command = DrawCommand();
+    command.type = CommandType::Image;
+    command.image = {image.getPixels().get(), 0, 0};
+    image.getBounds(command.bounds);
+    _storeCommand(command, index, owner);
+}
+
+void Drawing::Canvas::addRect(double x1, double y1, double x2, double y2, Drawing::Color color){
+    DrawCommand command = DrawCommand();
+    command.type = CommandType::Rect;
+    command.color = color;
+    command.rect = {x1, y1, x2, y2};
+    const double xs[2] = {x1, x2}, ys[2] = {y1, y2};
+    _pointsBounds(xs, ys, 2, command.bounds);
+    _storeCommand(command, m_commands.size());
+}
+
+void Drawing::Canvas::addTriangle(const Drawing::Point2d& a, const Drawing::Point2d& b, 
+    const Drawing::Point2d& c, Drawing::Color color, Drawing::TriangleMode mode){
+    
+    DrawCommand command = DrawCommand();
+    command.type = CommandType::Triangle;
+    command.triangleMode = mode;
+    command.color = color;
+    command.triangle = {{a.x(), b.x(), c.x()}, {a.y(), b.y(), c.y()}};
+    _pointsBounds(command.triangle.x, command.triangle.y, 3, command.bounds);
+    _storeCommand(command, m_commands.size());
+}
+
+std::shared_ptr<Drawing::Drawable> Drawing::Canvas::getDrawable(const unsigned index){
+    assert(index < m_commands.size());
+    const DrawCommand& command = m_commands[index];
+    if (command.type == CommandType::Callback)
+        return m_drawables[command.drawable];
+
+    //caller may change it (e.g. its drawFn), so it becomes the owner of a callback command
+    std::shared_ptr<Drawable> owner = command.type == CommandType::Image 
+        ? m_drawables[command.drawable] : copyDrawable(index);
+    _storeDrawable(owner, index);
+    return owner;
+}
+
+std::shared_ptr<Drawing::Drawable> Drawing::Canvas::copyDrawable(const unsigned index) const {
+    assert(index < m_commands.size());
+    const DrawCommand& command = m_commands[index];
+    if (command.type == CommandType::Image)
+        return std::make_shared<ImageFile>(static_cast<const ImageFile&>(*m_drawables[command.drawable]));
+    if (command.type == CommandType::Callback)
+        return m_drawables[command.drawable];
+
+    std::shared_ptr<Figure> figure;
+    if (command.type == CommandType::Rect){
+        figure = std::make_shared<Figure>(command.color, nullptr, VertexStore{
+            Point({command.rect.x1, command.rect.y1}), Point({command.rect.x2, command.rect.y2})
+        });
+#if DEFAULT_DRAWING_FUNCS
+        figure->drawFn = rect_filled;
+#endif
+    }
+    else {
+        const DrawCommand::TriangleData& triangle = command.triangle;
+        figure = std::make_shared<Figure>(command.color, nullptr, VertexStore{
+            Point({triangle.x[0], triangle.y[0]}), Point({triangle.x[1], triangle.y[1]}), 
+            Point({triangle.x[2], triangle.y[2]})
+        });
+#if DEFAULT_DRAWING_FUNCS
+        figure->drawFn = command.triangleMode == TriangleMode::Scanline ? triangle_filled
+            : command.triangleMode == TriangleMode::Edge ? triangle_edge : triangle_edge_aa;
+#endif
+    }
+    if (command.explicitBounds) figure->setBounds(command.bounds);
+    return figure;
+}
+
+bool Drawing::Canvas::_getCommandBounds(const DrawCommand& command, Rect& bounds) const {
+    if (command.type != CommandType::Callback){
+        bounds = command.bounds;
+        return true;
+    }
+    const Drawable* drawable = m_drawables[command.drawable].get();
+    if (drawable->drawFn == nullptr){
+        bounds = Rect(); //draws nothing
+        return true;
+    }
+    return drawable->getBounds(bounds);
+}
+
+#if DRAWING_PROFILE
+static const char* _commandTypeName(Drawing::CommandType type){
+    switch (type){
+        case Drawing::CommandType::Rect: return "rect";
+        case Drawing::CommandType::Triangle: return "triangle";
+        case Drawing::CommandType::Image: return "image";
+        default: return "callback";
+    }
+}
+#endif
+
+void Drawing::Canvas::_drawCommand(const DrawCommand& command, Canvas* target){
+    DRAWING_PROFILE_SCOPE(_commandTypeName(command.type), &command - m_commands.data());
+    switch (command.type){
+        case CommandType::Rect:
+            target->fillputPixels(command.rect.x1, command.rect.x2, 
+                command.rect.y1, command.rect.y2, command.color);
+            break;
+        case CommandType::Triangle:
+            if (command.triangleMode == TriangleMode::Scanline)
+                _triangleScanline(target, command.triangle.x, command.triangle.y, command.color);
+            else
+                _triangleEdges(target, command.triangle.x, command.triangle.y, command.color, 
+                    command.triangleMode == TriangleMode::EdgeAA);
+            break;
+        case CommandType::Image:
+            if (command.image.pixels == nullptr) break;
+            target->blit(*command.image.pixels, Rect(0, 0, command.image.pixels->getWidth(), 
+                command.image.pixels->getHeight()), command.image.x, command.image.y);
+            break;
+        case CommandType::Callback: {
+            Drawable* drawable = m_drawables[command.drawable].get();
+            if (drawable->drawFn != nullptr) drawable->drawFn(drawable, target);
+            break;
+        }
+    }
+}
+
+
+static const png_uint_32 _cullTileSize = 8;
+
+//coordinates draw functions convert to pixels without wrapping
+static bool _cullableCoordinates(const double* values, int count){
+    const double limit = (double) (1 << 20);
+    for (int i=0; i<count; i++)
+        if (!(values[i] >= 0.0 && values[i] < limit)) return false;
+    return true;
+}
+
+//point inside or on edges of triangle with counter-clockwise vertices
+static bool _insideTriangle(const double x[3], const double y[3], double px, double py){
+    for (int i=0; i<3; i++){
+        const int j = (i+1) % 3;
+        if ((x[j]-x[i])*(py-y[i]) - (y[j]-y[i])*(px-x[i]) < 0.0) return false;
+    }
+    return true;
+}
+
+void Drawing::Canvas::_cullCommands(void){
+    m_culled.assign(m_commands.size(), 0);
+    m_culledSize = 0;
+    //only these modes overwrite pixels under opaque colors regardless of what was there
+    if (!m_occlusionCulling || (m_blendMode != BlendMode::Legacy && m_blendMode != BlendMode::Over)) return;
+
+    const Rect area = m_clip;
+    if (area.isEmpty() || m_commands.size() < 2) return;
+    const png_uint_32 tilesX = (area.x2-area.x1 + _cullTileSize-1) / _cullTileSize;
+    const png_uint_32 tilesY = (area.y2-area.y1 + _cullTileSize-1) / _cullTileSize;
+
+    //tile is covered by opaque commands drawn later when it holds current pass,
+    //pass changes to drop every tile at once
+    m_opaqueTiles.assign((size_t) tilesX*tilesY, 0);
+    png_uint_32 pass = 1;
+    bool anyOpaque = false;
+
+    //walk back to front, every command sees only coverage of commands drawn after it
+    for (size_t i=m_commands.size(); i-- > 0;){
+        const DrawCommand& command = m_commands[i];
+        if (command.type == CommandType::Image) continue; //writes only its bounds
+        if (command.type == CommandType::Callback){
+            //may read pixels anywhere, e.g. to copy them
+            if (anyOpaque) pass++;
+            anyOpaque = false;
+            continue;
+        }
+
+        double xs[3], ys[3];
+        int count = 3;
+        if (command.type == CommandType::Rect){
+            xs[0] = command.rect.x1; xs[1] = command.rect.x2;
+            ys[0] = command.rect.y1; ys[1] = command.rect.y2;
+            count = 2;
+        }
+        else {
+            memcpy(xs, command.triangle.x, sizeof(xs));
+            memcpy(ys, command.triangle.y, sizeof(ys));
+        }
+        if (!_cullableCoordinates(xs, count) || !_cullableCoordinates(ys, count)) continue;
+
+        //pixels that may be written, as _pointsBounds
+        const Rect footprint = Rect(
+            floor(*std::min_element(xs, xs+count)), floor(*std::min_element(ys, ys+count)),
+            ceil(*std::max_element(xs, xs+count))+1, ceil(*std::max_element(ys, ys+count))+1
+        ).intersect(area);
+        if (footprint.isEmpty()){
+            m_culled[i] = 1;
+            m_culledSize++;
+            continue;
+        }
+        const png_uint_32 tx1 = (footprint.x1-area.x1) / _cullTileSize;
+        const png_uint_32 tx2 = (footprint.x2-1-area.x1) / _cullTileSize;
+        const png_uint_32 ty1 = (footprint.y1-area.y1) / _cullTileSize;
+        const png_uint_32 ty2 = (footprint.y2-1-area.y1) / _cullTileSize;
+
+        if (anyOpaque){
+            bool covered = true;
+            for (png_uint_32 ty=ty1; ty<=ty2 && covered; ty++)
+                for (png_uint_32 tx=tx1; tx<=tx2 && covered; tx++)
+                    covered = m_opaqueTiles[(size_t) ty*tilesX + tx] == pass;
+            if (covered){
+                m_culled[i] = 1;
+                m_culledSize++;
+                continue;
+            }
+        }
+
+        //antialiased edges blend, so those triangles never occlude
+        if (command.color.a != 1.0) continue;
+        if (command.type == CommandType::Triangle && command.triangleMode == TriangleMode::EdgeAA) continue;
+        const double area2 = (xs[1]-xs[0])*(ys[2]-ys[0]) - (ys[1]-ys[0])*(xs[2]-xs[0]);
+        if (command.type == CommandType::Triangle){
+            if (area2 == 0.0) continue;
+            if (area2 < 0.0){
+                std::swap(xs[1], xs[2]);
+                std::swap(ys[1], ys[2]);
+            }
+        }
+
+        for (png_uint_32 ty=ty1; ty<=ty2; ty++){
+            for (png_uint_32 tx=tx1; tx<=tx2; tx++){
+                //pixels of tile that can be drawn at all
+                const Rect tile = Rect(area.x1 + tx*_cullTileSize, area.y1 + ty*_cullTileSize,
+                    area.x1 + (tx+1)*_cullTileSize, area.y1 + (ty+1)*_cullTileSize).intersect(area);
+
+                bool opaque;
+                if (command.type == CommandType::Rect){
+                    //draw functions truncate coordinates
+                    opaque = ceil(xs[0]) <= tile.x1 && tile.x2 <= floor(xs[1]) && 
+                        ceil(ys[0]) <= tile.y1 && tile.y2 <= floor(ys[1]);
+                }
+                else {
+                    //tile grown by 1px margin inside triangle, scanline rows and
+                    //sample positions of the edge rasterizer are then all within it
+                    const double x1 = tile.x1 - 1.0, x2 = tile.x2 + 1.0;
+                    const double y1 = tile.y1 - 1.0, y2 = tile.y2 + 1.0;
+                    opaque = _insideTriangle(xs, ys, x1, y1) && _insideTriangle(xs, ys, x2, y1) &&
+                        _insideTriangle(xs, ys, x1, y2) && _insideTriangle(xs, ys, x2, y2);
+                }
+                if (opaque){
+                    m_opaqueTiles[(size_t) ty*tilesX + tx] = pass;
+                    anyOpaque = true;
+                }
+            }
+        }
+    }
+}
+
+void Drawing::Canvas::draw(){
+    DRAWING_PROFILE_SCOPE("draw");
+    assert(m_target->getData() != nullptr);
+    assert(m_pngPtr != nullptr);
+    assert(m_infoPtr != nullptr);
+
+    _cullCommands();
+    if (!m_threadPool || m_threadPool->getWorkersSize() == 0){
+        for (size_t i=0; i<m_commands.size(); i++)
+            if (!m_culled[i]) _drawCommand(m_commands[i], this);
+        return;
+    }
+
+    //commands without bounds may write anywhere, they split the scene 
+    //into parts drawn in parallel and are drawn alone between them
+    size_t first = 0;
+    Rect bounds;
+    for (size_t i=0; i<m_commands.size(); i++){
+        if (_getCommandBounds(m_commands[i], bounds)) continue;
+
+        _drawTiles(first, i);
+        _drawCommand(m_commands[i], this);
+        first = i+1;
+    }
+    _drawTiles(first, m_commands.size());
+}
+
+void Drawing::Canvas::queryDrawables(const Drawing::Rect& rect, std::vector<unsigned>& indices){
+    if (!m_spatialIndexValid){
+        m_spatialIndex.reset(m_width, m_height, m_tileSize);
+        Rect bounds;
+        for (size_t i=0; i<m_commands.size(); i++){
+            const bool bounded = _getCommandBounds(m_commands[i], bounds);
+            m_spatialIndex.insert(i, bounds, bounded);
+        }
+        m_spatialIndexValid = true;
+    }
+    m_spatialIndex.query(rect, indices);
+}
+
+void Drawing::Canvas::redrawRegion(const Drawing::Rect& rect, Drawing::Color bgColor){
+    DRAWING_PROFILE_SCOPE("redraw");
+    assert(m_target->getData() != nullptr);
+
+    //drawables are clipped to region, nothing they write outside of it changes
+    const Rect clip = m_clip;
+    m_clip = clip.intersect(rect);
+    if (!m_clip.isEmpty()){
+        //background written like initBuffer, Legacy set spans would keep old alpha
+        if (m_blendMode != BlendMode::Legacy)
+            fillsetPixels(m_clip.x1, m_clip.x2, m_clip.y1, m_clip.y2, bgColor);
+        else {
+            _markWritten(m_clip.x1, m_clip.x2, m_clip.y1, m_clip.y2);
+            DRAWING_COUNT_SET((unsigned long long) (m_clip.x2-m_clip.x1)*(m_clip.y2-m_clip.y1));
+            for (png_uint_32 y=m_clip.y1; y<m_clip.y2; y++)
+                m_formatOps->fillRow(_getPixelPtr(m_clip.x1, y), m_clip.x2-m_clip.x1, bgColor);
+        }
+        queryDrawables(m_clip, m_regionCommands);
+        for (unsigned i : m_regionCommands)
+            _drawCommand(m_commands[i], this);
+    }
+    m_clip = clip;
+}
+
+void Drawing::Canvas::_drawTiles(size_t first, size_t last){
+    const Rect area = m_clip;
+    if (first >= last || area.isEmpty()) return;
+
+    const png_uint_32 tilesX = (area.x2-area.x1 + m_tileSize-1) / m_tileSize;
+    const png_uint_32 tilesY = (area.y2-area.y1 + m_tileSize-1) / m_tileSize;
+
+    //bin drawables in submission order, so every tile blends in the same order as serial draw,
+    //bins keep their capacity between draws
+    std::vector<std::vector<unsigned>>& bins = m_tileBins;
+    bins.resize((size_t) tilesX*tilesY);
+    for (std::vector<unsigned>& bin : bins) bin.clear();
+    Rect bounds;
+    for (size_t i=first; i<last; i++){
+        if (m_culled[i] || !_getCommandBounds(m_commands[i], bounds)) continue;
+
+        bounds = bounds.intersect(area);
+        if (bounds.isEmpty()) continue;
+
+        const png_uint_32 tx1 = (bounds.x1-area.x1) / m_tileSize;
+        const png_uint_32 tx2 = (bounds.x2-1-area.x1) / m_tileSize;
+        const png_uint_32 ty1 = (bounds.y1-area.y1) / m_tileSize;
+        const png_uint_32 ty2 = (bounds.y2-1-area.y1) / m_tileSize;
+        for (png_uint_32 ty=ty1; ty<=ty2; ty++)
+            for (png_uint_32 tx=tx1; tx<=tx2; tx++)
+                bins[(size_t) ty*tilesX + tx].push_back(i);
+    }
+
+    std::vector<size_t>& tiles = m_tiles;
+    tiles.clear();
+    for (size_t i=0; i<bins.size(); i++)
+        if (!bins[i].empty()) tiles.push_back(i);
+
+    m_threadPool->parallelFor(tiles.size(), [&](size_t index){
+        const size_t tile = tiles[index];
+        const png_uint_32 x = area.x1 + (tile % tilesX)*m_tileSize;
+        const png_uint_32 y = area.y1 + (tile / tilesX)*m_tileSize;
+        Canvas view(*this, Rect(x, y, x+m_tileSize, y+m_tileSize));
+
+        for (unsigned i : bins[tile])
+            _drawCommand(m_commands[i], &view);
+    });
+
+    //views do not track writes, whole tiles are marked instead
+    if (m_dirtyTracking || !m_snapshotTiles.empty()){
+        for (size_t tile : tiles){
+            const png_uint_32 x = area.x1 + (tile % tilesX)*m_tileSize;
+            const png_uint_32 y = area.y1 + (tile / tilesX)*m_tileSize;
+            markDirty(Rect(x, y, x+m_tileSize, y+m_tileSize).intersect(area));
+        }
+    }
+}
+
+void Drawing::Canvas::_parallelRows(png_uint_32 height, 
+    const std::function<void(png_uint_32 y1, png_uint_32 y2)>& fn){
+
+    if (!m_threadPool || m_threadPool->getWorkersSize() == 0){
+        fn(0, height);
+        return;
+    }
+    //few chunks per thread, so stealing can even out uneven rows
+    const png_uint_32 chunks = std::min(height, m_threadPool->getThreadsSize()*4);
+    m_threadPool->parallelFor(chunks, [&](size_t chunk){
+        fn((unsigned long long) height*chunk/chunks, (unsigned long long) height*(chunk+1)/chunks);
+    });
+}
+
+void Drawing::Canvas::_compareSums(Canvas &canvasB, unsigned long long sums[3]){
+    const png_uint_32 height = m_target->getHeight();
+    const png_uint_32 width = m_target->getWidth();
+    const PixelFormatOps& format = *m_formatOps;
+    std::mutex mutex;
+
+    sums[0] = sums[1] = sums[2] = 0;
+    _parallelRows(height, [&](png_uint_32 y1, png_uint_32 y2){
+        unsigned long long partial[3] = {0, 0, 0};
+
+        for (png_uint_32 y=y1; y<y2; y++)
+            format.compareChannelSums(m_target->getRow(y), canvasB.m_target->getRow(y), width, partial);
+        std::lock_guard<std::mutex> lock(mutex);
+        for (int i=0; i<3; i++) sums[i] += partial[i];
+    });
+}
+
+void Drawing::Canvas::compareChannels(Canvas &canvasB, double mse[4]){
+    DRAWING_PROFILE_SCOPE("compare");
+    assert(m_target->getData() != nullptr);
+    assert(canvasB.m_target->getData() != nullptr);
+    assert(m_target->getWidth() == canvasB.m_target->getWidth());
+    assert(m_target->getHeight() == canvasB.m_target->getHeight());
+
+    const png_uint_32 height = m_target->getHeight();
+    const png_uint_32 width = m_target->getWidth();
+    const png_byte channels = m_formatOps->channels;
+    const PixelFormatOps& format = *m_formatOps;
+    unsigned long long sums[4] = {0, 0, 0, 0};
+    std::mutex mutex;
+
+    _parallelRows(height, [&](png_uint_32 y1, png_uint_32 y2){
+        unsigned long long partial[4] = {0, 0, 0, 0};
+
+        for (png_uint_32 y=y1; y<y2; y++)
+            format.compareChannels(m_target->getRow(y), canvasB.m_target->getRow(y), width, partial);
+        std::lock_guard<std::mutex> lock(mutex);
+        for (int c=0; c<4; c++) sums[c] += partial[c];
+    });
+
+    const double pixels = (double) width*height;
+    for (int c=0; c<4; c++)
+        mse[c] = c < channels ? sums[c] / pixels : 0.0;
+}
+
+//SSIM sum of color channels of 8x8 tiles in tile rows [ty1, ty2)
+template <typename Sample>
+static double _ssimTiles(const Drawing::FrameBuffer& bufferA, const Drawing::FrameBuffer& bufferB,
+    png_uint_32 ty1, png_uint_32 ty2, png_uint_32 tilesX, png_uint_32 tileSize){
+
+    //constants from Wang et al., scaled to sample range
+    const double range = (1u << 8*sizeof(Sample)) - 1;
+    const double C1 = (0.01*range)*(0.01*range);
+    const double C2 = (0.03*range)*(0.03*range);
+    const png_byte channels = bufferA.getChannels();
+    const png_byte colors = std::min<png_byte>(channels, 3); //color only
+    double partial = 0.0;
+
+    for (png_uint_32 ty=ty1; ty<ty2; ty++){
+        for (png_uint_32 tx=0; tx<tilesX; tx++){
+            for (png_byte c=0; c<colors; c++){
+                unsigned long long sumA = 0, sumB = 0, sumAA = 0, sumBB = 0, sumAB = 0;
+
+                for (png_uint_32 y=ty*tileSize; y<(ty+1)*tileSize; y++){
+                    const Sample* pixelA = (const Sample*) bufferA.getRow(y) + (size_t) tx*tileSize*channels + c;
+                    const Sample* pixelB = (const Sample*) bufferB.getRow(y) + (size_t) tx*tileSize*channels + c;
+
+                    for (png_uint_32 x=0; x<tileSize; x++, pixelA+=channels, pixelB+=channels){
+                        const unsigned long long a = *pixelA, b = *pixelB;
+                        sumA += a;
+                        sumB += b;
+                        sumAA += a*a;
+                        sumBB += b*b;
+                        sumAB += a*b;
+                    }
+                }
+
+                const double n = tileSize*tileSize;
+                const double meanA = sumA/n, meanB = sumB/n;
+                const double varA = sumAA/n - meanA*meanA;
+                const double varB = sumBB/n - meanB*meanB;
+                const double covAB = sumAB/n - meanA*meanB;
+
+                partial += ((2*meanA*meanB + C1) * (2*covAB + C2)) /
+                    ((meanA*meanA + meanB*meanB + C1) * (varA + varB + C2));
+            }
+        }
+    }
+    return partial;
+}
+
+double Drawing::Canvas::_compareSSIM(Canvas &canvasB){
+    const png_uint_32 tileSize = 8;
+    const png_byte channels = std::min<png_byte>(m_formatOps->channels, 3); //color only
+    const png_uint_32 tilesX = m_target->getWidth() / tileSize;
+    const png_uint_32 tilesY = m_target->getHeight() / tileSize;
+    if (tilesX == 0 || tilesY == 0) return 1.0;
+
+    double ssimSum = 0.0;
+    std::mutex mutex;
+    _parallelRows(tilesY, [&](png_uint_32 ty1, png_uint_32 ty2){
+        const double partial = m_formatOps->bitDepth == 16
+            ? _ssimTiles<png_uint_16>(*m_target, *canvasB.m_target, ty1, ty2, tilesX, tileSize)
+            : _ssimTiles<png_byte>(*m_target, *canvasB.m_target, ty1, ty2, tilesX, tileSize);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        ssimSum += partial;
+    });
+
+    return ssimSum / ((double) tilesX*tilesY*channels);
+}
+
+double Drawing::Canvas::compare(Canvas &canvasB, CompareMetric metric){
+    DRAWING_PROFILE_SCOPE("compare");
+    assert(m_target->getData() != nullptr);
+    assert(canvasB.m_target->getData() != nullptr);
+    assert(m_target->getWidth() == canvasB.m_target->getWidth());
+    assert(m_target->getHeight() == canvasB.m_target->getHeight());
+    assert(m_formatOps == canvasB.m_formatOps);
+
+    switch (metric){
+        case CompareMetric::ChannelSum: {
+            unsigned long long sums[3];
+            _compareSums(canvasB, sums);
+
+            //integer sums are exact, same value as summing doubles pixel by pixel
+            const double sumSquareDiff = sums[0];
+            const double pixelA_sumSquare = sums[1];
+            const double pixelB_sumSquare = sums[2];
+            return sumSquareDiff/sqrt(pixelA_sumSquare*pixelB_sumSquare);
+        }
+        case CompareMetric::MSE:
+        case CompareMetric::PSNR: {
+            double mse[4];
+            compareChannels(canvasB, mse);
+
+            const png_byte channels = m_formatOps->channels;
+            double meanMSE = 0.0;
+            for (png_byte c=0; c<channels; c++) meanMSE += mse[c];
+            meanMSE /= channels;
+
+            if (metric == CompareMetric::MSE) return meanMSE;
+            if (meanMSE == 0.0) return std::numeric_limits<double>::infinity();
+            const double peak = (1u << m_formatOps->bitDepth) - 1;
+            return 10*log10(peak*peak/meanMSE);
+        }
+        case CompareMetric::SSIM:
+            return _compareSSIM(canvasB);
+    }
+    return 0.0;
+}
+
+static void _applyWriteOptions(png_structp filePtr, const Drawing::PNGWriteOptions& options){
+    if (options.compressionLevel >= 0)
+        png_set_compression_level(filePtr, std::min(options.compressionLevel, 9));
+
+    switch (options.strategy){
+        case Drawing::PNGStrategy::Filtered: png_set_compression_strategy(filePtr, Z_FILTERED); break;
+        case Drawing::PNGStrategy::HuffmanOnly: png_set_compression_strategy(filePtr, Z_HUFFMAN_ONLY); break;
+        case Drawing::PNGStrategy::RLE: png_set_compression_strategy(filePtr, Z_RLE); break;
+        case Drawing::PNGStrategy::Fixed: png_set_compression_strategy(filePtr, Z_FIXED); break;
+        default: break;
+    }
+
+    int filters = -1;
+    switch (options.filter){
+        case Drawing::PNGFilter::None: filters = PNG_FILTER_NONE; break;
+        case Drawing::PNGFilter::Sub: filters = PNG_FILTER_SUB; break;
+        case Drawing::PNGFilter::Up: filters = PNG_FILTER_UP; break;
+        case Drawing::PNGFilter::Average: filters = PNG_FILTER_AVG; break;
+        case Drawing::PNGFilter::Paeth: filters = PNG_FILTER_PAETH; break;
+        case Drawing::PNGFilter::Adaptive: filters = PNG_ALL_FILTERS; break;
+        default: break;
+    }
+    if (filters >= 0) png_set_filter(filePtr, PNG_FILTER_TYPE_BASE, filters);
+}
+
+//rows are requested one at a time, getRow(y) must stay valid until next call
+static void _writePNG(png_structp filePtr, const Drawing::PNGHeader& header, 
+    const Drawing::PNGWriteOptions& options, const std::function<png_const_bytep(png_uint_32)>& getRow){
+    DRAWING_PROFILE_SCOPE("encode");
+
+    png_infop fileInfoPtr = png_create_info_struct(filePtr);
+    if (!fileInfoPtr) abort();
+    if (setjmp(png_jmpbuf(filePtr))) abort();
+
+    png_set_IHDR(
+        filePtr, fileInfoPtr, header.width, header.height,
+        header.bitDepth, header.colorType, header.interlaceMethod,
+        header.compressMethod, header.filterMethod
+    );
+    _applyWriteOptions(filePtr, options);
+    png_write_info(filePtr, fileInfoPtr);
+
+    //16-bit samples are kept in native byte order, PNG stores them big-endian
+    const png_uint_16 one = 1;
+    if (header.bitDepth == 16 && *(const png_byte*) &one == 1) png_set_swap(filePtr);
+
+    //interlaced images need every row once per pass
+    const int passes = png_set_interlace_handling(filePtr);
+    for (int pass=0; pass<passes; pass++)
+        for (png_uint_32 y=0; y<header.height; y++)
+            png_write_row(filePtr, getRow(y));
+
+    png_write_end(filePtr, fileInfoPtr);
+    png_destroy_info_struct(filePtr, &fileInfoPtr);
+}
+
+Drawing::PNGHeader Drawing::Canvas::getPNGHeader(void) const {
+    assert(m_infoPtr != NULL);
+
+    PNGHeader header;
+    header.width = m_width;
+    header.height = m_height;
+    header.bitDepth = png_get_bit_depth(m_pngPtr, m_infoPtr);
+    header.colorType = png_get_color_type(m_pngPtr, m_infoPtr);
+    header.interlaceMethod = png_get_interlace_type(m_pngPtr, m_infoPtr);
+    header.compressMethod = png_get_compression_type(m_pngPtr, m_infoPtr);
+    header.filterMethod = png_get_filter_type(m_pngPtr, m_infoPtr);
+    return header;
+}
+
+std::function<png_const_bytep(png_uint_32 y)> Drawing::Canvas::_outputRows(std::vector<png_byte>& scratch) const {
+    if (!isPremultiplied())
+        return [this](png_uint_32 y){ return (png_const_bytep) m_target->getRow(y); };
+
+    //PNG stores straight alpha, rows are converted one at a time
+    scratch.resize(m_target->getRowBytes());
+    return [this, &scratch](png_uint_32 y){
+        memcpy(scratch.data(), m_target->getRow(y), scratch.size());
+        unpremultiplyRow(scratch.data(), m_target->getWidth());
+        return (png_const_bytep) scratch.data();
+    };
+}
+
+void Drawing::Canvas::bufferToFile(const char* filepath, const PNGWriteOptions& options){
+    DRAWING_PROFILE_SCOPE("bufferToFile");
+    FILE *fp = fopen(filepath, "wb");
+    if (!fp) abort();
+
+    png_structp filePtr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if(!filePtr) abort();
+
+    assert(m_target->getData() != nullptr);
+    png_init_io(filePtr, fp);
+    std::vector<png_byte> scratch;
+    _writePNG(filePtr, getPNGHeader(), options, _outputRows(scratch));
+
+    fclose(fp);
+    png_destroy_write_struct(&filePtr, NULL);
+}
+
+static void _pngWriteToVector(png_structp pngPtr, png_bytep data, png_size_t length){
+    std::vector<png_byte>* out = (std::vector<png_byte>*) png_get_io_ptr(pngPtr);
+    out->insert(out->end(), data, data+length);
+}
+
+static void _pngFlushNothing(png_structp /*pngPtr*/) {}
+
+void Drawing::Canvas::bufferToMemory(std::vector<png_byte>& out, const PNGWriteOptions& options){
+    DRAWING_PROFILE_SCOPE("bufferToMemory");
+    png_structp filePtr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if(!filePtr) abort();
+
+    assert(m_target->getData() != nullptr);
+    out.clear();
+    png_set_write_fn(filePtr, &out, _pngWriteToVector, _pngFlushNothing);
+    std::vector<png_byte> scratch;
+    _writePNG(filePtr, getPNGHeader(), options, _outputRows(scratch));
+
+    png_destroy_write_struct(&filePtr, NULL);
+}
+
+Drawing::CandidateEvaluator::CandidateEvaluator(const Drawing::Canvas& target, Drawing::Color bgColor)
+    : m_target(target), m_threadPool(std::make_shared<ThreadPool>()) {
+
+    const FrameBuffer& buffer = target.getBuffer();
+    assert(buffer.getData() != nullptr);
+    assert(buffer.getChannels() == 4 && buffer.getBitDepth() == 8);
+
+    m_bgRow.resize(buffer.getRowBytes());
+    for (size_t x=0; x<m_bgRow.size(); x+=4){
+        m_bgRow[x] =     bgColor.r * 255;
+        m_bgRow[x+1] =   bgColor.g * 255;
+        m_bgRow[x+2] =   bgColor.b * 255;
+        m_bgRow[x+3] =   bgColor.a * 255;
+    }
+
+    //target part of compare denominator never changes
+    m_targetRowSquares.resize(buffer.getHeight());
+    for (png_uint_32 y=0; y<buffer.getHeight(); y++){
+        png_const_bytep pixel = buffer.getRow(y);
+        unsigned long long sumSquare = 0;
+        for (png_uint_32 x=0; x<buffer.getWidth(); x++, pixel+=4){
+            const unsigned long long channelSum = _channelSum(pixel);
+            sumSquare += channelSum*channelSum;
+        }
+        m_targetRowSquares[y] = sumSquare;
+    }
+}
+
+void Drawing::CandidateEvaluator::setThreadCount(unsigned threads){
+    m_threadPool = std::make_shared<ThreadPool>(threads == 0 ? 0 : threads-1);
+}
+
+double Drawing::CandidateEvaluator::evaluate(const Scene& candidate){
+    return _evaluate(candidate);
+}
+
+std::vector<double> Drawing::CandidateEvaluator::evaluate(const std::vector<Scene>& candidates){
+    std::vector<double> scores(candidates.size());
+    m_threadPool->parallelFor(candidates.size(), [&](size_t i){
+        scores[i] = _evaluate(candidates[i]);
+    });
+    return scores;
+}
+
+double Drawing::CandidateEvaluator::_evaluate(const Scene& candidate){
+    DRAWING_PROFILE_SCOPE("evaluate");
+    const FrameBuffer& target = m_target.getBuffer();
+    const png_uint_32 width = target.getWidth();
+    const png_uint_32 height = target.getHeight();
+    const png_uint_32 bandsSize = (height + m_bandHeight-1) / m_bandHeight;
+
+    //bin drawables into bands, drawables without bounds go to every band
+    std::vector<std::vector<unsigned>> bins(bandsSize);
+    Rect bounds;
+    for (size_t i=0; i<candidate.size(); i++){
+        const Drawable* drawable = candidate[i].get();
+        if (drawable->drawFn == nullptr) continue;
 
-    png_read_info(pngPtr, infoPtr);
+        png_uint_32 band1 = 0, band2 = bandsSize-1;
+        if (drawable->getBounds(bounds)){
+            bounds = bounds.intersect(Rect(0, 0, width, height));
+            if (bounds.isEmpty()) continue;
+            band1 = bounds.y1 / m_bandHeight;
+            band2 = (bounds.y2-1) / m_bandHeight;
+        }
+        for (png_uint_32 band=band1; band<=band2; band++)
+            bins[band].push_back(i);
+    }
 
-    png_uint_32 width      = png_get_image_width(pngPtr, infoPtr);
-    png_uint_32 height     = png_get_image_height(pngPtr, infoPtr);
-    png_byte color_type = png_get_color_type(pngPtr, infoPtr);
-    png_byte bit_depth  = png_get_bit_depth(pngPtr, infoPtr);
+    const SpanKernels& kernels = getSpanKernels();
+    FrameBuffer bandBuffer = m_bandPool.acquire(width, m_bandHeight, 4);
+    unsigned long long sumSquareDiff = 0;
+    unsigned long long candidateSumSquare = 0;
+    unsigned long long targetSumSquare = 0;
 
-    // Read any color_type into 8bit depth, RGBA format.
-    // See http://www.libpng.org/pub/png/libpng-manual.txt
+    for (png_uint_32 band=0; band<bandsSize; band++){
+        const png_uint_32 y1 = band*m_bandHeight;
+        const png_uint_32 y2 = std::min(y1+m_bandHeight, height);
 
-    if(bit_depth == 16)
-        png_set_strip_16(pngPtr);
-    
-    if(color_type == PNG_COLOR_TYPE_PALETTE)
-        png_set_palette_to_rgb(pngPtr);
+        for (png_uint_32 y=y1; y<y2; y++)
+            memcpy(bandBuffer.getRow(y-y1), m_bgRow.data(), m_bgRow.size());
 
-    // PNG_COLOR_TYPE_GRAY_ALPHA is always 8 or 16bit depth.
-    if(color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
-        png_set_expand_gray_1_2_4_to_8(pngPtr);
+        Canvas view(bandBuffer, width, height, Rect(0, y1, width, y2));
+        for (unsigned i : bins[band]){
+            Drawable* drawable = candidate[i].get();
+            drawable->drawFn(drawable, &view);
+        }
 
-    if(png_get_valid(pngPtr, infoPtr, PNG_INFO_tRNS))
-        png_set_tRNS_to_alpha(pngPtr);
+        //compare band while it is still in cache
+        for (png_uint_32 y=y1; y<y2; y++){
+            unsigned long long sums[3] = {0, 0, 0};
+            kernels.compareChannelSums(bandBuffer.getRow(y-y1), target.getRow(y), width, sums);
+            sumSquareDiff += sums[0];
+            candidateSumSquare += sums[1];
+            targetSumSquare += m_targetRowSquares[y];
+        }
+    }
+    m_bandPool.release(std::move(bandBuffer));
 
-    if(color_type == PNG_COLOR_TYPE_RGB ||
-        color_type == PNG_COLOR_TYPE_GRAY ||
-        color_type == PNG_COLOR_TYPE_PALETTE)
-        png_set_filler(pngPtr, 0xFF, PNG_FILLER_AFTER);
+    //integer sums are exact, so result equals Canvas::compare
+    const double pixelA_sumSquare = candidateSumSquare;
+    const double pixelB_sumSquare = targetSumSquare;
+    return sumSquareDiff/sqrt(pixelA_sumSquare*pixelB_sumSquare);
+}
 
-    if(color_type == PNG_COLOR_TYPE_GRAY ||
-        color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
-        png_set_gray_to_rgb(pngPtr);
 
-    png_read_update_info(pngPtr, infoPtr);
+Drawing::IncrementalComparator::IncrementalComparator(
+    const Drawing::Canvas& reference, png_uint_32 segmentWidth)
+    : m_reference(reference), m_segmentWidth(std::max(segmentWidth, 1u)) {
 
-    if (m_rowBufferPtrs) abort();
+    const FrameBuffer& buffer = reference.getBuffer();
+    assert(buffer.getData() != nullptr);
+    assert(buffer.getChannels() == 4 && buffer.getBitDepth() == 8);
 
-    m_rowBufferPtrs = (png_bytep*)malloc(sizeof(png_bytep) * height);
-    for(int y = 0; y < height; y++) {
-        m_rowBufferPtrs[y] = (png_byte*) malloc(png_get_rowbytes(pngPtr, infoPtr));
+    for (png_uint_32 y=0; y<buffer.getHeight(); y++){
+        png_const_bytep pixel = buffer.getRow(y);
+        for (png_uint_32 x=0; x<buffer.getWidth(); x++, pixel+=4){
+            const unsigned long long channelSum = _channelSum(pixel);
+            m_referenceSumSquare += channelSum*channelSum;
+        }
     }
+    m_segmentsPerRow = (buffer.getWidth() + m_segmentWidth-1) / m_segmentWidth;
+    m_segments.resize((size_t) m_segmentsPerRow*buffer.getHeight());
+}
 
-    png_read_image(pngPtr, m_rowBufferPtrs);
+void Drawing::IncrementalComparator::_scanSegment(
+    const Drawing::Canvas& canvas, png_uint_32 y, png_uint_32 segment){
 
-    fclose(fp);
+    const png_uint_32 x1 = segment*m_segmentWidth;
+    const png_uint_32 x2 = std::min(x1+m_segmentWidth, canvas.getBuffer().getWidth());
+    png_const_bytep pixelA = canvas.getBuffer().getRow(y) + (size_t) x1*4;
+    png_const_bytep pixelB = m_reference.getBuffer().getRow(y) + (size_t) x1*4;
 
-    png_destroy_read_struct(&pngPtr, &infoPtr, NULL);
-}
+    unsigned long long kernelSums[3] = {0, 0, 0};
+    getSpanKernels().compareChannelSums(pixelA, pixelB, x2-x1, kernelSums);
+    const SegmentSums sums = {kernelSums[0], kernelSums[1]};
 
-Drawing::Color Drawing::ImageFile::getPixel(png_uint_32 x, png_uint_32 y){
-    assert(m_rowBufferPtrs != NULL);
+    SegmentSums& cached = m_segments[(size_t) y*m_segmentsPerRow + segment];
+    m_sumSquareDiff += sums.sumSquareDiff - cached.sumSquareDiff;
+    m_sumSquare += sums.sumSquare - cached.sumSquare;
+    cached = sums;
+}
 
-    Drawing::Color color;
-    png_bytep row = m_rowBufferPtrs[y];
-    const png_byte channels = 4;
+double Drawing::IncrementalComparator::compare(Drawing::Canvas& canvas){
+    DRAWING_PROFILE_SCOPE("compare");
+    const FrameBuffer& buffer = canvas.getBuffer();
+    assert(buffer.getWidth() == m_reference.getBuffer().getWidth());
+    assert(buffer.getHeight() == m_reference.getBuffer().getHeight());
+    assert(buffer.getChannels() == 4 && buffer.getBitDepth() == 8);
 
-    color.r = row[channels*x] / 255.0;
-    color.g = row[channels*x+1] / 255.0;
-    color.b = row[channels*x+2] / 255.0;
-    color.a = row[channels*x+3] / 255.0;
+    //reader dropped by canvas means canvas was replaced at same address
+    if (m_canvas != &canvas || !canvas.getDirtyTracking() || m_dirty.use_count() < 2){
+        std::fill(m_segments.begin(), m_segments.end(), SegmentSums{0, 0});
+        m_sumSquareDiff = 0;
+        m_sumSquare = 0;
+        for (png_uint_32 y=0; y<buffer.getHeight(); y++)
+            for (png_uint_32 segment=0; segment<m_segmentsPerRow; segment++)
+                _scanSegment(canvas, y, segment);
+        m_canvas = &canvas;
+        m_dirty.reset();
+        if (canvas.getDirtyTracking()) m_dirty = canvas.addDirtyReader();
+    }
+    else {
+        const DirtyRegion& dirty = *m_dirty;
+        const Rect& bounds = dirty.getBounds();
+        for (png_uint_32 y=bounds.y1; y<bounds.y2; y++){
+            const png_uint_32 x1 = dirty.getRowX1(y), x2 = dirty.getRowX2(y);
+            if (x1 >= x2) continue;
+            for (png_uint_32 segment=x1/m_segmentWidth; segment<=(x2-1)/m_segmentWidth; segment++)
+                _scanSegment(canvas, y, segment);
+        }
+    }
+    if (m_dirty) m_dirty->clear();
 
-    return color;
+    const double pixelA_sumSquare = m_sumSquare;
+    const double pixelB_sumSquare = m_referenceSumSquare;
+    return m_sumSquareDiff/sqrt(pixelA_sumSquare*pixelB_sumSquare);
 }
 
 
-void Drawing::Canvas::_copyConstructor(const Drawing::Canvas& canvas){
-    assert(canvas.m_pngPtr != nullptr);
-    assert(canvas.m_infoPtr != nullptr);
-    assert(canvas.m_rowBufferPtrs != nullptr);
 
-    png_uint_32 width = png_get_image_width(canvas.m_pngPtr, canvas.m_infoPtr);
-    png_uint_32 height = png_get_image_height(canvas.m_pngPtr, canvas.m_infoPtr);
+void Drawing::ImagePyramid::build(const Drawing::FrameBuffer& source, unsigned levels){
+    assert(source.getChannels() == 4 && source.getBitDepth() == 8);
+    m_levels.resize(levels);
 
-    initImage(canvas.m_pngPtr, canvas.m_infoPtr);
-    initBuffer();
+    const FrameBuffer* previous = &source;
+    size_t built = 0;
+    for (; built<levels; built++){
+        const png_uint_32 width = previous->getWidth()/2, height = previous->getHeight()/2;
+        if (width == 0 || height == 0) break;
 
-    for(int y = 0; y < height; y++) {
-        *(m_rowBufferPtrs[y]) = *(canvas.m_rowBufferPtrs[y]);
+        FrameBuffer& level = m_levels[built];
+        if (level.getWidth() != width || level.getHeight() != height || level.getChannels() != 4)
+            level.resize(width, height, 4);
+        _downsample(*previous, level, Rect(0, 0, width, height));
+        previous = &level;
     }
-    m_drawables = canvas.m_drawables;
+    m_levels.resize(built);
 }
 
-Drawing::Canvas::Canvas(const Drawing::Canvas& canvas){
-    _copyConstructor(canvas);
-}
+void Drawing::ImagePyramid::update(const Drawing::FrameBuffer& source, const Drawing::Rect& rect){
+    png_uint_32 x1 = rect.x1, y1 = rect.y1, x2 = rect.x2, y2 = rect.y2;
+    const FrameBuffer* previous = &source;
+    for (FrameBuffer& level : m_levels){
+        x1 >>= 1; y1 >>= 1;
+        x2 = std::min((x2+1) >> 1, level.getWidth());
+        y2 = std::min((y2+1) >> 1, level.getHeight());
+        if (x1 >= x2 || y1 >= y2) return;
 
-Drawing::Canvas::Canvas(png_uint_32 width, png_uint_32 height,
-    int bitDepth, int colorType, int interlaceMethod, int compressMethod, int filterMethod){
-    
-    initImage(width, height, bitDepth, colorType, interlaceMethod, compressMethod, filterMethod);
-    initBuffer();
+        _downsample(*previous, level, Rect(x1, y1, x2, y2));
+        previous = &level;
+    }
 }
 
-Drawing::Canvas::~Canvas(){
-    png_uint_32 height = png_get_image_height(m_pngPtr, m_infoPtr);
-    for(int y = 0; y < height; y++) {
-        free(m_rowBufferPtrs[y]);
+void Drawing::ImagePyramid::_downsample(
+    const Drawing::FrameBuffer& source, Drawing::FrameBuffer& level, const Drawing::Rect& rect){
+
+    const SpanKernels& kernels = getSpanKernels();
+    for (png_uint_32 y=rect.y1; y<rect.y2; y++){
+        kernels.downsampleRow(level.getRow(y) + (size_t) rect.x1*4, 
+            source.getRow(2*y) + (size_t) rect.x1*8, source.getRow(2*y+1) + (size_t) rect.x1*8, 
+            rect.x2-rect.x1);
     }
-    free(m_rowBufferPtrs);
-    png_destroy_write_struct(&m_pngPtr, &m_infoPtr);
 }
 
 
-Drawing::Canvas& Drawing::Canvas::operator=(Canvas rhs){
-    _copyConstructor(rhs);
-    return *this;
-}
+Drawing::PyramidComparator::PyramidComparator(
+    const Drawing::Canvas& reference, unsigned levels, Drawing::CompareMetric metric)
+    : m_reference(reference), m_metric(metric), m_levels(levels) {
 
+    assert(metric == CompareMetric::ChannelSum || metric == CompareMetric::MSE);
+    const FrameBuffer& buffer = reference.getBuffer();
+    assert(buffer.getData() != nullptr);
+    assert(buffer.getChannels() == 4 && buffer.getBitDepth() == 8);
 
+    unsigned long long sumSquare = 0;
+    for (png_uint_32 y=0; y<buffer.getHeight(); y++){
+        png_const_bytep pixel = buffer.getRow(y);
+        for (png_uint_32 x=0; x<buffer.getWidth(); x++, pixel+=4){
+            const unsigned long long channelSum = _channelSum(pixel);
+            sumSquare += channelSum*channelSum;
+        }
+    }
+    m_referenceNorm = sqrt((double) sumSquare);
+    m_referencePyramid.build(buffer, levels);
+}
 
-void createPngStructs(png_structp *pngPtr, png_infop *infoPtr){
-    *pngPtr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!(*pngPtr)) abort();
+//every level rounds each channel by at most 1/2 in both pyramids, so block mean of
+//full resolution differences is within margin of level difference; sum of squares 
+//of a block of n pixels is at least n times its squared mean
+double Drawing::PyramidComparator::_levelBound(size_t level) const {
+    const FrameBuffer& levelA = m_canvasPyramid.getLevel(level);
+    const FrameBuffer& levelB = m_referencePyramid.getLevel(level);
+    const double blockPixels = (double) (1ull << (2*(level+1)));
+    const FrameBuffer& buffer = m_reference.getBuffer();
 
-    *infoPtr = png_create_info_struct(*pngPtr);
-    if (!infoPtr) abort();
+    if (m_metric == CompareMetric::ChannelSum){
+        const int margin = 4*(int) (level+1);
+        unsigned long long sum = 0;
+        for (png_uint_32 y=0; y<levelA.getHeight(); y++){
+            png_const_bytep pixelA = levelA.getRow(y), pixelB = levelB.getRow(y);
+            for (png_uint_32 x=0; x<levelA.getWidth(); x++, pixelA+=4, pixelB+=4){
+                const int diff = std::abs((int) _channelSum(pixelA) - (int) _channelSum(pixelB)) - margin;
+                if (diff > 0) sum += (unsigned long long) (diff*diff);
+            }
+        }
+        //candidate norm is at most reference norm + difference norm
+        const double diffNorm = sqrt(blockPixels*sum);
+        return diffNorm*diffNorm/(m_referenceNorm*(m_referenceNorm+diffNorm));
+    }
 
-    if (setjmp(png_jmpbuf(*pngPtr))) abort();
+    const int margin = (int) level+1;
+    unsigned long long sum = 0;
+    for (png_uint_32 y=0; y<levelA.getHeight(); y++){
+        png_const_bytep channelA = levelA.getRow(y), channelB = levelB.getRow(y);
+        for (png_uint_32 x=0; x<levelA.getWidth()*4; x++){
+            const int diff = std::abs((int) channelA[x] - (int) channelB[x]) - margin;
+            if (diff > 0) sum += (unsigned long long) (diff*diff);
+        }
+    }
+    return blockPixels*sum/((double) buffer.getWidth()*buffer.getHeight()*4);
 }
 
-void Drawing::Canvas::initImage(png_uint_32 width, png_uint_32 height,
-    int bitDepth, int colorType, int interlaceMethod, int compressMethod, int filterMethod){
+double Drawing::PyramidComparator::compare(Drawing::Canvas& canvas, double threshold){
+    DRAWING_PROFILE_SCOPE("compare");
+    const FrameBuffer& buffer = canvas.getBuffer();
+    assert(buffer.getWidth() == m_reference.getBuffer().getWidth());
+    assert(buffer.getHeight() == m_reference.getBuffer().getHeight());
+    assert(buffer.getChannels() == 4 && buffer.getBitDepth() == 8);
 
-    createPngStructs(&m_pngPtr, &m_infoPtr);
-    png_set_IHDR(
-        m_pngPtr, m_infoPtr, width, height,
-        bitDepth, colorType, interlaceMethod,
-        compressMethod, filterMethod
-    );
+    //reader dropped by canvas means canvas was replaced at same address
+    if (m_canvas != &canvas || !canvas.getDirtyTracking() || m_dirty.use_count() < 2){
+        m_canvasPyramid.build(buffer, m_levels);
+        m_canvas = &canvas;
+        m_dirty.reset();
+        if (canvas.getDirtyTracking()) m_dirty = canvas.addDirtyReader();
+    }
+    else if (!m_dirty->isEmpty())
+        m_canvasPyramid.update(buffer, m_dirty->getBounds());
+    if (m_dirty) m_dirty->clear();
+
+    m_rejectLevel = -1;
+    if (m_metric != CompareMetric::ChannelSum || m_referenceNorm > 0.0){
+        for (size_t level=m_canvasPyramid.getLevelsSize(); level-->0;){
+            const double bound = _levelBound(level);
+            if (bound >= threshold){
+                m_rejectLevel = (int) level;
+                return bound;
+            }
+        }
+    }
+    return canvas.compare(const_cast<Canvas&>(m_reference), m_metric);
 }
 
-void Drawing::Canvas::initImage(const png_structp &pngPtr, const png_infop &infoPtr){
+Drawing::AsyncExporter::AsyncExporter(unsigned encoders, size_t maxQueued, PNGWriteOptions options)
+    : m_options(options), m_maxQueued(std::max<size_t>(maxQueued, 1)), m_bufferPool(maxQueued) {
 
-    createPngStructs(&m_pngPtr, &m_infoPtr);
-    png_set_IHDR(
-        m_pngPtr, m_infoPtr,
-        png_get_image_width(pngPtr, infoPtr),
-        png_get_image_height(pngPtr, infoPtr),
-        png_get_bit_depth(pngPtr, infoPtr),
-        png_get_color_type(pngPtr, infoPtr),
-        png_get_interlace_type(pngPtr, infoPtr),
-        png_get_compression_type(pngPtr, infoPtr),
-        png_get_filter_type(pngPtr, infoPtr)
-    );
+    if (encoders == 0) encoders = std::max(std::thread::hardware_concurrency(), 1u);
+    for (unsigned i=0; i<encoders; i++)
+        m_encoders.emplace_back(&AsyncExporter::_encoderLoop, this);
+    m_writer = std::thread(&AsyncExporter::_writerLoop, this);
 }
 
-void Drawing::Canvas::initBuffer(Color bgColor){
-    png_uint_32 height = png_get_image_height(m_pngPtr, m_infoPtr);
-    png_uint_32 width = png_get_image_width(m_pngPtr, m_infoPtr);
-    size_t rowbytes = png_get_rowbytes(m_pngPtr, m_infoPtr);
-
-    m_rowBufferPtrs = (png_bytep*) malloc(height*sizeof(png_bytep));
-    for(unsigned y=0; y<height; y++) {
-        m_rowBufferPtrs[y] = (png_byte*) malloc(rowbytes);
-        
-        //set default background color
-        for (unsigned x=0; x<rowbytes; x+=4){
-            m_rowBufferPtrs[y][x] =     bgColor.r * 255;
-            m_rowBufferPtrs[y][x+1] =   bgColor.g * 255;
-            m_rowBufferPtrs[y][x+2] =   bgColor.b * 255;
-            m_rowBufferPtrs[y][x+3] =   bgColor.a * 255;
-        }
+Drawing::AsyncExporter::~AsyncExporter(){
+    flush();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
     }
+    m_encodeCv.notify_all();
+    m_writeCv.notify_all();
+    for (auto& encoder : m_encoders)
+        encoder.join();
+    m_writer.join();
 }
 
+void Drawing::AsyncExporter::submit(const Drawing::Canvas& canvas, const std::string& filepath){
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_doneCv.wait(lock, [this]{ return m_unwritten < m_maxQueued; });
+        m_unwritten++;
+    }
 
+    std::unique_ptr<Job> job(new Job());
+    job->filepath = filepath;
+    job->header = canvas.getPNGHeader();
+    
+    const FrameBuffer& buffer = canvas.getBuffer();
+    job->pixels = m_bufferPool.acquire(buffer.getWidth(), buffer.getHeight(), 
+        buffer.getChannels(), buffer.getBitDepth());
+    memcpy(job->pixels.getData(), buffer.getData(), buffer.getSize());
+    if (canvas.isPremultiplied()){
+        for (png_uint_32 y=0; y<buffer.getHeight(); y++)
+            unpremultiplyRow(job->pixels.getRow(y), buffer.getWidth());
+    }
 
-#define mixColor(oldColor, alphaOld, newColor, alphaNew) \
-    oldColor*alphaOld*(1-alphaNew) + newColor*alphaNew
-
-/*
-alphaMixConst = alphaOld * negAlphaConst
-negAlphaConst = (1-alphaNew)
-newColorConst = newColor * alphaNew
-*/
-#define mixColor2(oldColor, alphaMixConst, newColorConst) \
-    oldColor*alphaMixConst + newColorConst
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_pending.push_back(job.get());
+        m_jobs.push_back(std::move(job));
+    }
+    m_encodeCv.notify_one();
+}
 
+void Drawing::AsyncExporter::flush(void){
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_doneCv.wait(lock, [this]{ return m_unwritten == 0; });
+}
 
-void Drawing::Canvas::putPixel(
-    png_uint_32 x, png_uint_32 y, Drawing::Color color){
-    
-    const png_byte channels = png_get_channels(m_pngPtr, m_infoPtr);
-    png_bytep pixel = &m_rowBufferPtrs[y][x*channels]; //C = {0...255}
-    const double a = pixel[3] / (int) 255;
-    const double alphaMix = a * (1-color.a);
+void Drawing::AsyncExporter::_encoderLoop(void){
+    while (true){
+        Job* job;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_encodeCv.wait(lock, [this]{ return m_stop || !m_pending.empty(); });
+            if (m_pending.empty()) return;
+            job = m_pending.front();
+            m_pending.pop_front();
+        }
 
-    const double _255mulAlpha = 255*color.a;
-    color.multiplyRGB(_255mulAlpha, _255mulAlpha, _255mulAlpha); //newColorConstant created
+        png_structp filePtr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+        if(!filePtr) abort();
+        png_set_write_fn(filePtr, &job->encoded, _pngWriteToVector, _pngFlushNothing);
+        _writePNG(filePtr, job->header, m_options, [job](png_uint_32 y){
+            return (png_const_bytep) job->pixels.getRow(y);
+        });
+        png_destroy_write_struct(&filePtr, NULL);
+        m_bufferPool.release(std::move(job->pixels));
 
-    pixel[0] = mixColor2(pixel[0], alphaMix, color.r);
-    pixel[1] = mixColor2(pixel[1], alphaMix, color.g);
-    pixel[2] = mixColor2(pixel[2], alphaMix, color.b);
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            job->isEncoded = true;
+        }
+        m_writeCv.notify_one();
+    }
 }
 
-void Drawing::Canvas::setPixel(
-    png_uint_32 x, png_uint_32 y, Drawing::Color color){
+void Drawing::AsyncExporter::_writerLoop(void){
+    while (true){
+        std::unique_ptr<Job> job;
+        {
+            //files are written in submission order
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_writeCv.wait(lock, [this]{ 
+                return (m_stop && m_jobs.empty()) || (!m_jobs.empty() && m_jobs.front()->isEncoded); 
+            });
+            if (m_jobs.empty()) return;
+            job = std::move(m_jobs.front());
+            m_jobs.pop_front();
+        }
 
-    const png_byte channels = png_get_channels(m_pngPtr, m_infoPtr);
-    color.multiplyRGB(255, 255, 255);
+        FILE *fp = fopen(job->filepath.c_str(), "wb");
+        if (!fp) abort();
+        if (fwrite(job->encoded.data(), 1, job->encoded.size(), fp) != job->encoded.size()) abort();
+        fclose(fp);
 
-    m_rowBufferPtrs[y][x*channels] = color.r;
-    m_rowBufferPtrs[y][x*channels+1] = color.g;
-    m_rowBufferPtrs[y][x*channels+2] = color.b;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_unwritten--;
+        }
+        m_doneCv.notify_all();
+    }
 }
 
-void Drawing::Canvas::fillputPixels(
-    png_uint_32 x1, png_uint_32 x2, png_uint_32 y, 
-    Drawing::Color color){
-    
-    const png_byte channels = png_get_channels(m_pngPtr, m_infoPtr);
-    const double negAlpha = 1-color.a;
-    const double _255mulAlpha = 255*color.a;
-    color.multiplyRGB(_255mulAlpha, _255mulAlpha, _255mulAlpha); //newColorConstant created
 
-    png_bytep row = m_rowBufferPtrs[y];
+Drawing::TiledCanvas::TiledCanvas(png_uint_32 width, png_uint_32 height, 
+    png_uint_32 tileSize, size_t memoryLimit){
+
+    assert(width > 0 && height > 0);
+    m_width = width;
+    m_height = height;
+    m_tileSize = std::max(tileSize, 1u);
+    m_tilesX = (width + m_tileSize-1) / m_tileSize;
+    m_tilesY = (height + m_tileSize-1) / m_tileSize;
+    m_tileBytes = FrameBuffer::computeStride(m_tileSize, 4)*m_tileSize;
+    m_maxResident = std::max<size_t>(memoryLimit / m_tileBytes, 1);
+    m_maxResident = std::min<size_t>(m_maxResident, (size_t) m_tilesX*m_tilesY);
+
+    //commands only, scene never gets a buffer
+    m_scene.initImage(width, height);
+    m_tiles.resize((size_t) m_tilesX*m_tilesY);
+    m_bins.resize(m_tiles.size());
+    //tile references stay valid while a band is drawn
+    m_slots.reserve(m_maxResident);
+
+    const char* tmpdir = getenv("TMPDIR");
+    m_scratchDirectory = tmpdir != nullptr && tmpdir[0] != '\0' ? tmpdir : "/tmp";
+}
 
-    for (png_uint_32 x=x1; x<x2; x++){
+Drawing::TiledCanvas::~TiledCanvas(){
+#ifndef _WIN32
+    if (m_scratch != nullptr) munmap(m_scratch, m_scratchSize);
+    if (m_scratchFd >= 0) close(m_scratchFd);
+#endif
+}
 
-        const double bufferAlpha = *(row+x*channels+3) / (int) 255;
-        const double alphaMix = bufferAlpha*negAlpha;
+Drawing::Rect Drawing::TiledCanvas::_tileRect(unsigned tile) const {
+    const png_uint_32 x = (tile % m_tilesX)*m_tileSize;
+    const png_uint_32 y = (tile / m_tilesX)*m_tileSize;
+    return Rect(x, y, std::min(x+m_tileSize, m_width), std::min(y+m_tileSize, m_height));
+}
 
-        row[x*channels] = mixColor2(row[x*channels], alphaMix, color.r);
-        row[x*channels+1] = mixColor2(row[x*channels+1], alphaMix, color.g);
-        row[x*channels+2] = mixColor2(row[x*channels+2], alphaMix, color.b);
+void Drawing::TiledCanvas::initBuffer(Color bgColor){
+    //every tile goes back to background, queued drawing is dropped like on Canvas
+    for (unsigned tile=0; tile<m_tiles.size(); tile++){
+        if (m_tiles[tile].slot >= 0) _evictTile(tile, false);
+        m_tiles[tile].spilled = false;
+        m_tiles[tile].pending = false;
+        m_bins[tile].clear();
     }
+    m_pendingTiles = 0;
+    m_pendingUnbounded = false;
+    m_binnedCommands = 0;
+    m_bgColor = bgColor;
 }
-void Drawing::Canvas::fillputPixels(png_uint_32 x1, png_uint_32 x2,
-    png_uint_32 y1, png_uint_32 y2, Drawing::Color color){
 
-    const png_byte channels = png_get_channels(m_pngPtr, m_infoPtr);
-    const double negAlpha = 1-color.a;
-    const double _255mulAlpha = 255*color.a;
-    color.multiplyRGB(_255mulAlpha, _255mulAlpha, _255mulAlpha); //newColorConstant created
+void Drawing::TiledCanvas::setBlendMode(Drawing::BlendMode mode){
+    _flushPending();
+    const bool wasPremultiplied = m_blendMode != BlendMode::Legacy;
+    m_blendMode = mode;
+    m_scene.setBlendMode(mode);
+    if (wasPremultiplied == (mode != BlendMode::Legacy)) return;
 
-    for (png_uint_32 y=y1; y<y2; y++){
-        png_bytep row = m_rowBufferPtrs[y];
+    //untouched tiles are filled in new mode when used, stored ones are converted
+    for (unsigned tile=0; tile<m_tiles.size(); tile++){
+        if (m_tiles[tile].slot < 0 && !m_tiles[tile].spilled) continue;
+
+        FrameBuffer& buffer = _acquireTile(tile, false);
+        for (png_uint_32 y=0; y<buffer.getHeight(); y++){
+            if (wasPremultiplied) unpremultiplyRow(buffer.getRow(y), buffer.getWidth());
+            else premultiplyRow(buffer.getRow(y), buffer.getWidth());
+        }
+        m_tiles[tile].dirty = true;
+    }
+}
 
-        for (png_uint_32 x=x1; x<x2; x++){
+void Drawing::TiledCanvas::draw(void){
+    //commands are only appended while tiles are pending, earlier ones are
+    //already in bins or drawn
+    const std::vector<DrawCommand>& commands = m_scene.m_commands;
+    const Rect area(0, 0, m_width, m_height);
+    Rect bounds;
+    for (size_t i=m_binnedCommands; i<commands.size(); i++){
+        png_uint_32 tx1 = 0, tx2 = m_tilesX-1, ty1 = 0, ty2 = m_tilesY-1;
+        if (m_scene._getCommandBounds(commands[i], bounds)){
+            bounds = bounds.intersect(area);
+            if (bounds.isEmpty()) continue;
 
-            const double bufferAlpha = *(row+x*channels+3) / (int) 255;
-            const double alphaMix = bufferAlpha*negAlpha;
+            tx1 = bounds.x1 / m_tileSize;
+            tx2 = (bounds.x2-1) / m_tileSize;
+            ty1 = bounds.y1 / m_tileSize;
+            ty2 = (bounds.y2-1) / m_tileSize;
+        }
+        else m_pendingUnbounded = true;
 
-            row[x*channels] = mixColor2(row[x*channels], alphaMix, color.r);
-            row[x*channels+1] = mixColor2(row[x*channels+1], alphaMix, color.g);
-            row[x*channels+2] = mixColor2(row[x*channels+2], alphaMix, color.b);
+        for (png_uint_32 ty=ty1; ty<=ty2; ty++){
+            for (png_uint_32 tx=tx1; tx<=tx2; tx++){
+                const size_t tile = (size_t) ty*m_tilesX + tx;
+                m_bins[tile].push_back(i);
+                if (!m_tiles[tile].pending) m_pendingTiles++;
+                m_tiles[tile].pending = true;
+            }
         }
     }
+    m_binnedCommands = commands.size();
 }
 
-void Drawing::Canvas::fillsetPixels(
-    png_uint_32 x1, png_uint_32 x2, png_uint_32 y, 
-    Drawing::Color color){
-    
-    const png_byte channels = png_get_channels(m_pngPtr, m_infoPtr);
-    color.multiplyRGB(255, 255, 255);
+void Drawing::TiledCanvas::_renderTile(unsigned tile, FrameBuffer& buffer){
+    Canvas view(buffer, m_width, m_height, _tileRect(tile));
+    view.m_blendMode = m_blendMode;
+    for (unsigned i : m_bins[tile])
+        m_scene._drawCommand(m_scene.m_commands[i], &view);
+}
+
+void Drawing::TiledCanvas::_flushPending(void){
+    for (png_uint_32 band=0; band<m_tilesY && m_pendingTiles > 0; band++)
+        _prepareBand(band);
+}
+
+void Drawing::TiledCanvas::_prepareBand(png_uint_32 band){
+    const unsigned first = band*m_tilesX;
+    const unsigned last = first + m_tilesX;
+    bool pending = false;
+    for (unsigned tile=first; tile<last; tile++) pending |= m_tiles[tile].pending;
+    if (!pending) return;
 
-    png_bytep row = m_rowBufferPtrs[y];
+    //unbounded drawables are not assumed to be safe to call from several threads
+    if (!m_threadPool || m_threadPool->getWorkersSize() == 0 || 
+        m_pendingUnbounded || m_tilesX > m_maxResident){
 
-    for (png_uint_32 x=x1; x<x2; x++){
-        row[x*channels] = (png_byte) color.r;
-        row[x*channels+1] = (png_byte) color.g;
-        row[x*channels+2] = (png_byte) color.b;
+        for (unsigned tile=first; tile<last; tile++) _acquireTile(tile);
+        return;
     }
+
+    std::vector<unsigned> tiles;
+    std::vector<FrameBuffer*> buffers;
+    for (unsigned tile=first; tile<last; tile++){
+        if (!m_tiles[tile].pending) continue;
+        tiles.push_back(tile);
+        buffers.push_back(&_acquireTile(tile, false));
+    }
+    m_threadPool->parallelFor(tiles.size(), [&](size_t index){
+        _renderTile(tiles[index], *buffers[index]);
+    });
+    for (unsigned tile : tiles){
+        m_tiles[tile].pending = false;
+        m_tiles[tile].dirty = true;
+        m_bins[tile].clear();
+    }
+    m_pendingTiles -= tiles.size();
+    if (m_pendingTiles == 0) m_pendingUnbounded = false;
 }
-void Drawing::Canvas::fillsetPixels(png_uint_32 x1, png_uint_32 x2,
-    png_uint_32 y1, png_uint_32 y2, Drawing::Color color){
-    
-    const png_byte channels = png_get_channels(m_pngPtr, m_infoPtr);
-    color.multiplyRGB(255, 255, 255);
 
-    for (png_uint_32 y=y1; y<y2; y++){
-        png_bytep row = m_rowBufferPtrs[y];
+Drawing::FrameBuffer& Drawing::TiledCanvas::_acquireTile(unsigned tile, bool render){
+    Tile& state = m_tiles[tile];
+    if (state.slot >= 0){
+        m_lru.splice(m_lru.begin(), m_lru, state.lru);
+    }
+    else {
+        if (!m_freeSlots.empty()){
+            state.slot = m_freeSlots.back();
+            m_freeSlots.pop_back();
+        }
+        else if (m_slots.size() < m_maxResident){
+            state.slot = m_slots.size();
+            m_slots.emplace_back();
+        }
+        else {
+            _evictTile(m_lru.back());
+            state.slot = m_freeSlots.back();
+            m_freeSlots.pop_back();
+        }
+        m_lru.push_front(tile);
+        state.lru = m_lru.begin();
 
-        for (png_uint_32 x=x1; x<x2; x++){
-            row[x*channels] = (png_byte) color.r;
-            row[x*channels+1] = (png_byte) color.g;
-            row[x*channels+2] = (png_byte) color.b;
+        //slots keep capacity of a whole tile, edge tiles only use part of it
+        const Rect rect = _tileRect(tile);
+        FrameBuffer& buffer = m_slots[state.slot];
+        buffer.resize(rect.x2-rect.x1, rect.y2-rect.y1, 4);
+        if (state.spilled){
+            png_const_bytep stored = _scratchTile(tile);
+            for (png_uint_32 y=0; y<buffer.getHeight(); y++)
+                memcpy(buffer.getRow(y), stored + (size_t) y*m_tileSize*4, buffer.getRowBytes());
+            m_loads++;
         }
+        else {
+            png_byte bg[4];
+            if (m_blendMode != BlendMode::Legacy) premultiplyColor(m_bgColor, bg);
+            else {
+                bg[0] = m_bgColor.r * 255;
+                bg[1] = m_bgColor.g * 255;
+                bg[2] = m_bgColor.b * 255;
+                bg[3] = m_bgColor.a * 255;
+            }
+            png_bytep firstRow = buffer.getRow(0);
+            for (png_uint_32 x=0; x<buffer.getWidth(); x++) memcpy(firstRow + x*4, bg, 4);
+            for (png_uint_32 y=1; y<buffer.getHeight(); y++)
+                memcpy(buffer.getRow(y), firstRow, buffer.getRowBytes());
+        }
+        state.dirty = false;
+    }
+
+    FrameBuffer& buffer = m_slots[state.slot];
+    if (render && state.pending){
+        _renderTile(tile, buffer);
+        state.pending = false;
+        state.dirty = true;
+        m_bins[tile].clear();
+        if (--m_pendingTiles == 0) m_pendingUnbounded = false;
     }
+    return buffer;
 }
 
+void Drawing::TiledCanvas::_evictTile(unsigned tile, bool keep){
+    Tile& state = m_tiles[tile];
+    assert(state.slot >= 0);
 
+    const FrameBuffer& buffer = m_slots[state.slot];
+    if (keep && state.dirty){
+        png_bytep stored = _scratchTile(tile);
+        for (png_uint_32 y=0; y<buffer.getHeight(); y++)
+            memcpy(stored + (size_t) y*m_tileSize*4, buffer.getRow(y), buffer.getRowBytes());
+        state.spilled = true;
+        m_spills++;
+    }
+    else if (!keep) state.spilled = false;
 
+    m_lru.erase(state.lru);
+    m_freeSlots.push_back(state.slot);
+    state.slot = -1;
+    state.dirty = false;
+}
 
-void Drawing::Canvas::draw(){
-    assert(m_rowBufferPtrs != nullptr);
-    assert(m_pngPtr != nullptr);
-    assert(m_infoPtr != nullptr);
+png_bytep Drawing::TiledCanvas::_scratchTile(unsigned tile){
+    const size_t tileStored = (size_t) m_tileSize*m_tileSize*4;
+#ifdef _WIN32
+    abort(); //spilling needs mmap
+#else
+    if (m_scratch == nullptr){
+        //sparse file, only spilled tiles take disk space
+        std::string path = m_scratchDirectory + "/drawingXXXXXX";
+        m_scratchFd = mkstemp(&path[0]);
+        if (m_scratchFd < 0) abort();
+        unlink(path.c_str());
 
-    for (auto& drawable : m_drawables){
-        if(drawable->drawFn != nullptr)
-            drawable->drawFn(drawable.get(), this);
+        m_scratchSize = tileStored*m_tiles.size();
+        if (ftruncate(m_scratchFd, m_scratchSize) != 0) abort();
+        void* mapped = mmap(nullptr, m_scratchSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_scratchFd, 0);
+        if (mapped == MAP_FAILED) abort();
+        m_scratch = (png_bytep) mapped;
     }
+#endif
+    return m_scratch + tileStored*tile;
 }
 
-double Drawing::Canvas::compare(Canvas &canvasB){
-    assert(m_rowBufferPtrs != NULL);
-    assert(m_pngPtr != NULL);
-    assert(m_infoPtr != NULL);
-
-    png_uint_32 height = png_get_image_height(m_pngPtr, m_infoPtr);
-    png_uint_32 width = png_get_image_width(m_pngPtr, m_infoPtr);
-    png_byte channels = png_get_channels(m_pngPtr, m_infoPtr);
-    Canvas *canvasA = this;
+void Drawing::TiledCanvas::readRow(png_uint_32 y, png_bytep out){
+    assert(y < m_height);
+    const png_uint_32 band = y / m_tileSize;
+    _prepareBand(band);
+    for (png_uint_32 tx=0; tx<m_tilesX; tx++){
+        const FrameBuffer& buffer = _acquireTile(band*m_tilesX + tx);
+        memcpy(out + (size_t) tx*m_tileSize*4, buffer.getRow(y - band*m_tileSize), buffer.getRowBytes());
+    }
+}
 
-    double sumSquareDiff = 0.0;
-    double pixelA_sumSquare = 0.0;
-    double pixelB_sumSquare = 0.0;
+Drawing::PNGHeader Drawing::TiledCanvas::getPNGHeader(void) const {
+    return m_scene.getPNGHeader();
+}
 
-    for (png_uint_32 y=0; y<height; y++){
-        for (png_uint_32 x=0; x<width; x++){
-            png_bytep pixelA = &canvasA->m_rowBufferPtrs[y][x*channels];
-            png_bytep pixelB = &canvasB.m_rowBufferPtrs[y][x*channels];
-            
-            double channelSumA = (double)pixelA[0]+(double)pixelA[1]+(double)pixelA[2]+(double)pixelA[3];
-            double channelSumB = (double)pixelB[0]+(double)pixelB[1]+(double)pixelB[2]+(double)pixelB[3];
+void Drawing::TiledCanvas::_writeRows(png_structp filePtr, const PNGWriteOptions& options, bool dropBands){
+    DRAWING_PROFILE_SCOPE("bufferToFile");
+    const PNGHeader header = getPNGHeader();
+    //interlaced images need every row once per pass
+    dropBands = dropBands && header.interlaceMethod == PNG_INTERLACE_NONE;
 
-            double diff = channelSumA - channelSumB;
-            sumSquareDiff += diff*diff;
+    std::vector<png_byte> row((size_t) m_width*4);
+    png_uint_32 currentBand = m_tilesY;
+    _writePNG(filePtr, header, options, [&](png_uint_32 y){
+        const png_uint_32 band = y / m_tileSize;
+        if (dropBands && currentBand < m_tilesY && band != currentBand){
+            for (unsigned tile=currentBand*m_tilesX; tile<(currentBand+1)*m_tilesX; tile++){
+                if (m_tiles[tile].slot >= 0) _evictTile(tile, false);
+                m_tiles[tile].spilled = false;
+            }
+        }
+        currentBand = band;
 
-            pixelA_sumSquare += channelSumA*channelSumA;
-            pixelB_sumSquare += channelSumB*channelSumB;
+        readRow(y, row.data());
+        if (m_blendMode != BlendMode::Legacy) unpremultiplyRow(row.data(), m_width);
+        return (png_const_bytep) row.data();
+    });
+    if (dropBands && currentBand < m_tilesY){
+        for (unsigned tile=currentBand*m_tilesX; tile<(currentBand+1)*m_tilesX; tile++){
+            if (m_tiles[tile].slot >= 0) _evictTile(tile, false);
+            m_tiles[tile].spilled = false;
         }
     }
-
-    return sumSquareDiff/sqrt(pixelA_sumSquare*pixelB_sumSquare);
+    //every tile is back to background, next draw renders whole scene again
+    if (dropBands) m_binnedCommands = 0;
 }
 
-void Drawing::Canvas::bufferToFile(const char* filepath){
+void Drawing::TiledCanvas::bufferToFile(const char* filepath, const PNGWriteOptions& options){
     FILE *fp = fopen(filepath, "wb");
     if (!fp) abort();
 
-    assert(m_rowBufferPtrs != NULL);
-    assert(m_infoPtr != NULL);
-
     png_structp filePtr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
     if(!filePtr) abort();
 
     png_init_io(filePtr, fp);
-    png_write_info(filePtr, m_infoPtr);
+    _writeRows(filePtr, options, false);
+
+    fclose(fp);
+    png_destroy_write_struct(&filePtr, NULL);
+}
+
+void Drawing::TiledCanvas::drawToFile(const char* filepath, const PNGWriteOptions& options){
+    draw();
+
+    FILE *fp = fopen(filepath, "wb");
+    if (!fp) abort();
 
-    png_write_image(filePtr, m_rowBufferPtrs);
-    png_write_end(filePtr, NULL);
+    png_structp filePtr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if(!filePtr) abort();
+
+    png_init_io(filePtr, fp);
+    _writeRows(filePtr, options, true);
 
     fclose(fp);
-    png_destroy_read_struct(&filePtr, NULL, NULL);
+    png_destroy_write_struct(&filePtr, NULL);
 }
 
+
 void Drawing::rect_filled(Drawing::Drawable *drawable, Drawing::Canvas* canvas){
     const Drawing::Color pixel = drawable->getPixel(0, 0);
-    canvas->fillputPixels(drawable->points[0].x(), drawable->points[1].x(), 
-        drawable->points[0].y(), drawable->points[1].y(), pixel);
+    const Drawing::VertexStore& points = drawable->points;
+    canvas->fillputPixels(points.x(0), points.x(1), points.y(0), points.y(1), pixel);
 }
 
 // static inline double slope(Drawing::Point &A, Drawing::Point &B){
 //     return (B.y() - A.y()) / (B.x() - A.x());
 // }
-static double invSlope(Drawing::Point &A, Drawing::Point &B){
+static double invSlope(const Drawing::Point2d &A, const Drawing::Point2d &B){
     return (B.x() - A.x()) / (B.y() - A.y());
 }
 
@@ -405,34 +4099,247 @@ static double invSlope(Drawing::Point &A, Drawing::Point &B){
 //     if (B.x()-A.x() == 0) return A.x();
 //     return (y-B.y())/slope(A,B) + B.x();
 // }
-static double line_zero(double y, Drawing::Point &A, Drawing::Point &B){
+static double line_zero(double y, const Drawing::Point2d &A, const Drawing::Point2d &B){
     if (B.y()-A.y() == 0) return A.x();
     return (y-B.y())*invSlope(A,B) + B.x();
 }
 
 void Drawing::triangle_filled(Drawing::Drawable *drawable, Drawing::Canvas* canvas){
-    const Drawing::Color color = drawable->getPixel(0, 0);
+    const Drawing::VertexStore& vertices = drawable->points;
+    const double x[3] = {vertices.x(0), vertices.x(1), vertices.x(2)};
+    const double y[3] = {vertices.y(0), vertices.y(1), vertices.y(2)};
+    _triangleScanline(canvas, x, y, drawable->getPixel(0, 0));
+}
 
-    std::sort(drawable->points.begin(), drawable->points.end(), [](Drawing::Point a, Drawing::Point b) {
+static void _triangleScanline(Drawing::Canvas* canvas, const double x[3], const double y[3], 
+    const Drawing::Color& color){
+
+    //sorted copy, triangle may be drawn by several tiles at once
+    Drawing::Point2d points[3] = {{{x[0], y[0]}}, {{x[1], y[1]}}, {{x[2], y[2]}}};
+    std::sort(points, points+3, [](const Drawing::Point2d &a, const Drawing::Point2d &b) {
         return a.y() < b.y();
     });
 
-    for(png_uint_32 y=ceil(drawable->points[0].y()); y<drawable->points[2].y(); y++){
+    //rows and columns outside clip rect would be dropped anyway, clamped before
+    //conversion so coordinates left or above canvas do not wrap around
+    const Drawing::Rect& clip = canvas->getClipRect();
+    const double yStart = std::max(ceil(points[0].y()), (double) clip.y1);
+    const double yEnd = std::min((double) clip.y2, points[2].y());
+    if (yEnd <= yStart) return;
+
+    for(png_uint_32 y=yStart; y<yEnd; y++){
         
-        png_uint_32 x1 = line_zero(y, drawable->points[0], drawable->points[2]);
-        png_uint_32 x2;
+        double x1 = line_zero(y, points[0], points[2]);
+        double x2;
 
-        if (y < drawable->points[1].y())
-            x2 = line_zero(y, drawable->points[0], drawable->points[1]);
+        if (y < points[1].y())
+            x2 = line_zero(y, points[0], points[1]);
         else
-            x2 = line_zero(y, drawable->points[1], drawable->points[2]);
+            x2 = line_zero(y, points[1], points[2]);
 
         if(x1 > x2) 
             std::swap(x1, x2);
 
+        x1 = std::min(std::max(x1, (double) clip.x1), (double) clip.x2);
+        x2 = std::min(std::max(x2, (double) clip.x1), (double) clip.x2);
         canvas->fillputPixels(
-            x1, x2,
+            (png_uint_32) x1, (png_uint_32) x2,
             y, color
         );
     }
-}
\ No newline at end of file
+}
+
+
+namespace {
+    //E(x, y) = a*x + b*y + c in subpixels, inside where E >= 0
+    struct _Edge {
+        long long a, b, c;
+    };
+}
+
+static const int _subpixelBits = 8;
+static const long long _subpixel = 1 << _subpixelBits;
+static const int _blockSize = 8;
+static const int _aaSamples = 4; //per axis
+
+static long long _toSubpixel(double value){
+    //keeps edge function products in 64 bits
+    const double limit = (double) (1 << 20);
+    return llround(std::min(std::max(value, -limit), limit) * _subpixel);
+}
+
+static long long _floorDiv(long long value, long long divisor){
+    return value >= 0 ? value / divisor : -((-value + divisor - 1) / divisor);
+}
+
+static _Edge _makeEdge(long long x0, long long y0, long long x1, long long y1){
+    _Edge edge;
+    edge.a = -(y1 - y0);
+    edge.b = x1 - x0;
+    edge.c = -(edge.a*x0 + edge.b*y0);
+    //top-left rule, samples exactly on other edges belong to the neighbour triangle
+    const bool topLeft = (y1 < y0) || (y1 == y0 && x1 > x0);
+    if (!topLeft) edge.c -= 1;
+    return edge;
+}
+
+static void _triangleEdges(Drawing::Canvas* canvas, const double vertexX[3], const double vertexY[3], 
+    const Drawing::Color& color, bool antialiased){
+
+    long long x[3], y[3];
+    for (int i=0; i<3; i++){
+        x[i] = _toSubpixel(vertexX[i]);
+        y[i] = _toSubpixel(vertexY[i]);
+    }
+
+    const long long area = (x[1]-x[0])*(y[2]-y[0]) - (y[1]-y[0])*(x[2]-x[0]);
+    if (area == 0) return;
+    if (area < 0){
+        std::swap(x[1], x[2]);
+        std::swap(y[1], y[2]);
+    }
+    const _Edge edges[3] = {
+        _makeEdge(x[0], y[0], x[1], y[1]),
+        _makeEdge(x[1], y[1], x[2], y[2]),
+        _makeEdge(x[2], y[2], x[0], y[0])
+    };
+
+    //pixels touched by the triangle, clipped
+    const Drawing::Rect& clip = canvas->getClipRect();
+    const long long minX = std::max(_floorDiv(*std::min_element(x, x+3), _subpixel), (long long) clip.x1);
+    const long long minY = std::max(_floorDiv(*std::min_element(y, y+3), _subpixel), (long long) clip.y1);
+    const long long maxX = std::min(_floorDiv(*std::max_element(x, x+3), _subpixel) + 1, (long long) clip.x2);
+    const long long maxY = std::min(_floorDiv(*std::max_element(y, y+3), _subpixel) + 1, (long long) clip.y2);
+    if (minX >= maxX || minY >= maxY) return;
+
+    //sample positions inside a pixel, pixel centre without antialiasing
+    const int samples = antialiased ? _aaSamples*_aaSamples : 1;
+    const long long sampleStep = antialiased ? _subpixel / _aaSamples : 0;
+    const long long sampleFirst = antialiased ? sampleStep / 2 : _subpixel / 2;
+    const long long sampleLast = sampleFirst + sampleStep*(antialiased ? _aaSamples-1 : 0);
+
+    long long sampleOffsets[3][_aaSamples*_aaSamples];
+    for (int e=0; e<3; e++){
+        for (int i=0; i<samples; i++){
+            const long long offsetX = sampleFirst + sampleStep*(i % _aaSamples);
+            const long long offsetY = sampleFirst + sampleStep*(i / _aaSamples);
+            sampleOffsets[e][i] = edges[e].a*offsetX + edges[e].b*offsetY;
+        }
+    }
+
+    //alpha of every coverage level
+    Drawing::Color coverageColors[_aaSamples*_aaSamples + 1];
+    for (int i=0; i<=samples; i++){
+        coverageColors[i] = color;
+        coverageColors[i].a = color.a * i / samples;
+    }
+
+    //runs of equal coverage continue across blocks, covered pixels of a row are contiguous
+    long long runX[_blockSize];
+    int runCoverage[_blockSize];
+    auto extendRun = [&](long long row, long long px, long long y, int coverage){
+        if (coverage == runCoverage[row]) return;
+        if (runCoverage[row] && px > runX[row]) canvas->fillputPixels(runX[row], px, y, coverageColors[runCoverage[row]]);
+        runX[row] = px;
+        runCoverage[row] = coverage;
+    };
+
+    for (long long blockY=minY; blockY<maxY; blockY+=_blockSize){
+        const long long blockY2 = std::min(blockY + _blockSize, maxY);
+        const long long rows = blockY2 - blockY;
+        std::fill(runCoverage, runCoverage + rows, 0);
+        int rowsCoverage = 0; //coverage of all rows' runs, -1 if they differ
+        bool entered = false;
+
+        for (long long blockX=minX; blockX<maxX; blockX+=_blockSize){
+            const long long blockX2 = std::min(blockX + _blockSize, maxX);
+
+            //edge functions are linear, extremes of the block are at its corner samples
+            const long long spanX = (blockX2-1-blockX)*_subpixel + sampleLast - sampleFirst;
+            const long long spanY = (blockY2-1-blockY)*_subpixel + sampleLast - sampleFirst;
+            bool rejected = false, accepted = true;
+            for (int e=0; e<3 && !rejected; e++){
+                const _Edge& edge = edges[e];
+                const long long corner = edge.a*(blockX*_subpixel + sampleFirst) 
+                    + edge.b*(blockY*_subpixel + sampleFirst) + edge.c;
+                const long long high = corner + std::max(0LL, edge.a*spanX) + std::max(0LL, edge.b*spanY);
+                const long long low = corner + std::min(0LL, edge.a*spanX) + std::min(0LL, edge.b*spanY);
+                rejected = high < 0;
+                accepted = accepted && low >= 0;
+            }
+
+            if (rejected || accepted){
+                const int coverage = rejected ? 0 : samples;
+                if (rowsCoverage != coverage){
+                    for (long long row=0; row<rows; row++) extendRun(row, blockX, blockY+row, coverage);
+                    rowsCoverage = coverage;
+                }
+                //triangle is convex, nothing more in this block row once left
+                if (rejected && entered) break;
+                entered = entered || !rejected;
+                continue;
+            }
+            entered = true;
+            rowsCoverage = -1;
+
+            //partial block, covered pixels of a row from the edge equations
+            if (!antialiased){
+                for (long long row=0; row<rows; row++){
+                    const long long py = blockY + row;
+                    long long x1 = blockX, x2 = blockX2;
+                    for (int e=0; e<3; e++){
+                        //a*256*x + m >= 0
+                        const long long k = edges[e].a*_subpixel;
+                        const long long m = edges[e].a*sampleFirst + edges[e].b*(py*_subpixel + sampleFirst) + edges[e].c;
+                        if (k > 0) x1 = std::max(x1, -_floorDiv(m, k));
+                        else if (k < 0) x2 = std::min(x2, _floorDiv(m, -k) + 1);
+                        else if (m < 0) x2 = x1;
+                    }
+                    if (x1 >= x2){
+                        extendRun(row, blockX, py, 0);
+                        continue;
+                    }
+                    if (x1 > blockX) extendRun(row, blockX, py, 0);
+                    extendRun(row, x1, py, samples);
+                    if (x2 < blockX2) extendRun(row, x2, py, 0);
+                }
+                continue;
+            }
+
+            //partial block, coverage of every pixel
+            for (long long row=0; row<rows; row++){
+                const long long py = blockY + row;
+                long long base[3];
+                for (int e=0; e<3; e++)
+                    base[e] = edges[e].a*blockX*_subpixel + edges[e].b*py*_subpixel + edges[e].c;
+
+                for (long long px=blockX; px<blockX2; px++){
+                    int coverage = 0;
+                    for (int i=0; i<samples; i++){
+                        coverage += base[0] + sampleOffsets[0][i] >= 0 
+                            && base[1] + sampleOffsets[1][i] >= 0 
+                            && base[2] + sampleOffsets[2][i] >= 0;
+                    }
+                    for (int e=0; e<3; e++) base[e] += edges[e].a*_subpixel;
+                    extendRun(row, px, py, coverage);
+                }
+            }
+        }
+        for (long long row=0; row<rows; row++) extendRun(row, maxX, blockY+row, 0);
+    }
+}
+
+static void _triangleEdges(Drawing::Drawable* drawable, Drawing::Canvas* canvas, bool antialiased){
+    const Drawing::VertexStore& vertices = drawable->points;
+    const double x[3] = {vertices.x(0), vertices.x(1), vertices.x(2)};
+    const double y[3] = {vertices.y(0), vertices.y(1), vertices.y(2)};
+    _triangleEdges(canvas, x, y, drawable->getPixel(0, 0), antialiased);
+}
+
+void Drawing::triangle_edge(Drawing::Drawable *drawable, Drawing::Canvas* canvas){
+    _triangleEdges(drawable, canvas, false);
+}
+
+void Drawing::triangle_edge_aa(Drawing::Drawable *drawable, Drawing::Canvas* canvas){
+    _triangleEdges(drawable, canvas, true);
+}
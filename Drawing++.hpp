@@ -1,13 +1,33 @@
 #include <vector>
+#include <initializer_list>
+#include <type_traits>
 #include <png.h>
 #include <memory>
 #include <stdlib.h>
 #include <cassert>
 #include <cmath>
 #include <algorithm>
+#include <cstring>
+#include <cstddef>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <chrono>
 
 #define DEFAULT_DRAWING_FUNCS 1
 
+//render instrumentation (Drawing::Profiler), compiled out unless defined to 1
+#ifndef DRAWING_PROFILE
+#define DRAWING_PROFILE 0
+#endif
+
 namespace Drawing {
     struct Color{
         Color (void) {}
@@ -42,25 +62,574 @@ namespace Drawing {
     }
 
     
-    //behold true beauty!!! 
-    struct Point : std::vector<double> {
-        Point(void) {};
-        Point(std::vector<double> coords) : std::vector<double>(coords) {}
-        double x(void) const { return this->at(0); }
-        double y(void) const { return this->at(1); }
-        double z(void) const { return this->at(2); }
-        double w(void) const { return this->at(3); }
+    //fixed dimension point, trivially copyable
+    template <size_t N, typename T = double>
+    struct BasicPoint {
+        static_assert(N >= 1 && N <= 4, "BasicPoint has 1 to 4 coordinates");
+        T coords[N];
+
+        T x(void) const { return coords[0]; }
+        T y(void) const { static_assert(N >= 2, "no y coordinate"); return coords[1]; }
+        T z(void) const { static_assert(N >= 3, "no z coordinate"); return coords[2]; }
+        T w(void) const { static_assert(N >= 4, "no w coordinate"); return coords[3]; }
+        T& operator[](size_t i) { return coords[i]; }
+        const T& operator[](size_t i) const { return coords[i]; }
+        static constexpr size_t size(void) { return N; }
+    };
+    using Point2f = BasicPoint<2, float>;
+    using Point2d = BasicPoint<2, double>;
+    using Point3f = BasicPoint<3, float>;
+    using Point3d = BasicPoint<3, double>;
+    using Point2i = BasicPoint<2, int>;
+
+    //up to 4 double coordinates, dimension chosen at construction
+    struct Point {
+        static const size_t maxDimensions = 4;
+
+        Point(void) {}
+        Point(std::initializer_list<double> coords) { _assign(coords.begin(), coords.size()); }
+        Point(const std::vector<double>& coords) { _assign(coords.data(), coords.size()); }
+        Point(const double* coords, size_t size) { _assign(coords, size); }
+        template <size_t N, typename T>
+        Point(const BasicPoint<N, T>& point){
+            for (size_t i=0; i<N; i++) m_coords[i] = point.coords[i];
+            m_size = N;
+        }
+
+        double x(void) const { return m_coords[0]; }
+        double y(void) const { return m_coords[1]; }
+        double z(void) const { return m_coords[2]; }
+        double w(void) const { return m_coords[3]; }
+        double& operator[](size_t i) { return m_coords[i]; }
+        const double& operator[](size_t i) const { return m_coords[i]; }
+        size_t size(void) const { return m_size; }
+        bool empty(void) const { return m_size == 0; }
+        double* begin(void) { return m_coords; }
+        double* end(void) { return m_coords + m_size; }
+        const double* begin(void) const { return m_coords; }
+        const double* end(void) const { return m_coords + m_size; }
+
         Point& operator*=(const Point &rhs){
-            std::transform(this->begin(), this->end(), rhs.begin(), 
-                this->begin(), std::multiplies<double>());
+            for (size_t i=0; i<m_size; i++) m_coords[i] *= rhs.m_coords[i];
             return *this;
         }
+
+        private:
+            void _assign(const double* coords, size_t size){
+                assert(size <= maxDimensions);
+                std::copy(coords, coords+size, m_coords);
+                m_size = size;
+            }
+
+            double m_coords[maxDimensions] = {0, 0, 0, 0};
+            size_t m_size = 0;
     };
     inline Point operator*(Point lhs, const Point &rhs) {
-        std::transform(lhs.begin(), lhs.end(), rhs.begin(), 
-            lhs.begin(), std::multiplies<double>());
-        return lhs;
+        return lhs *= rhs;
     }
+    static_assert(std::is_trivially_copyable<Point>::value, "Point is copied by value in vertex loops");
+    static_assert(std::is_trivially_copyable<Point2d>::value, "BasicPoint is copied by value in vertex loops");
+
+    //structure of arrays vertex storage, a few vertices need no allocation
+    class VertexStore {
+        public:
+            static const size_t inlineCapacity = 4;
+
+            class const_iterator {
+                public:
+                    const_iterator(const VertexStore* store, size_t index) 
+                        : m_store(store), m_index(index) {}
+                    Point operator*(void) const { return (*m_store)[m_index]; }
+                    const_iterator& operator++(void) { m_index++; return *this; }
+                    bool operator==(const const_iterator& other) const { return m_index == other.m_index; }
+                    bool operator!=(const const_iterator& other) const { return m_index != other.m_index; }
+                private:
+                    const VertexStore* m_store;
+                    size_t m_index;
+            };
+
+            //vertex of a mutable store, assignments to it or to its coordinates write through
+            class VertexRef {
+                public:
+                    VertexRef(VertexStore& store, size_t index) : m_store(&store), m_index(index) {}
+                    VertexRef(const VertexRef& other) = default;
+
+                    operator Point(void) const { return ((const VertexStore&) *m_store)[m_index]; }
+                    VertexRef& operator=(const Point& point) { m_store->set(m_index, point); return *this; }
+                    VertexRef& operator=(const VertexRef& other) { return *this = (Point) other; }
+
+                    double& operator[](size_t d) const { return m_store->m_data[d*m_store->m_capacity + m_index]; }
+                    double x(void) const { return (*this)[0]; }
+                    double y(void) const { return (*this)[1]; }
+                    double z(void) const { return (*this)[2]; }
+                    double w(void) const { return (*this)[3]; }
+                    size_t size(void) const { return m_store->m_dims[m_index]; }
+                private:
+                    VertexStore* m_store;
+                    size_t m_index;
+            };
+
+            VertexStore(void) {}
+            VertexStore(std::initializer_list<Point> points);
+            VertexStore(const std::vector<Point>& points);
+            VertexStore(const VertexStore& other);
+            VertexStore(VertexStore&& other) noexcept;
+            VertexStore& operator=(const VertexStore& other);
+            VertexStore& operator=(VertexStore&& other) noexcept;
+            ~VertexStore(void);
+
+            size_t size(void) const { return m_size; }
+            bool empty(void) const { return m_size == 0; }
+            size_t capacity(void) const { return m_capacity; }
+            void reserve(size_t capacity);
+            void clear(void) { m_size = 0; }
+            void push_back(const Point& point);
+            void set(size_t i, const Point& point);
+
+            Point operator[](size_t i) const;
+            VertexRef operator[](size_t i) { assert(i < m_size); return VertexRef(*this, i); }
+            double x(size_t i) const { return m_data[i]; }
+            double y(size_t i) const { return m_data[m_capacity + i]; }
+            //size() values of one coordinate
+            const double* getComponent(size_t dimension) const { return m_data + dimension*m_capacity; }
+
+            const_iterator begin(void) const { return const_iterator(this, 0); }
+            const_iterator end(void) const { return const_iterator(this, m_size); }
+
+        private:
+            void _write(size_t i, const Point& point);
+
+            double m_inline[inlineCapacity*Point::maxDimensions];
+            png_byte m_inlineDims[inlineCapacity];
+            double* m_data = m_inline;
+            png_bytep m_dims = m_inlineDims;
+            size_t m_size = 0;
+            size_t m_capacity = inlineCapacity;
+    };
+
+
+    //contiguous pixel storage, every row starts on a 64-byte boundary
+    class FrameBuffer {
+        public:
+            static const size_t alignment = 64;
+
+            FrameBuffer(void) {};
+            FrameBuffer(png_uint_32 width, png_uint_32 height, png_byte channels, png_byte bitDepth = 8);
+            FrameBuffer(const FrameBuffer& buffer);
+            FrameBuffer(FrameBuffer&& buffer) noexcept;
+            ~FrameBuffer();
+
+            FrameBuffer& operator=(const FrameBuffer& rhs);
+            FrameBuffer& operator=(FrameBuffer&& rhs) noexcept;
+
+            //reshape buffer, memory is reallocated only when capacity is too small
+            void resize(png_uint_32 width, png_uint_32 height, png_byte channels, png_byte bitDepth = 8);
+            void release(void);
+
+            png_bytep getRow(png_uint_32 y) { return m_data + y*m_stride; }
+            png_const_bytep getRow(png_uint_32 y) const { return m_data + y*m_stride; }
+            png_bytep getData(void) { return m_data; }
+            png_const_bytep getData(void) const { return m_data; }
+
+            png_uint_32 getWidth(void) const { return m_width; }
+            png_uint_32 getHeight(void) const { return m_height; }
+            png_byte getChannels(void) const { return m_channels; }
+            png_byte getBitDepth(void) const { return m_bitDepth; }
+            //bytes per pixel, 16-bit samples are in native byte order
+            png_byte getPixelSize(void) const { return m_channels*m_bitDepth/8; }
+            size_t getStride(void) const { return m_stride; }
+            size_t getRowBytes(void) const { return (size_t) m_width*getPixelSize(); }
+            size_t getSize(void) const { return m_stride*m_height; }
+            size_t getCapacity(void) const { return m_capacity; }
+
+            static size_t computeStride(png_uint_32 width, png_byte pixelSize) {
+                return ((size_t) width*pixelSize + alignment-1) / alignment * alignment;
+            }
+
+            //row pointer view for libpng, valid as long as buffer is not resized
+            std::vector<png_bytep> getRowPointers(void);
+
+        private:
+            png_bytep m_data = nullptr;
+            size_t m_capacity = 0;
+            size_t m_stride = 0;
+            png_uint_32 m_width = 0;
+            png_uint_32 m_height = 0;
+            png_byte m_channels = 0;
+            png_byte m_bitDepth = 8;
+    };
+    static_assert(std::is_nothrow_move_constructible<FrameBuffer>::value, "vectors of FrameBuffer move pixels on growth");
+
+    //keeps released buffers for reuse by canvases of similar size
+    class FrameBufferPool {
+        public:
+            FrameBufferPool(size_t maxBuffers = 16) : m_maxBuffers(maxBuffers) {}
+
+            FrameBuffer acquire(png_uint_32 width, png_uint_32 height, png_byte channels, png_byte bitDepth = 8);
+            void release(FrameBuffer&& buffer);
+
+            void setMaxBuffers(size_t maxBuffers);
+            size_t getBuffersSize(void);
+            void clear(void);
+
+        private:
+            std::mutex m_mutex;
+            std::vector<FrameBuffer> m_buffers;
+            size_t m_maxBuffers;
+    };
+
+
+    //RGBA8 span kernels, selected at runtime by CPU detection
+    enum class SimdLevel { Scalar, SSE2, AVX2 };
+
+    //fixed-point form of Color for span kernels:
+    //blend: out = (old*mul + add) >> 8, old is zeroed where pixel alpha != 255
+    //set: out = rgba, alpha channel untouched
+    struct SpanColor {
+        png_uint_16 mul[4];
+        png_uint_16 add[4];
+        png_byte rgba[4];
+    };
+    SpanColor makeSpanColor(const Color& color);
+
+    //how Canvas blends colors, every mode but Legacy keeps premultiplied RGBA8 with alpha written
+    enum class BlendMode {
+        Legacy,   //straight colors, alpha channel untouched
+        Over,     //Porter-Duff source over destination
+        Add,      //saturating sum
+        Multiply, //source*destination + uncovered parts of both
+        Source    //source replaces destination
+    };
+
+    struct SpanKernels {
+        SimdLevel level;
+        void (*blendSpan)(png_bytep row, png_uint_32 count, const SpanColor& color);
+        void (*setSpan)(png_bytep row, png_uint_32 count, const SpanColor& color);
+        void (*blendRect)(png_bytep data, size_t stride, png_uint_32 width, 
+            png_uint_32 height, const SpanColor& color);
+        void (*setRect)(png_bytep data, size_t stride, png_uint_32 width, 
+            png_uint_32 height, const SpanColor& color);
+        //alpha of every source pixel blended like Canvas::putPixel, destination alpha untouched
+        void (*blendRow)(png_bytep dst, png_const_bytep src, png_uint_32 count);
+        //premultiplied color composited over premultiplied row, mode is not Legacy
+        void (*compositeSpan)(png_bytep row, png_uint_32 count, const png_byte color[4], BlendMode mode);
+
+        //compare kernels add to sums, channel sum of pixel is r+g+b+a
+        //sums = {sum (channelSumA-channelSumB)^2, sum channelSumA^2, sum channelSumB^2}
+        void (*compareChannelSums)(png_const_bytep rowA, png_const_bytep rowB, 
+            png_uint_32 count, unsigned long long sums[3]);
+        //sums[c] = sum (A[c]-B[c])^2 for every channel
+        void (*compareChannels)(png_const_bytep rowA, png_const_bytep rowB, 
+            png_uint_32 count, unsigned long long sums[4]);
+
+        //count pixels, each rounded average of 2x2 source pixels of row0 and row1
+        void (*downsampleRow)(png_bytep dst, png_const_bytep row0, png_const_bytep row1, png_uint_32 count);
+    };
+
+    //color to premultiplied RGBA8
+    void premultiplyColor(const Color& color, png_byte out[4]);
+    void premultiplyRow(png_bytep row, png_uint_32 count);
+    void unpremultiplyRow(png_bytep row, png_uint_32 count);
+
+    SimdLevel detectSimdLevel(void);
+    //kernels for level, falls back to best level supported by CPU
+    const SpanKernels& getSpanKernels(SimdLevel level);
+    //kernels used by Canvas, detected level unless overridden
+    const SpanKernels& getSpanKernels(void);
+    void setSimdLevel(SimdLevel level);
+    const char* getSimdLevelName(SimdLevel level);
+
+
+    //sample layout of Canvas buffer, set by bit depth and color type of its PNG header
+    enum class PixelFormat { RGBA8, RGB8, Gray8, RGBA16 };
+
+    template <PixelFormat Format> struct PixelFormatTraits;
+    template <> struct PixelFormatTraits<PixelFormat::RGBA8> {
+        typedef png_byte Sample;
+        static const png_byte channels = 4, bitDepth = 8;
+        static const int colorType = PNG_COLOR_TYPE_RGBA;
+    };
+    template <> struct PixelFormatTraits<PixelFormat::RGB8> {
+        typedef png_byte Sample;
+        static const png_byte channels = 3, bitDepth = 8;
+        static const int colorType = PNG_COLOR_TYPE_RGB;
+    };
+    template <> struct PixelFormatTraits<PixelFormat::Gray8> {
+        typedef png_byte Sample;
+        static const png_byte channels = 1, bitDepth = 8;
+        static const int colorType = PNG_COLOR_TYPE_GRAY;
+    };
+    template <> struct PixelFormatTraits<PixelFormat::RGBA16> {
+        typedef png_uint_16 Sample;
+        static const png_byte channels = 4, bitDepth = 16;
+        static const int colorType = PNG_COLOR_TYPE_RGBA;
+    };
+
+    //Legacy blend mode routines of one pixel format, instantiated per format at compile time;
+    //RGBA8 fills, blends and compares are the span kernels. Gray is luma (Rec. 709) of color,
+    //formats without alpha are opaque and alpha is never written by blending
+    struct PixelFormatOps {
+        PixelFormat format;
+        png_byte channels;
+        png_byte bitDepth;
+        png_byte pixelSize;
+
+        //every pixel set to color, alpha included
+        void (*fillRow)(png_bytep row, png_uint_32 count, const Color& color);
+        void (*putPixel)(png_bytep pixel, const Color& color);
+        void (*setPixel)(png_bytep pixel, const Color& color);
+        void (*blendRect)(png_bytep data, size_t stride, png_uint_32 width, 
+            png_uint_32 height, const Color& color);
+        void (*setRect)(png_bytep data, size_t stride, png_uint_32 width, 
+            png_uint_32 height, const Color& color);
+        //straight RGBA8 source row blended by its alpha, or converted (alpha included)
+        void (*blendRow)(png_bytep dst, png_const_bytep src, png_uint_32 count);
+        void (*copyRow)(png_bytep dst, png_const_bytep src, png_uint_32 count);
+
+        //same sums as SpanKernels, in sample units of format
+        void (*compareChannelSums)(png_const_bytep rowA, png_const_bytep rowB, 
+            png_uint_32 count, unsigned long long sums[3]);
+        void (*compareChannels)(png_const_bytep rowA, png_const_bytep rowB, 
+            png_uint_32 count, unsigned long long sums[4]);
+    };
+
+    const PixelFormatOps& getPixelFormatOps(PixelFormat format);
+    //aborts for PNG formats Canvas cannot draw to
+    PixelFormat getPNGPixelFormat(int bitDepth, int colorType);
+
+
+    //work-stealing pool, every worker pops from its own queue and steals from others when idle
+    class ThreadPool {
+        public:
+            //workers = 0 uses one worker less than hardware threads (caller takes part too)
+            ThreadPool(unsigned workers = 0);
+            ThreadPool(const ThreadPool&) = delete;
+            ThreadPool& operator=(const ThreadPool&) = delete;
+            ~ThreadPool();
+
+            void submit(std::function<void()> task);
+
+            //run fn(0)...fn(count-1), caller executes tasks too until all are done
+            void parallelFor(size_t count, const std::function<void(size_t)>& fn);
+
+            unsigned getWorkersSize(void) const { return m_workers.size(); }
+            unsigned getThreadsSize(void) const { return m_workers.size()+1; }
+
+        private:
+            struct TaskQueue {
+                std::mutex mutex;
+                std::deque<std::function<void()>> tasks;
+            };
+
+            bool _popTask(std::function<void()>& task);
+            void _workerLoop(unsigned index);
+
+            std::vector<std::unique_ptr<TaskQueue>> m_queues;
+            std::vector<std::thread> m_workers;
+            std::mutex m_sleepMutex;
+            std::condition_variable m_sleepCv;
+            std::atomic<size_t> m_queued{0};
+            std::atomic<unsigned> m_nextQueue{0};
+            bool m_stop = false;
+    };
+
+
+    //half-open pixel rectangle [x1, x2) x [y1, y2)
+    struct Rect {
+        Rect (void) {}
+        Rect (png_uint_32 x1, png_uint_32 y1, png_uint_32 x2, png_uint_32 y2){
+            this->x1 = x1;
+            this->y1 = y1;
+            this->x2 = x2;
+            this->y2 = y2;
+        }
+        bool isEmpty(void) const { return x1 >= x2 || y1 >= y2; }
+        bool contains(png_uint_32 x, png_uint_32 y) const { 
+            return x >= x1 && x < x2 && y >= y1 && y < y2; 
+        }
+        bool intersects(const Rect &rhs) const {
+            return x1 < rhs.x2 && rhs.x1 < x2 && y1 < rhs.y2 && rhs.y1 < y2;
+        }
+        Rect intersect(const Rect &rhs) const {
+            Rect rect(std::max(x1, rhs.x1), std::max(y1, rhs.y1), 
+                std::min(x2, rhs.x2), std::min(y2, rhs.y2));
+            if (rect.isEmpty()) rect = Rect();
+            return rect;
+        }
+        png_uint_32 x1 = 0, y1 = 0, x2 = 0, y2 = 0;
+    };
+
+
+    //pixels written since last clear, kept as one span [x1, x2) per row
+    class DirtyRegion {
+        public:
+            void reset(png_uint_32 width, png_uint_32 height);
+            void mark(png_uint_32 x1, png_uint_32 x2, png_uint_32 y1, png_uint_32 y2);
+            void mark(const Rect& rect) { mark(rect.x1, rect.x2, rect.y1, rect.y2); }
+            void markAll(void) { mark(0, m_width, 0, m_x1.size()); }
+            void clear(void);
+
+            bool isEmpty(void) const { return m_bounds.isEmpty(); }
+            const Rect& getBounds(void) const { return m_bounds; }
+            //empty span (x1 >= x2) if row is clean
+            png_uint_32 getRowX1(png_uint_32 y) const { return m_x1[y]; }
+            png_uint_32 getRowX2(png_uint_32 y) const { return m_x2[y]; }
+
+        private:
+            std::vector<png_uint_32> m_x1;
+            std::vector<png_uint_32> m_x2;
+            png_uint_32 m_width = 0;
+            Rect m_bounds;
+    };
+
+
+    enum class BlitMode {
+        Copy,     //all four channels are copied
+        AlphaOver //source alpha blended like putPixel, canvas alpha kept
+    };
+
+    enum class CompareMetric {
+        ChannelSum, //difference of r+g+b+a sums, normalized, 0 = same (lower is better)
+        MSE,        //mean squared error of all channels (lower is better)
+        PSNR,       //peak signal-to-noise ratio in dB, infinity = same (higher is better)
+        SSIM        //mean structural similarity of 8x8 tiles, 1 = same (higher is better)
+    };
+
+
+    enum class PNGFilter { Default, None, Sub, Up, Average, Paeth, Adaptive };
+    enum class PNGStrategy { Default, Filtered, HuffmanOnly, RLE, Fixed };
+
+    struct PNGWriteOptions {
+        int compressionLevel = -1; //zlib level 0-9, -1 = libpng default
+        PNGFilter filter = PNGFilter::Default; //Adaptive tries all filters per row
+        PNGStrategy strategy = PNGStrategy::Default;
+    };
+
+    //IHDR fields of written image
+    struct PNGHeader {
+        png_uint_32 width = 0;
+        png_uint_32 height = 0;
+        int bitDepth = 8;
+        int colorType = PNG_COLOR_TYPE_RGBA;
+        int interlaceMethod = PNG_INTERLACE_NONE;
+        int compressMethod = PNG_COMPRESSION_TYPE_DEFAULT;
+        int filterMethod = PNG_FILTER_TYPE_DEFAULT;
+
+        bool operator==(const PNGHeader& rhs) const {
+            return width == rhs.width && height == rhs.height && bitDepth == rhs.bitDepth 
+                && colorType == rhs.colorType && interlaceMethod == rhs.interlaceMethod
+                && compressMethod == rhs.compressMethod && filterMethod == rhs.filterMethod;
+        }
+    };
+
+
+    enum class AllocationKind {
+        FrameBuffer, //pixel memory
+        VertexStore, //vertices beyond inline capacity
+        ArenaBlock,
+        SceneList,   //growth of canvas command and drawable lists
+        Drawable,    //drawable copied by addDrawable outside arena
+        Count
+    };
+
+    //process-wide heap allocations made by the library, a steady-state render loop should add none
+    unsigned long long getAllocationCount(AllocationKind kind);
+    unsigned long long getAllocationCount(void);
+    void resetAllocationCounts(void);
+    void countAllocation(AllocationKind kind);
+
+    struct ProfileEvent {
+        const char* name; //phase (draw, compare, bufferToFile...) or type of draw command
+        long long command; //index of draw command, -1 for phases
+        unsigned thread; //in order of first recorded event
+        unsigned long long start; //ns since profiler creation
+        unsigned long long duration; //ns
+        unsigned long long blendedPixels; //pixels written by put/fillput/blit while event lasted
+        unsigned long long setPixels; //pixels written by set/fillset/copy blit
+    };
+
+    //per-command and per-phase timing, recorded only when DRAWING_PROFILE is 1 and profiler
+    //is enabled; events are kept per thread, read them when no drawing is in progress
+    class Profiler {
+        public:
+            static Profiler& getInstance(void);
+
+            void setEnabled(bool enabled);
+            bool isEnabled(void) const;
+            void clear(void);
+
+            //appended to events of calling thread, e.g. own phases
+            void record(ProfileEvent event);
+            unsigned long long getTime(void) const;
+
+            //events of all threads ordered by start
+            std::vector<ProfileEvent> getEvents(void);
+            //Chrome trace event JSON, opens in chrome://tracing or Perfetto
+            void writeTrace(const char* filepath);
+            //totals per phase and commands with most time
+            std::string getSummary(size_t commands = 10);
+
+        private:
+            Profiler(void);
+
+            std::mutex m_mutex;
+            std::vector<std::shared_ptr<std::vector<ProfileEvent>>> m_threads;
+            std::chrono::steady_clock::time_point m_epoch;
+    };
+
+    //monotonic allocator, memory is reclaimed only all at once by reset
+    class Arena {
+        public:
+            Arena(size_t blockSize = 64 << 10) : m_blockSize(blockSize) {}
+            ~Arena(void);
+            Arena(const Arena&) = delete;
+            Arena& operator=(const Arena&) = delete;
+
+            void* allocate(size_t size, size_t alignment = alignof(std::max_align_t));
+            //O(1), blocks are kept for next allocations
+            void reset(void);
+            //frees blocks
+            void release(void);
+
+            size_t getBlockSize(void) const { return m_blockSize; }
+            size_t getBytesUsed(void) const { return m_usedBefore + m_offset; }
+            size_t getCapacity(void) const { return m_capacity; }
+
+        private:
+            struct Block {
+                Block* next;
+                size_t size;
+            };
+            static const size_t headerSize = (sizeof(Block) + alignof(std::max_align_t) - 1) 
+                / alignof(std::max_align_t) * alignof(std::max_align_t);
+
+            Block* m_first = nullptr;
+            Block* m_current = nullptr;
+            size_t m_offset = 0; //bytes used in current block
+            size_t m_usedBefore = 0; //bytes of blocks before current
+            size_t m_capacity = 0;
+            size_t m_blockSize;
+    };
+
+    //objects allocated with it (and their shared_ptr control blocks) keep arena alive
+    template <typename T>
+    struct ArenaAllocator {
+        using value_type = T;
+
+        ArenaAllocator(std::shared_ptr<Arena> arena) : arena(std::move(arena)) {}
+        template <typename U>
+        ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+        T* allocate(size_t count) { return (T*) arena->allocate(count*sizeof(T), alignof(T)); }
+        void deallocate(T* /*ptr*/, size_t /*count*/) {}
+
+        template <typename U>
+        bool operator==(const ArenaAllocator<U>& other) const { return arena == other.arena; }
+        template <typename U>
+        bool operator!=(const ArenaAllocator<U>& other) const { return arena != other.arena; }
+
+        std::shared_ptr<Arena> arena;
+    };
 
 
     class Drawable;
@@ -72,8 +641,18 @@ namespace Drawing {
             virtual Color getPixel(unsigned x, unsigned y) = 0;
             void setDrawFn(draw_fn_ptr drawFnPtr) { drawFn = drawFnPtr; }
 
-            std::vector<Point> points;
+            //area drawFn may write to, false if unknown (user draw function without bounds set)
+            virtual bool getBounds(Rect& bounds) const;
+            void setBounds(const Rect& bounds) { m_bounds = bounds; m_hasBounds = true; }
+            void resetBounds(void) { m_hasBounds = false; }
+            bool hasExplicitBounds(void) const { return m_hasBounds; }
+
+            VertexStore points;
             draw_fn_ptr drawFn = nullptr;
+
+        private:
+            Rect m_bounds;
+            bool m_hasBounds = false;
     };
 
 
@@ -82,27 +661,199 @@ namespace Drawing {
         public:
             Figure (void) {};
             Figure (Color bgColor, draw_fn_ptr drawFnPtr, 
-                std::vector<Point> points);
+                VertexStore points);
             
             Color getPixel(unsigned x, unsigned y) { return m_bgColor; }
+            const Color& getColor(void) const { return m_bgColor; }
 
         private:
             Color m_bgColor;
     };
 
+    class SpanShader;
+    //fills rgba with straight alpha RGBA8 colors of pixels x1..x2-1 of row y, alpha is
+    //coverage times opacity (0 leaves pixel unchanged); rows are shaded from several threads at once
+    using span_fn_ptr = void(*)(const SpanShader* shader, png_uint_32 y, 
+        png_uint_32 x1, png_uint_32 x2, png_bytep rgba);
+
+    //per-pixel draw function computing whole row spans, spans are blended like blit;
+    //empty bounds shade whole canvas
+    class SpanShader : public Drawable {
+        public:
+            SpanShader(void);
+            SpanShader(span_fn_ptr spanFnPtr, VertexStore points = VertexStore(), 
+                const Rect& bounds = Rect());
+
+            Color getPixel(png_uint_32 x, png_uint_32 y);
+
+            span_fn_ptr spanFn = nullptr;
+    };
+
+    //part and size of decoded image, rows are decoded one at a time and only
+    //output pixels are kept, so memory depends on output size instead of file size
+    struct ImageLoadOptions {
+        Rect region; //source pixels kept, empty keeps whole image
+        //output size, area resampled from region, 0 keeps aspect ratio of region
+        //(both 0 keeps region size); integer ratios are box filters
+        png_uint_32 width = 0;
+        png_uint_32 height = 0;
+        png_byte downscale = 0; //power of two reduction of region, used when width and height are 0
+
+        bool isDefault(void) const { return region.isEmpty() && width == 0 && height == 0 && downscale == 0; }
+    };
+
     class ImageFile : public Drawable {
         public:
             ImageFile(void) {};
-            ImageFile(const char* filename);
+            ImageFile(const char* filename, const ImageLoadOptions& options = ImageLoadOptions());
 
-            void loadPNGFile(const char* filename);
+            void loadPNGFile(const char* filename, const ImageLoadOptions& options = ImageLoadOptions());
             Color getPixel(png_uint_32 x, png_uint_32 y);
+            bool getBounds(Rect& bounds) const;
+
+            png_uint_32 getWidth(void) const { return m_buffer ? m_buffer->getWidth() : 0; }
+            png_uint_32 getHeight(void) const { return m_buffer ? m_buffer->getHeight() : 0; }
+            //decoded RGBA8 pixels, shared by copies of this image and by ImageCache
+            std::shared_ptr<const FrameBuffer> getPixels(void) const { return m_buffer; }
             
         private:
-            png_bytep *m_rowBufferPtrs = nullptr;
+            std::shared_ptr<const FrameBuffer> m_buffer;
+    };
+
+    //process-wide cache of decoded PNG files, keyed by path and file modification time,
+    //least recently used images are dropped when memory budget is exceeded
+    class ImageCache {
+        public:
+            static ImageCache& getInstance(void);
+
+            //file is decoded only if not cached or changed on disk since,
+            //every load options of a file are cached separately
+            std::shared_ptr<const FrameBuffer> load(const char* filename, 
+                const ImageLoadOptions& options = ImageLoadOptions());
+
+            //bytes of pixels kept by cache, 0 disables caching
+            void setMemoryBudget(size_t bytes);
+            size_t getMemoryBudget(void) const { return m_memoryBudget; }
+            size_t getMemoryUsage(void);
+            size_t getEntriesSize(void);
+            size_t getHits(void) const { return m_hits; }
+            size_t getMisses(void) const { return m_misses; }
+            void clear(void);
+
+        private:
+            struct Entry {
+                std::string key; //path and load options
+                long long modifyTime; //ns where file system keeps them
+                long long fileSize;
+                unsigned long long device; //file replaced by rename has another inode
+                unsigned long long inode;
+                std::shared_ptr<const FrameBuffer> pixels;
+            };
+
+            ImageCache(void) {}
+            void _evict(void);
+            void _erase(std::list<Entry>::iterator entry);
+
+            std::mutex m_mutex;
+            std::list<Entry> m_lru; //most recently used first
+            std::unordered_map<std::string, std::list<Entry>::iterator> m_entries;
+            size_t m_memoryBudget = 256 << 20;
+            size_t m_memoryUsage = 0;
+            std::atomic<size_t> m_hits{0};
+            std::atomic<size_t> m_misses{0};
+    };
+
+
+
+    enum class CommandType : png_byte {
+        Rect,
+        Triangle,
+        Image,
+        Callback //drawFn of a Drawable owned by canvas
+    };
+
+    enum class TriangleMode : png_byte {
+        Scanline, //triangle_filled
+        Edge,     //triangle_edge
+        EdgeAA    //triangle_edge_aa
+    };
+
+    //one retained draw call, plain data dispatched by type
+    struct DrawCommand {
+        struct RectData { double x1, y1, x2, y2; };
+        struct TriangleData { double x[3], y[3]; };
+        struct ImageData { const FrameBuffer* pixels; png_uint_32 x, y; };
+
+        CommandType type;
+        TriangleMode triangleMode;
+        bool explicitBounds; //set by Drawable::setBounds
+        png_uint_32 drawable; //index of owning drawable of Image and Callback commands
+        Rect bounds; //Rect, Triangle and Image commands
+        Color color; //Rect and Triangle commands
+        union {
+            RectData rect;
+            TriangleData triangle;
+            ImageData image;
+        };
+    };
+    static_assert(std::is_trivially_copyable<DrawCommand>::value, "DrawCommand is stored as plain data");
+
+
+    //uniform grid of item bounds for region queries, items of every cell are kept 
+    //in ascending order; items with unknown bounds match every query
+    class SpatialGrid {
+        public:
+            //removes all items, bounds are clipped to [width x height]
+            void reset(png_uint_32 width, png_uint_32 height, png_uint_32 cellSize);
+            //adds item or replaces bounds of existing one
+            void insert(unsigned item, const Rect& bounds, bool bounded = true);
+            void remove(unsigned item);
+            //items intersecting rect in ascending order, out is cleared first
+            void query(const Rect& rect, std::vector<unsigned>& out) const;
+
+            size_t getItemsSize(void) const { return m_items.size(); }
+            png_uint_32 getCellSize(void) const { return m_cellSize; }
+
+        private:
+            enum class ItemState : png_byte { None, Bounded, Unbounded };
+            struct Item { 
+                Rect bounds; //clipped, empty when outside grid
+                ItemState state; 
+            };
+            void _cellRange(const Rect& rect, png_uint_32& cx1, png_uint_32& cy1, 
+                png_uint_32& cx2, png_uint_32& cy2) const;
+
+            std::vector<Item> m_items;
+            std::vector<std::vector<unsigned>> m_cells;
+            std::vector<unsigned> m_unbounded;
+            png_uint_32 m_cellSize = 64;
+            png_uint_32 m_cellsX = 0;
+            png_uint_32 m_cellsY = 0;
+            png_uint_32 m_width = 0;
+            png_uint_32 m_height = 0;
     };
 
+    //canvas pixels kept in tiles, snapshots taken from one canvas share tiles 
+    //not written in between (copy on write), see Canvas::takeSnapshot
+    class CanvasSnapshot {
+        public:
+            CanvasSnapshot(png_uint_32 tileSize = 64) : m_tileSize(std::max(tileSize, 1u)) {}
 
+            bool isEmpty(void) const { return m_tiles.empty(); }
+            void release(void) { m_tiles.clear(); }
+            png_uint_32 getTileSize(void) const { return m_tileSize; }
+            size_t getTilesSize(void) const { return m_tiles.size(); }
+            //tiles copied by last takeSnapshot, others are shared with previous snapshot
+            size_t getCopiedTiles(void) const { return m_copiedTiles; }
+
+        private:
+            friend class Canvas;
+            std::vector<std::shared_ptr<const FrameBuffer>> m_tiles;
+            png_uint_32 m_width = 0;
+            png_uint_32 m_height = 0;
+            png_uint_32 m_tileSize;
+            size_t m_copiedTiles = 0;
+    };
 
     class Canvas {
         public:
@@ -113,9 +864,13 @@ namespace Drawing {
                 int interlaceMethod = PNG_INTERLACE_NONE,
                 int compressMethod = PNG_COMPRESSION_TYPE_DEFAULT,
                 int filterMethod = PNG_FILTER_TYPE_DEFAULT);
+            //buffers, scene and libpng structs are taken over, canvas is left empty
+            Canvas(Canvas&& canvas) noexcept;
             ~Canvas();
 
-            Canvas& operator=(Canvas rhs);
+            //libpng structs are kept when headers match, buffer memory is reused
+            Canvas& operator=(const Canvas& rhs);
+            Canvas& operator=(Canvas&& rhs) noexcept;
 
             //init new image [width x height]
             void initImage(const png_uint_32 width, const png_uint_32 height, 
@@ -127,22 +882,73 @@ namespace Drawing {
             //init new image and assign values from pngPtr and infoPtr
             void initImage(const png_structp &pngPtr, const png_infop &infoPtr);
 
+            //buffer memory is reused when current (or pooled) buffer is large enough
             void initBuffer(
                 Color bgColor = Color(1.0, 1.0, 1.0, 1.0)
             );
 
-            //T Drawable to K (default T) shared ptr
+            //buffers are taken from and returned to pool, pool must outlive canvas
+            void setBufferPool(FrameBufferPool* pool) { m_bufferPool = pool; }
+            FrameBuffer releaseBuffer(void);
+            void adoptBuffer(FrameBuffer&& buffer);
+
+            FrameBuffer& getBuffer(void) { return *m_target; }
+            const FrameBuffer& getBuffer(void) const { return *m_target; }
+
+            //when enabled every pixel write is recorded in dirty region (see IncrementalComparator)
+            void setDirtyTracking(bool enabled);
+            bool getDirtyTracking(void) const { return m_dirtyTracking; }
+            const DirtyRegion& getDirtyRegion(void) const { return m_dirtyRegion; }
+            //dirty region of one reader (e.g. a comparator), starts all dirty and is marked like 
+            //getDirtyRegion while tracking is enabled but cleared only by its reader;
+            //canvas drops it once reader holds the only reference
+            std::shared_ptr<DirtyRegion> addDirtyReader(void);
+            //writes through getBuffer are seen by dirty region and snapshots only when marked
+            void markDirty(const Rect& rect) { _markWritten(rect.x1, rect.x2, rect.y1, rect.y2); }
+            void clearDirtyRegion(void) { m_dirtyRegion.clear(); }
+
+            //whole buffer copied to snapshot, its memory is reused
+            void takeSnapshot(FrameBuffer& snapshot) const;
+            void restoreSnapshot(const FrameBuffer& snapshot);
+            //tiles not written since previous snapshot taken or restored are shared 
+            //with it instead of copied
+            void takeSnapshot(CanvasSnapshot& snapshot);
+            //only tiles that may differ from snapshot are copied back, snapshot stays valid
+            void restoreSnapshot(const CanvasSnapshot& snapshot);
+
+            //pixel writes outside clip rect are dropped, default is whole canvas
+            void setClipRect(const Rect& rect);
+            void resetClipRect(void);
+            const Rect& getClipRect(void) const { return m_clip; }
+
+            //rect_filled and triangle figures are recorded as plain commands, other 
+            //drawables are copied to K (default T) shared ptr and drawn through drawFn
             template<typename T, typename K = T>
             void addDrawable(const T& drawable){
-                m_drawables.push_back(
-                    std::static_pointer_cast<Drawable>(
-                        std::make_shared<K>(drawable))
-                );
+                _storeDrawable(_copyDrawable<K>(drawable), m_commands.size());
             }
+            void addDrawable(const Figure& figure) { _storeFigure(figure, m_commands.size()); }
+            void addDrawable(const ImageFile& image) { _storeImage(image, m_commands.size()); }
+            //shared drawable stays shared, changes made through the pointer are drawn
             void addDrawable(std::shared_ptr<Drawable> drawable){
-                m_drawables.push_back(drawable);
+                _storeDrawable(drawable, m_commands.size());
             }
 
+            //commands without Drawable
+            void addRect(double x1, double y1, double x2, double y2, Color color);
+            void addTriangle(const Point2d& a, const Point2d& b, const Point2d& c, 
+                Color color, TriangleMode mode = TriangleMode::Scanline);
+            const std::vector<DrawCommand>& getCommands(void) const { return m_commands; }
+
+            //drawables copied by addDrawable are allocated from canvas arena, vertices past
+            //VertexStore inline capacity are not; drawables kept by getDrawable keep arena alive
+            //and clearDrawables then continues in a new arena
+            void setArenaScene(bool enabled);
+            bool getArenaScene(void) const { return m_arenaScene; }
+            const Arena* getArena(void) const { return m_arena.get(); }
+            //command list capacity and arena blocks are kept, O(1) for plain commands
+            void clearDrawables(void);
+
             void putPixel(png_uint_32 x, png_uint_32 y, Drawing::Color color);
             void setPixel(png_uint_32 x, png_uint_32 y, Drawing::Color color);
             
@@ -156,42 +962,472 @@ namespace Drawing {
             void fillsetPixels(png_uint_32 x1, png_uint_32 x2, 
                 png_uint_32 y1, png_uint_32 y2, Drawing::Color color);
 
+            //buffer is converted when switching between Legacy and premultiplied modes,
+            //PNG output is always straight alpha
+            void setBlendMode(BlendMode mode);
+            BlendMode getBlendMode(void) const { return m_blendMode; }
+            bool isPremultiplied(void) const { return m_blendMode != BlendMode::Legacy; }
+
+            //draw sourceRect of RGBA8 source at (x, y), clipped to source and clip rect
+            void blit(const FrameBuffer& source, const Rect& sourceRect, 
+                png_uint_32 x, png_uint_32 y, BlitMode mode = BlitMode::AlphaOver);
+            //shades rows of shader bounds inside clip rect, rows are split between 
+            //threads of draw when called on whole canvas
+            void drawShader(const SpanShader& shader);
+
 
+            //serial when thread count is 1, otherwise drawables are binned into tiles
+            //and tiles are drawn in parallel (same result as serial draw)
             void draw();
+
+            //threads used by draw, 0 = hardware threads
+            void setThreadCount(unsigned threads);
+            unsigned getThreadCount(void) const { return m_threadPool ? m_threadPool->getThreadsSize() : 1; }
+            void setThreadPool(std::shared_ptr<ThreadPool> threadPool) { m_threadPool = threadPool; }
+            void setTileSize(png_uint_32 tileSize) { m_tileSize = std::max(tileSize, 1u); }
+            png_uint_32 getTileSize(void) const { return m_tileSize; }
+
+            //rects and triangles hidden under later opaque ones are skipped by draw,
+            //output is unchanged (Legacy and Over blend modes, on by default)
+            void setOcclusionCulling(bool enabled) { m_occlusionCulling = enabled; }
+            bool getOcclusionCulling(void) const { return m_occlusionCulling; }
+            //commands skipped by last draw
+            size_t getCulledSize(void) const { return m_culledSize; }
         
-            double compare(Canvas &canvasB);
+            //rows are split between draw threads (see setThreadCount)
+            double compare(Canvas &canvasB, CompareMetric metric = CompareMetric::ChannelSum);
+            //mean squared error of every channel, in samples of pixel format (0...65535 for RGBA16)
+            void compareChannels(Canvas &canvasB, double mse[4]);
 
-            void bufferToFile(const char* filepath);
+            //rows are encoded one by one straight from buffer
+            void bufferToFile(const char* filepath, const PNGWriteOptions& options = PNGWriteOptions());
+            //encode PNG into out (cleared first), no temporary file
+            void bufferToMemory(std::vector<png_byte>& out, const PNGWriteOptions& options = PNGWriteOptions());
 
-            std::size_t getDrawablesSize(void) const { return m_drawables.size(); }
+            std::size_t getDrawablesSize(void) const { return m_commands.size(); }
             // Drawing::Drawable* getDrawable(const unsigned index) { return m_drawables[index].get(); }
 
-            std::shared_ptr<Drawable> getDrawable(const unsigned index) { 
-                return m_drawables[index];
-            }
+            //stored drawable, changes made through the pointer are drawn; a plain rect, triangle
+            //or image command is turned into a drawable drawn through drawFn on first access
+            std::shared_ptr<Drawable> getDrawable(const unsigned index);
+            //rects, triangles and images as detached copies (changes are drawn only after 
+            //setDrawable), plain commands stay plain; drawables drawn through drawFn are shared
+            std::shared_ptr<Drawable> copyDrawable(const unsigned index) const;
 
             //T Drawable to K (default T) shared ptr
             template<typename T, typename K = T>
             void setDrawable(const T& drawable, const unsigned index) {
-                m_drawables[index] = (
-                    std::static_pointer_cast<Drawable>(
-                        std::make_shared<K>(drawable))
-                );
+                assert(index < m_commands.size());
+                _storeDrawable(_copyDrawable<K>(drawable), index);
+            }
+            void setDrawable(const Figure& figure, const unsigned index) {
+                assert(index < m_commands.size());
+                _storeFigure(figure, index);
+            }
+            void setDrawable(const ImageFile& image, const unsigned index) {
+                assert(index < m_commands.size());
+                _storeImage(image, index);
             }
 
-            png_uint_32 getWidth(void) const { return png_get_image_width(m_pngPtr, m_infoPtr); }
-            png_uint_32 getHeight(void) const { return png_get_image_height(m_pngPtr, m_infoPtr); }
+            //area drawable may write to, false if unknown
+            bool getDrawableBounds(const unsigned index, Rect& bounds) const {
+                assert(index < m_commands.size());
+                return _getCommandBounds(m_commands[index], bounds);
+            }
+            //indices of drawables intersecting rect in draw order, drawables with unknown bounds
+            //always match; grid is built on first query and kept up to date by add/setDrawable
+            //(changes made through shared pointers are seen after setDrawable)
+            void queryDrawables(const Rect& rect, std::vector<unsigned>& indices);
+            //rect is filled with bgColor and only drawables touching it are drawn again, in order
+            //(same pixels inside rect as initBuffer and draw); redraw old and new bounds of 
+            //a drawable replaced by setDrawable instead of whole canvas
+            void redrawRegion(const Rect& rect, Color bgColor = Color(1.0, 1.0, 1.0, 1.0));
+
+            png_uint_32 getWidth(void) const { return m_width; }
+            png_uint_32 getHeight(void) const { return m_height; }
+            PNGHeader getPNGHeader(void) const;
+            PixelFormat getPixelFormat(void) const { return m_formatOps->format; }
 
         private:
-            std::vector<std::shared_ptr<Drawable>> m_drawables;
+            friend class CandidateEvaluator;
+            friend class TiledCanvas;
+
+            //view sharing pixels of canvas, used to draw one tile
+            Canvas(Canvas& canvas, const Rect& clip);
+            //view of [width x height] image where buffer holds only pixels of area
+            Canvas(FrameBuffer& buffer, png_uint_32 width, png_uint_32 height, const Rect& area);
+
+            png_bytep _getPixelPtr(png_uint_32 x, png_uint_32 y) {
+                return m_target->getRow(y-m_originY) + (size_t) (x-m_originX)*m_formatOps->pixelSize;
+            }
+            void _markWritten(png_uint_32 x1, png_uint_32 x2, png_uint_32 y1, png_uint_32 y2) {
+                if (m_dirtyTracking) _markDirty(x1, x2, y1, y2);
+                if (!m_snapshotTiles.empty()) m_snapshotWritten.mark(x1, x2, y1, y2);
+            }
+            void _markDirty(png_uint_32 x1, png_uint_32 x2, png_uint_32 y1, png_uint_32 y2) {
+                m_dirtyRegion.mark(x1, x2, y1, y2);
+                for (const std::shared_ptr<DirtyRegion>& reader : m_dirtyReaders) reader->mark(x1, x2, y1, y2);
+            }
+
+            std::vector<DrawCommand> m_commands;
+            std::shared_ptr<Arena> m_arena; //shared with copies of canvas and drawables allocated from it
+            bool m_arenaScene = false;
+            std::vector<std::shared_ptr<Drawable>> m_drawables; //owners of Image and Callback commands
             png_structp m_pngPtr = nullptr;
             png_infop m_infoPtr = nullptr;
-            png_bytep *m_rowBufferPtrs = nullptr;
+            png_uint_32 m_width = 0;
+            png_uint_32 m_height = 0;
+            FrameBuffer m_buffer;
+            FrameBuffer* m_target = &m_buffer; //m_buffer or buffer of viewed canvas
+            const PixelFormatOps* m_formatOps = &getPixelFormatOps(PixelFormat::RGBA8); //of PNG header
+            png_uint_32 m_originX = 0; //canvas position of m_target first pixel
+            png_uint_32 m_originY = 0;
+            FrameBufferPool* m_bufferPool = nullptr;
+            Rect m_clip;
+            BlendMode m_blendMode = BlendMode::Legacy;
+            DirtyRegion m_dirtyRegion;
+            std::vector<std::shared_ptr<DirtyRegion>> m_dirtyReaders; //not copied with canvas
+            bool m_dirtyTracking = false;
+            //tiles of last snapshot taken or restored, equal to buffer outside of written region
+            std::vector<std::shared_ptr<const FrameBuffer>> m_snapshotTiles;
+            png_uint_32 m_snapshotTileSize = 0;
+            DirtyRegion m_snapshotWritten;
+            std::shared_ptr<ThreadPool> m_threadPool;
+            png_uint_32 m_tileSize = 64;
+            std::vector<std::vector<unsigned>> m_tileBins;
+            std::vector<size_t> m_tiles; //non-empty bins
+            bool m_occlusionCulling = true;
+            std::vector<png_byte> m_culled; //per command, set by _cullCommands
+            std::vector<png_uint_32> m_opaqueTiles; //pass that covered tile, see _cullCommands
+            size_t m_culledSize = 0;
+            SpatialGrid m_spatialIndex; //of command bounds, see queryDrawables
+            bool m_spatialIndexValid = false;
+            std::vector<unsigned> m_regionCommands; //reused by redrawRegion
             void _copyConstructor(const Canvas& rhs);
+            void _swap(Canvas& rhs);
+            void _writtenTiles(png_uint_32 tileSize, std::vector<png_byte>& written) const;
+            template<typename K, typename T>
+            std::shared_ptr<Drawable> _copyDrawable(const T& drawable){
+                if (m_arenaScene)
+                    return std::allocate_shared<K>(ArenaAllocator<K>(m_arena), drawable);
+                countAllocation(AllocationKind::Drawable);
+                return std::make_shared<K>(drawable);
+            }
+            void _storeCommand(const DrawCommand& command, size_t index, std::shared_ptr<Drawable> owner = nullptr);
+            void _storeDrawable(std::shared_ptr<Drawable> drawable, size_t index);
+            void _storeFigure(const Figure& figure, size_t index);
+            void _storeImage(const ImageFile& image, size_t index);
+            bool _getCommandBounds(const DrawCommand& command, Rect& bounds) const;
+            void _drawCommand(const DrawCommand& command, Canvas* target);
+            void _drawTiles(size_t first, size_t last);
+            void _cullCommands(void);
+            std::function<png_const_bytep(png_uint_32 y)> _outputRows(std::vector<png_byte>& scratch) const;
+            void _compareSums(Canvas &canvasB, unsigned long long sums[3]);
+            double _compareSSIM(Canvas &canvasB);
+            void _blitRow(png_bytep dstRow, png_const_bytep srcRow, png_uint_32 width, BlitMode mode);
+            void _parallelRows(png_uint_32 height, 
+                const std::function<void(png_uint_32 y1, png_uint_32 y2)>& fn);
+    };
+
+    //canvas of pixel format fixed at compile time, e.g. Gray8 masks or RGB8 outputs
+    //(1/4 and 3/4 of RGBA8 memory)
+    template <PixelFormat Format>
+    class TypedCanvas : public Canvas {
+        public:
+            typedef PixelFormatTraits<Format> Traits;
+
+            TypedCanvas(void) {}
+            TypedCanvas(png_uint_32 width, png_uint_32 height,
+                int interlaceMethod = PNG_INTERLACE_NONE,
+                int compressMethod = PNG_COMPRESSION_TYPE_DEFAULT,
+                int filterMethod = PNG_FILTER_TYPE_DEFAULT)
+                : Canvas(width, height, Traits::bitDepth, Traits::colorType, 
+                    interlaceMethod, compressMethod, filterMethod) {}
+
+            void initImage(const png_uint_32 width, const png_uint_32 height, 
+                int interlaceMethod = PNG_INTERLACE_NONE,
+                int compressMethod = PNG_COMPRESSION_TYPE_DEFAULT,
+                int filterMethod = PNG_FILTER_TYPE_DEFAULT) {
+                Canvas::initImage(width, height, Traits::bitDepth, Traits::colorType, 
+                    interlaceMethod, compressMethod, filterMethod);
+            }
+    };
+    using CanvasRGBA8 = TypedCanvas<PixelFormat::RGBA8>;
+    using CanvasRGB8 = TypedCanvas<PixelFormat::RGB8>;
+    using CanvasGray8 = TypedCanvas<PixelFormat::Gray8>;
+    using CanvasRGBA16 = TypedCanvas<PixelFormat::RGBA16>;
+
+    //scores many candidate scenes against one target without keeping a canvas per candidate,
+    //every candidate is drawn band by band into a small buffer compared while still in cache
+    class CandidateEvaluator {
+        public:
+            using Scene = std::vector<std::shared_ptr<Drawable>>;
+
+            //target must outlive evaluator, candidates are drawn over bgColor
+            CandidateEvaluator(const Canvas& target, Color bgColor = Color(1.0, 1.0, 1.0, 1.0));
+
+            //same value as drawing scene on new canvas and calling canvas.compare(target)
+            double evaluate(const Scene& candidate);
+            //candidates are evaluated in parallel
+            std::vector<double> evaluate(const std::vector<Scene>& candidates);
+
+            //threads used by evaluate, 0 = hardware threads (default)
+            void setThreadCount(unsigned threads);
+            void setThreadPool(std::shared_ptr<ThreadPool> threadPool) { m_threadPool = threadPool; }
+            void setBandHeight(png_uint_32 bandHeight) { m_bandHeight = std::max(bandHeight, 1u); }
+
+        private:
+            double _evaluate(const Scene& candidate);
+
+            const Canvas& m_target;
+            std::vector<png_byte> m_bgRow;
+            std::vector<unsigned long long> m_targetRowSquares;
+            FrameBufferPool m_bandPool;
+            std::shared_ptr<ThreadPool> m_threadPool;
+            png_uint_32 m_bandHeight = 32;
+    };
+
+    //compare against fixed reference, partial sums are cached per row segment
+    //and only segments in canvas dirty region are rescanned
+    class IncrementalComparator {
+        public:
+            //reference must outlive comparator
+            IncrementalComparator(const Canvas& reference, png_uint_32 segmentWidth = 64);
+
+            //same value as canvas.compare(reference), rows written since previous call are
+            //read from own dirty reader of canvas (see Canvas::addDirtyReader); whole canvas 
+            //is rescanned on first call, for another canvas or when canvas has no dirty tracking
+            double compare(Canvas& canvas);
+            void invalidate(void) { m_canvas = nullptr; m_dirty.reset(); }
+
+        private:
+            struct SegmentSums {
+                unsigned long long sumSquareDiff;
+                unsigned long long sumSquare;
+            };
+            void _scanSegment(const Canvas& canvas, png_uint_32 y, png_uint_32 segment);
+
+            const Canvas& m_reference;
+            const Canvas* m_canvas = nullptr;
+            std::shared_ptr<DirtyRegion> m_dirty; //reader of m_canvas
+            png_uint_32 m_segmentWidth;
+            png_uint_32 m_segmentsPerRow = 0;
+            std::vector<SegmentSums> m_segments;
+            unsigned long long m_sumSquareDiff = 0;
+            unsigned long long m_sumSquare = 0;
+            unsigned long long m_referenceSumSquare = 0;
+    };
+
+    //levels of 2x2 box averages (rounded) of RGBA8 pixels, level 0 is half size of source,
+    //last odd row and column of every level are dropped
+    class ImagePyramid {
+        public:
+            //levels are fewer when size reaches 0, memory of previous build is reused
+            void build(const FrameBuffer& source, unsigned levels);
+            //recomputes only pixels covering rect of source
+            void update(const FrameBuffer& source, const Rect& rect);
+
+            size_t getLevelsSize(void) const { return m_levels.size(); }
+            const FrameBuffer& getLevel(size_t level) const { return m_levels[level]; }
+
+        private:
+            void _downsample(const FrameBuffer& source, FrameBuffer& level, const Rect& rect);
+
+            std::vector<FrameBuffer> m_levels;
+    };
+
+    //compare against fixed reference scoring coarsest pyramid level first: a candidate is 
+    //rejected as soon as a lower bound of its full resolution value reaches threshold;
+    //ChannelSum and MSE metrics
+    class PyramidComparator {
+        public:
+            //reference must outlive comparator, its pyramid is built once
+            PyramidComparator(const Canvas& reference, unsigned levels = 3, 
+                CompareMetric metric = CompareMetric::ChannelSum);
+
+            //canvas.compare(reference) when below threshold, otherwise that or a lower bound
+            //>= threshold; canvas pyramid is updated from own dirty reader of canvas, whole canvas 
+            //is used on first call, for another canvas or when canvas has no dirty tracking
+            double compare(Canvas& canvas, double threshold = std::numeric_limits<double>::infinity());
+            void invalidate(void) { m_canvas = nullptr; m_dirty.reset(); }
+            //level that rejected last compare, -1 when compared at full resolution
+            int getRejectLevel(void) const { return m_rejectLevel; }
+
+        private:
+            double _levelBound(size_t level) const;
+
+            const Canvas& m_reference;
+            const Canvas* m_canvas = nullptr;
+            std::shared_ptr<DirtyRegion> m_dirty; //reader of m_canvas
+            CompareMetric m_metric;
+            unsigned m_levels;
+            ImagePyramid m_referencePyramid;
+            ImagePyramid m_canvasPyramid;
+            double m_referenceNorm = 0.0; //sqrt of sum of squared channel sums
+            int m_rejectLevel = -1;
+    };
+
+    //encodes snapshots of canvas on background threads and writes files in submission order
+    class AsyncExporter {
+        public:
+            //encoders = 0 uses hardware threads, maxQueued caps frames held in memory
+            AsyncExporter(unsigned encoders = 0, size_t maxQueued = 4, 
+                PNGWriteOptions options = PNGWriteOptions());
+            AsyncExporter(const AsyncExporter&) = delete;
+            AsyncExporter& operator=(const AsyncExporter&) = delete;
+            ~AsyncExporter(); //flushes
+
+            //copies canvas pixels, blocks while maxQueued frames are not written yet
+            void submit(const Canvas& canvas, const std::string& filepath);
+            //waits until every submitted frame is written
+            void flush(void);
+
+        private:
+            struct Job {
+                std::string filepath;
+                PNGHeader header;
+                FrameBuffer pixels;
+                std::vector<png_byte> encoded;
+                bool isEncoded = false;
+            };
+
+            void _encoderLoop(void);
+            void _writerLoop(void);
+
+            PNGWriteOptions m_options;
+            size_t m_maxQueued;
+            FrameBufferPool m_bufferPool;
+            std::mutex m_mutex;
+            std::condition_variable m_encodeCv;
+            std::condition_variable m_writeCv;
+            std::condition_variable m_doneCv;
+            std::deque<std::unique_ptr<Job>> m_jobs; //not written yet, in submission order
+            std::deque<Job*> m_pending; //not encoded yet
+            size_t m_unwritten = 0;
+            bool m_stop = false;
+            std::vector<std::thread> m_encoders;
+            std::thread m_writer;
+    };
+
+    //image larger than memory, tiles are kept in an LRU pool of at most memoryLimit bytes
+    //and evicted tiles are kept in a memory-mapped scratch file; drawing is deferred
+    //until tiles are used, so draw followed by bufferToFile renders band by band
+    class TiledCanvas {
+        public:
+            TiledCanvas(png_uint_32 width, png_uint_32 height, 
+                png_uint_32 tileSize = 256, size_t memoryLimit = 256 << 20);
+            TiledCanvas(const TiledCanvas&) = delete;
+            TiledCanvas& operator=(const TiledCanvas&) = delete;
+            ~TiledCanvas();
+
+            //directory of scratch file (unlinked right after creation), default TMPDIR or /tmp
+            void setScratchDirectory(const std::string& directory) { m_scratchDirectory = directory; }
+            //O(1), tiles are filled when first used
+            void initBuffer(Color bgColor = Color(1.0, 1.0, 1.0, 1.0));
+            void setBlendMode(BlendMode mode);
+            BlendMode getBlendMode(void) const { return m_blendMode; }
+
+            //same recording as Canvas, clearDrawables draws pending tiles first
+            template<typename T, typename K = T>
+            void addDrawable(const T& drawable){
+                m_scene.addDrawable<T, K>(drawable);
+            }
+            void addDrawable(std::shared_ptr<Drawable> drawable){
+                m_scene.addDrawable(drawable);
+            }
+            void addRect(double x1, double y1, double x2, double y2, Color color){
+                m_scene.addRect(x1, y1, x2, y2, color);
+            }
+            void addTriangle(const Point2d& a, const Point2d& b, const Point2d& c, 
+                Color color, TriangleMode mode = TriangleMode::Scanline){
+                m_scene.addTriangle(a, b, c, color, mode);
+            }
+            void clearDrawables(void){
+                _flushPending();
+                m_scene.clearDrawables();
+                m_binnedCommands = 0;
+            }
+            std::size_t getDrawablesSize(void) const { return m_scene.getDrawablesSize(); }
+
+            //drawables added since previous draw (whole scene after initBuffer or drawToFile) 
+            //are binned by bounds, without bounds they are drawn on every tile
+            void draw(void);
+            //tiles of a band are drawn in parallel when the band fits in memory limit
+            //and every pending drawable has bounds
+            void setThreadPool(std::shared_ptr<ThreadPool> threadPool) { m_threadPool = threadPool; }
+
+            //rows are assembled from tiles one at a time, straight alpha,
+            //memory limit should hold a band of tiles (width/tileSize tiles)
+            void bufferToFile(const char* filepath, const PNGWriteOptions& options = PNGWriteOptions());
+            //draw and bufferToFile, tiles are dropped once their band is written so nothing spills,
+            //canvas is left at background color (interlaced output keeps tiles)
+            void drawToFile(const char* filepath, const PNGWriteOptions& options = PNGWriteOptions());
+            //stored (premultiplied unless Legacy) pixels of row y
+            void readRow(png_uint_32 y, png_bytep out);
+
+            png_uint_32 getWidth(void) const { return m_width; }
+            png_uint_32 getHeight(void) const { return m_height; }
+            png_uint_32 getTileSize(void) const { return m_tileSize; }
+            size_t getMemoryLimit(void) const { return m_maxResident*m_tileBytes; }
+            size_t getResidentTiles(void) const { return m_lru.size(); }
+            size_t getTileSpills(void) const { return m_spills; }
+            size_t getTileLoads(void) const { return m_loads; }
+            PNGHeader getPNGHeader(void) const;
+
+        private:
+            struct Tile {
+                int slot = -1; //index of resident buffer
+                bool spilled = false; //content in scratch file
+                bool dirty = false; //resident content newer than scratch file
+                bool pending = false; //commands in bin not drawn yet
+                std::list<unsigned>::iterator lru;
+            };
+
+            Rect _tileRect(unsigned tile) const;
+            FrameBuffer& _acquireTile(unsigned tile, bool render = true);
+            void _evictTile(unsigned tile, bool keep = true);
+            void _renderTile(unsigned tile, FrameBuffer& buffer);
+            void _prepareBand(png_uint_32 band);
+            void _flushPending(void);
+            png_bytep _scratchTile(unsigned tile);
+            void _writeRows(png_structp filePtr, const PNGWriteOptions& options, bool dropBands);
+
+            png_uint_32 m_width;
+            png_uint_32 m_height;
+            png_uint_32 m_tileSize;
+            png_uint_32 m_tilesX;
+            png_uint_32 m_tilesY;
+            size_t m_tileBytes;
+            size_t m_maxResident;
+            Color m_bgColor = Color(1.0, 1.0, 1.0, 1.0);
+            BlendMode m_blendMode = BlendMode::Legacy;
+
+            Canvas m_scene; //commands only, no pixels
+            std::vector<std::vector<unsigned>> m_bins;
+            size_t m_binnedCommands = 0; //commands before it are in bins or drawn
+            size_t m_pendingTiles = 0;
+            bool m_pendingUnbounded = false;
+
+            std::vector<Tile> m_tiles;
+            std::vector<FrameBuffer> m_slots;
+            std::vector<int> m_freeSlots;
+            std::list<unsigned> m_lru; //resident tiles, most recently used first
+            size_t m_spills = 0;
+            size_t m_loads = 0;
+
+            std::string m_scratchDirectory;
+            int m_scratchFd = -1;
+            png_bytep m_scratch = nullptr;
+            size_t m_scratchSize = 0;
+            std::shared_ptr<ThreadPool> m_threadPool;
     };
 
     #if DEFAULT_DRAWING_FUNCS
     void rect_filled(Drawing::Drawable *drawable, Drawing::Canvas* canvas);
     void triangle_filled(Drawing::Drawable *drawable, Drawing::Canvas* canvas);
+    //fixed-point edge functions, top-left fill rule, shared edges are drawn once
+    void triangle_edge(Drawing::Drawable *drawable, Drawing::Canvas* canvas);
+    //as triangle_edge, 4x4 samples per pixel scale alpha by coverage
+    void triangle_edge_aa(Drawing::Drawable *drawable, Drawing::Canvas* canvas);
     #endif
 }
\ No newline at end of file